@@ -1,3 +1,6 @@
+#if defined(WIN32) && !defined(_WIN32_WINNT)
+#define _WIN32_WINNT 0x0600   // for CONDITION_VARIABLE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -117,8 +120,37 @@ void closeSerialPort(HANDLE hSerial)
     CloseHandle(hSerial);
 }
 
+// Returns what has arrived, waiting up to timeout_ms for the first byte. The
+// timeouts of openSerialPort() would wait for a full buffer instead, so they are
+// replaced for this call.
+DWORD readSomeFromSerialPort(HANDLE hSerial, uint8_t * buffer, int buffersize, int timeout_ms)
+{
+    COMMTIMEOUTS saved, timeouts;
+    if (!GetCommTimeouts(hSerial, &saved)) {
+        ErrorExit("GetCommTimeouts");
+    }
+    timeouts = saved;
+    timeouts.ReadIntervalTimeout = MAXDWORD;
+    timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+    timeouts.ReadTotalTimeoutConstant = timeout_ms > 0 ? timeout_ms : 1;
+    if (!SetCommTimeouts(hSerial, &timeouts)) {
+        ErrorExit("SetCommTimeouts");
+    }
+    DWORD n = readFromSerialPort(hSerial, buffer, buffersize);
+    if (!SetCommTimeouts(hSerial, &saved)) {
+        ErrorExit("SetCommTimeouts");
+    }
+    return n;
+}
+
+void flushSerialPort(HANDLE hSerial)
+{
+    PurgeComm(hSerial, PURGE_RXCLEAR);
+}
+
 #else               // }{
 
+#include <poll.h>
 #include <termios.h>
 
 int openSerialPort(const char *portname)
@@ -175,6 +207,25 @@ int readFromSerialPort(int fd, uint8_t *b, size_t s)
   return s;
 }
 
+// Reads whatever has arrived, up to s bytes. Waits at most timeout_ms for the
+// first byte. Returns 0 on timeout, -1 on error.
+int readSomeFromSerialPort(int fd, uint8_t *b, size_t s, int timeout_ms)
+{
+  struct pollfd pfd = {fd, POLLIN, 0};
+  int n = poll(&pfd, 1, timeout_ms);
+  if (n <= 0)
+    return (n < 0 && errno == EINTR) ? 0 : n;
+  n = read(fd, b, s);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN))
+    return 0;
+  return n;
+}
+
+void flushSerialPort(int fd)
+{
+  tcflush(fd, TCIFLUSH);
+}
+
 int writeToSerialPort(int fd, const uint8_t *b, size_t s)
 {
 #ifdef VERBOSE
@@ -245,6 +296,7 @@ void i2c_connect(I2CDriver *sd, const char* portname)
   int i;
 
   sd->connected = 0;
+  sd->capture = NULL;
   sd->port = openSerialPort(portname);
 #if !defined(WIN32)
   if (sd->port == -1)
@@ -369,54 +421,378 @@ void i2c_monitor(I2CDriver *sd, int enable)
   charCommand(sd, enable ? 'm' : '@');
 }
 
-void i2c_capture(I2CDriver *sd)
+// ******************************  Threads  ***********************************
+
+#if defined(WIN32)
+typedef HANDLE thread_t;
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+#define THREAD_FUNC(name, arg) DWORD WINAPI name(LPVOID arg)
+#define THREAD_RETURN return 0
+
+static int thread_create(thread_t *t, LPTHREAD_START_ROUTINE f, void *arg)
 {
-  printf("Capture started\n");
-  charCommand(sd, 'c');
-  uint8_t bytes[1];
+  *t = CreateThread(NULL, 0, f, arg, 0, NULL);
+  return (*t == NULL) ? -1 : 0;
+}
+static void thread_join(thread_t t)  { WaitForSingleObject(t, INFINITE); CloseHandle(t); }
+static void mutex_init(mutex_t *m)   { InitializeCriticalSection(m); }
+static void mutex_destroy(mutex_t *m) { DeleteCriticalSection(m); }
+static void mutex_lock(mutex_t *m)   { EnterCriticalSection(m); }
+static void mutex_unlock(mutex_t *m) { LeaveCriticalSection(m); }
+static void cond_init(cond_t *c)     { InitializeConditionVariable(c); }
+static void cond_destroy(cond_t *c)  { }
+static void cond_wait(cond_t *c, mutex_t *m) { SleepConditionVariableCS(c, m, INFINITE); }
+static void cond_signal(cond_t *c)   { WakeConditionVariable(c); }
+static void sleep_ms(int ms)         { Sleep(ms); }
+#else
+#include <pthread.h>
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+#define THREAD_FUNC(name, arg) void *name(void *arg)
+#define THREAD_RETURN return NULL
+
+static int thread_create(thread_t *t, void *(*f)(void *), void *arg) { return pthread_create(t, NULL, f, arg); }
+static void thread_join(thread_t t)  { pthread_join(t, NULL); }
+static void mutex_init(mutex_t *m)   { pthread_mutex_init(m, NULL); }
+static void mutex_destroy(mutex_t *m) { pthread_mutex_destroy(m); }
+static void mutex_lock(mutex_t *m)   { pthread_mutex_lock(m); }
+static void mutex_unlock(mutex_t *m) { pthread_mutex_unlock(m); }
+static void cond_init(cond_t *c)     { pthread_cond_init(c, NULL); }
+static void cond_destroy(cond_t *c)  { pthread_cond_destroy(c); }
+static void cond_wait(cond_t *c, mutex_t *m) { pthread_cond_wait(c, m); }
+static void cond_signal(cond_t *c)   { pthread_cond_signal(c); }
+static void sleep_ms(int ms)         { usleep(ms * 1000); }
+#endif
+
+// ******************************  Capture  ***********************************
+
+// The capture stream is read by a reader thread into a ring of buffers and
+// decoded by a delivery thread, which calls the callback. If the callback does
+// not keep up and the ring is full, the reader keeps reading so the serial
+// port can't overrun, and drops the data. The amount is passed to the callback
+// with the next batch.
+
+#define CAPTURE_BUFFERS 16
+
+struct I2CCapture {
+  I2CDriver *sd;
+  i2c_capture_callback callback;
+  void *user;
+  size_t bufsize;
+  uint8_t *raw;                     // CAPTURE_BUFFERS buffers of bufsize bytes
+  size_t len[CAPTURE_BUFFERS];
+  uint64_t lost[CAPTURE_BUFFERS];   // bytes dropped before each buffer
+  unsigned head, tail;              // buffers filled, delivered
+  volatile int stopping;            // set by i2c_capture_stop()
+  int reader_done;
+  uint64_t dropped;                 // total bytes dropped
+  I2CCaptureEvent *events;
+  mutex_t mutex;
+  cond_t cond;
+  thread_t reader, delivery;
+
+  I2CCaptureDecoder decoder;
+};
+
+// Resets d to the state at the start of a capture.
+void i2c_capture_decoder_init(I2CCaptureDecoder *d)
+{
+  d->starting = 1;
+  d->nbits = 0;
+  d->bits = 0;
+  d->addr = 0xff;
+}
+
+// Decodes 1 token of the capture stream into ev[]. Returns the number of
+// events, at most 2.
+static int capture_token(I2CCaptureDecoder *d, int symbol, I2CCaptureEvent ev[2])
+{
+  int count = 0;
+
+  if (symbol < 8 && d->nbits > 0) {
+    I2CCaptureEvent e = {I2C_CAPTURE_ERROR, (uint8_t)d->bits, 0, (uint8_t)d->nbits};
+    ev[count++] = e;
+    d->nbits = 0;
+    d->bits = 0;
+    d->starting = 1;
+  }
+  if (symbol >= 8) {
+    d->bits = (d->bits << 3) | (symbol & 7);
+    d->nbits += 3;
+    if (d->nbits == 9) {
+      I2CCaptureEvent e = {I2C_CAPTURE_DATA, (uint8_t)(d->bits >> 1), (uint8_t)!(d->bits & 1), 0};
+      if (d->starting)
+        e.type = I2C_CAPTURE_ADDR;
+      ev[count++] = e;
+      d->starting = 0;
+      d->nbits = 0;
+      d->bits = 0;
+    }
+  } else if (symbol == 1 || symbol == 2) {
+    I2CCaptureEvent e = {(uint8_t)(symbol == 1 ? I2C_CAPTURE_START : I2C_CAPTURE_STOP), 0, 0, 0};
+    ev[count++] = e;
+    d->starting = 1;
+  } else if (symbol != 0) {
+    I2CCaptureEvent e = {I2C_CAPTURE_ERROR, (uint8_t)symbol, 0, 0};
+    ev[count++] = e;
+  }
+  return count;
+}
 
-  int starting = 0;
-  int nbits = 0, bits = 0;
-  while (1) {
-    int i;
-    readFromSerialPort(sd->port, bytes, 1);
+// Decodes n bytes of capture stream into ev[], which needs room for
+// I2C_CAPTURE_EVENTS_PER_BYTE * n events. Returns the number of events.
+size_t i2c_capture_decode(I2CCaptureDecoder *d, const uint8_t *data, size_t n, I2CCaptureEvent *ev)
+{
+  size_t count = 0;
+  size_t k;
+
+  for (k = 0; k < n; k++) {
+    count += capture_token(d, data[k] >> 4, ev + count);
+    count += capture_token(d, data[k] & 0xf, ev + count);
+  }
+  return count;
+}
+
+// Decodes n bytes of capture stream that were received between t0_ns and
+// t1_ns into the columns of cols, so that large captures can be analyzed
+// without an object per event. The bytes are taken to have arrived evenly
+// spread over that time. Decoding stops early if the columns could overflow.
+// If consumed is not NULL, it receives the number of bytes decoded, so that
+// the rest can be passed in again with new columns. Returns the number of
+// events.
+size_t i2c_capture_decode_columns(I2CCaptureDecoder *d, const uint8_t *data, size_t n,
+                                  uint64_t t0_ns, uint64_t t1_ns, I2CCaptureColumns *cols, size_t *consumed)
+{
+  size_t count = 0;
+  size_t k;
+  int i, j;
+
+  for (k = 0; k < n && count + I2C_CAPTURE_EVENTS_PER_BYTE <= cols->capacity; k++) {
+    uint64_t ts = t0_ns + (t1_ns > t0_ns ? (t1_ns - t0_ns) * k / n : 0);
     for (i = 0; i < 2; i++) {
-      int symbol = (i == 0) ? (bytes[0] >> 4) : (bytes[0] & 0xf);
-      switch (symbol) {
-        case 0:
-          break;
-        case 1:
-          starting = 1;
-          break;
-        case 2:
-          printf("STOP\n");
-          starting = 1;
-          break;
-        case 8:
-        case 9:
-        case 10:
-        case 11:
-        case 12:
-        case 13:
-        case 14:
-        case 15:
-          bits = (bits << 3) | (symbol & 7);
-          nbits += 3;
-          if (nbits == 9) {
-            int b8 = (bits >> 1), ack = !(bits & 1);
-            if (starting) {
-              starting = 0;
-              printf("START %02x %s", b8 >> 1, (b8 & 1) ? "READ" : "WRITE");
-            } else {
-              printf("BYTE %02x", b8);
-            }
-            printf(" %s\n", ack ? "ACK" : "NAK");
-            nbits = 0;
-            bits = 0;
-          }
+      I2CCaptureEvent ev[2];
+      int m = capture_token(d, i == 0 ? data[k] >> 4 : data[k] & 0xf, ev);
+      for (j = 0; j < m; j++) {
+        if (ev[j].type == I2C_CAPTURE_START)
+          d->addr = 0xff;
+        else if (ev[j].type == I2C_CAPTURE_ADDR)
+          d->addr = ev[j].value >> 1;
+        cols->ts_ns[count] = ts;
+        cols->type[count] = ev[j].type;
+        cols->addr[count] = d->addr;
+        cols->value[count] = ev[j].value;
+        cols->ack[count] = ev[j].ack;
+        count++;
+        if (ev[j].type == I2C_CAPTURE_STOP || (ev[j].type == I2C_CAPTURE_ERROR && ev[j].bits != 0))
+          d->addr = 0xff;
       }
     }
   }
+  if (consumed != NULL)
+    *consumed = k;
+  return count;
+}
+
+static THREAD_FUNC(capture_reader, arg)
+{
+  struct I2CCapture *c = (struct I2CCapture *)arg;
+  uint8_t *scratch = (uint8_t *)malloc(c->bufsize);
+  uint64_t lost = 0;
+
+  while (!c->stopping) {
+    mutex_lock(&c->mutex);
+    int full = (c->head - c->tail == CAPTURE_BUFFERS);
+    mutex_unlock(&c->mutex);
+
+    // The delivery thread doesn't touch buffer head until it is published.
+    uint8_t *buf = full ? scratch : c->raw + (c->head % CAPTURE_BUFFERS) * c->bufsize;
+    int n = readSomeFromSerialPort(c->sd->port, buf, c->bufsize, 100);
+    if (n < 0)
+      break;
+    if (n == 0)
+      continue;
+    if (full) {
+      lost += n;
+      continue;
+    }
+    mutex_lock(&c->mutex);
+    c->len[c->head % CAPTURE_BUFFERS] = n;
+    c->lost[c->head % CAPTURE_BUFFERS] = lost;
+    c->dropped += lost;
+    c->head++;
+    cond_signal(&c->cond);
+    mutex_unlock(&c->mutex);
+    lost = 0;
+  }
+
+  mutex_lock(&c->mutex);
+  c->dropped += lost;
+  c->reader_done = 1;
+  cond_signal(&c->cond);
+  mutex_unlock(&c->mutex);
+  free(scratch);
+  THREAD_RETURN;
+}
+
+static THREAD_FUNC(capture_delivery, arg)
+{
+  struct I2CCapture *c = (struct I2CCapture *)arg;
+
+  for (;;) {
+    mutex_lock(&c->mutex);
+    while (c->head == c->tail && !c->reader_done)
+      cond_wait(&c->cond, &c->mutex);
+    if (c->head == c->tail) {
+      mutex_unlock(&c->mutex);
+      break;
+    }
+    unsigned i = c->tail % CAPTURE_BUFFERS;
+    mutex_unlock(&c->mutex);
+
+    // A partial byte from before lost data must not be joined with bits after it.
+    if (c->lost[i] != 0)
+      i2c_capture_decoder_init(&c->decoder);
+    size_t n = i2c_capture_decode(&c->decoder, c->raw + i * c->bufsize, c->len[i], c->events);
+    if (n > 0 || c->lost[i] > 0)
+      c->callback(c->user, c->events, n, c->lost[i]);
+
+    mutex_lock(&c->mutex);
+    c->tail++;
+    mutex_unlock(&c->mutex);
+  }
+  THREAD_RETURN;
+}
+
+static void capture_free(struct I2CCapture *c)
+{
+  mutex_destroy(&c->mutex);
+  cond_destroy(&c->cond);
+  free(c->raw);
+  free(c->events);
+  free(c);
+}
+
+// Switches the I2CDriver back to I2C mode and discards the rest of the capture stream.
+static void capture_exit(I2CDriver *sd)
+{
+  charCommand(sd, '@');
+  sleep_ms(10);
+  flushSerialPort(sd->port);
+}
+
+// Switches the I2CDriver to capture mode and calls callback with batches of
+// decoded events from a separate thread until i2c_capture_stop() is called.
+// bufsize is the number of bytes of capture stream read at once (0 for a
+// default of 4096). Returns 0 on success, -1 on failure.
+int i2c_capture_start(I2CDriver *sd, i2c_capture_callback callback, void *user, size_t bufsize)
+{
+  if (sd->capture != NULL)
+    return -1;
+  if (bufsize == 0)
+    bufsize = 4096;
+
+  struct I2CCapture *c = (struct I2CCapture *)calloc(1, sizeof(struct I2CCapture));
+  if (c == NULL)
+    return -1;
+  c->sd = sd;
+  c->callback = callback;
+  c->user = user;
+  c->bufsize = bufsize;
+  i2c_capture_decoder_init(&c->decoder);
+  mutex_init(&c->mutex);
+  cond_init(&c->cond);
+  c->raw = (uint8_t *)malloc(CAPTURE_BUFFERS * bufsize);
+  c->events = (I2CCaptureEvent *)malloc(I2C_CAPTURE_EVENTS_PER_BYTE * bufsize * sizeof(I2CCaptureEvent));
+  if (c->raw == NULL || c->events == NULL) {
+    capture_free(c);
+    return -1;
+  }
+
+  charCommand(sd, 'c');
+  if (thread_create(&c->delivery, capture_delivery, c) != 0) {
+    capture_exit(sd);
+    capture_free(c);
+    return -1;
+  }
+  if (thread_create(&c->reader, capture_reader, c) != 0) {
+    mutex_lock(&c->mutex);
+    c->reader_done = 1;
+    cond_signal(&c->cond);
+    mutex_unlock(&c->mutex);
+    thread_join(c->delivery);
+    capture_exit(sd);
+    capture_free(c);
+    return -1;
+  }
+  sd->capture = c;
+  return 0;
+}
+
+// Stops a capture started with i2c_capture_start(). All data read so far is
+// passed to the callback before this returns. The I2CDriver is switched back
+// to I2C mode. Returns the total number of bytes of capture stream dropped.
+uint64_t i2c_capture_stop(I2CDriver *sd)
+{
+  struct I2CCapture *c = sd->capture;
+  if (c == NULL)
+    return 0;
+
+  c->stopping = 1;
+  thread_join(c->reader);
+  thread_join(c->delivery);
+  capture_exit(sd);
+
+  uint64_t dropped = c->dropped;
+  capture_free(c);
+  sd->capture = NULL;
+  return dropped;
+}
+
+static void print_capture(void *user, const I2CCaptureEvent events[], size_t n, uint64_t lost)
+{
+  size_t i;
+
+  if (lost)
+    printf("[%" PRIu64 " bytes lost]\n", lost);
+  for (i = 0; i < n; i++) {
+    const I2CCaptureEvent *e = &events[i];
+    switch (e->type) {
+      case I2C_CAPTURE_STOP:
+        printf("STOP\n");
+        break;
+      case I2C_CAPTURE_ADDR:
+        printf("START %02x %s %s\n", e->value >> 1, (e->value & 1) ? "READ" : "WRITE", e->ack ? "ACK" : "NAK");
+        break;
+      case I2C_CAPTURE_DATA:
+        printf("BYTE %02x %s\n", e->value, e->ack ? "ACK" : "NAK");
+        break;
+      case I2C_CAPTURE_ERROR:
+        if (e->bits)
+          printf("ERROR %d bits %x\n", e->bits, e->value);
+        else
+          printf("ERROR token %x\n", e->value);
+        break;
+    }
+  }
+  fflush(stdout);
+}
+
+void i2c_capture(I2CDriver *sd)
+{
+  char line[100];
+
+  if (i2c_capture_start(sd, print_capture, NULL, 0) != 0) {
+    fprintf(stderr, "Capture failed\n");
+    return;
+  }
+  printf("Capture started\n");
+  printf("[Hit return to exit capture mode]\n");
+  if (fgets(line, sizeof(line) - 1, stdin)){};
+  uint64_t dropped = i2c_capture_stop(sd);
+  if (dropped)
+    fprintf(stderr, "%" PRIu64 " bytes of capture data dropped\n", dropped);
 }
 
 int i2c_commands(I2CDriver *sd, int argc, char *argv[])
@@ -550,7 +926,7 @@ int i2c_commands(I2CDriver *sd, int argc, char *argv[])
       fprintf(stderr, "  p              send a STOP\n");
       fprintf(stderr, "  r dev N        read N bytes from I2C device dev, then STOP\n");
       fprintf(stderr, "  m              enter I2C bus monitor mode\n");
-      fprintf(stderr, "  c              enter I2C bus capture mode\n");
+      fprintf(stderr, "  c              capture I2C bus events until return is hit\n");
       fprintf(stderr, "\n");
 
       return 1;
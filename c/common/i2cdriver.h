@@ -3,12 +3,16 @@
 
 #include <stdint.h>
 
+#include <stddef.h>
+
 #if defined(WIN32)
 #include <windows.h>
 #else
 #define HANDLE int
 #endif
 
+struct I2CCapture;
+
 typedef struct {
   int connected;          // Set to 1 when connected
   HANDLE port;
@@ -26,8 +30,50 @@ typedef struct {
   unsigned int
             ccitt_crc,    // Hardware CCITT CRC
             e_ccitt_crc;  // Host CCITT CRC, should match
+  struct I2CCapture *capture; // running capture, see i2c_capture_start()
 } I2CDriver;
 
+// Event decoded from the capture stream
+enum {
+  I2C_CAPTURE_START,
+  I2C_CAPTURE_STOP,
+  I2C_CAPTURE_ADDR,       // value is the address byte incl. R/W bit
+  I2C_CAPTURE_DATA,       // value is the data byte
+  I2C_CAPTURE_ERROR       // value is an undocumented token, or the bits of a partial byte
+};
+
+typedef struct {
+  uint8_t type;           // I2C_CAPTURE_...
+  uint8_t value;
+  uint8_t ack;            // ADDR, DATA: 1 if the byte was ACKed
+  uint8_t bits;           // ERROR: number of bits of a partial byte, 0 for an undocumented token
+} I2CCaptureEvent;
+
+// State of a capture stream decoder, see i2c_capture_decoder_init()
+typedef struct {
+  int starting;           // next byte is an address
+  int nbits, bits;        // partial byte
+  uint8_t addr;           // address of the current message, 0xff if none
+} I2CCaptureDecoder;
+
+// Caller-provided arrays that i2c_capture_decode_columns() fills with 1 entry
+// per event (struct of arrays), each with room for capacity entries
+typedef struct {
+  uint64_t *ts_ns;        // time of the event, interpolated over the data
+  uint8_t *type;          // I2C_CAPTURE_...
+  uint8_t *addr;          // 7 bit address of the message the event belongs to, 0xff if none
+  uint8_t *value;         // as in I2CCaptureEvent
+  uint8_t *ack;           // as in I2CCaptureEvent
+  size_t capacity;
+} I2CCaptureColumns;
+
+// Maximum number of events decoded from 1 byte of capture stream
+#define I2C_CAPTURE_EVENTS_PER_BYTE 4
+
+// Receives n events. lost is the number of bytes of capture stream that had to
+// be dropped before these events, because the callback did not keep up.
+typedef void (*i2c_capture_callback)(void *user, const I2CCaptureEvent events[], size_t n, uint64_t lost);
+
 void i2c_connect(I2CDriver *sd, const char* portname);
 void i2c_getstatus(I2CDriver *sd);
 int  i2c_write(I2CDriver *sd, const uint8_t bytes[], size_t nn);
@@ -37,6 +83,13 @@ void i2c_stop(I2CDriver *sd);
 
 void i2c_monitor(I2CDriver *sd, int enable);
 void i2c_capture(I2CDriver *sd);
+int  i2c_capture_start(I2CDriver *sd, i2c_capture_callback callback, void *user, size_t bufsize);
+uint64_t i2c_capture_stop(I2CDriver *sd);
+
+void i2c_capture_decoder_init(I2CCaptureDecoder *d);
+size_t i2c_capture_decode(I2CCaptureDecoder *d, const uint8_t *data, size_t n, I2CCaptureEvent *ev);
+size_t i2c_capture_decode_columns(I2CCaptureDecoder *d, const uint8_t *data, size_t n,
+                                  uint64_t t0_ns, uint64_t t1_ns, I2CCaptureColumns *cols, size_t *consumed);
 
 int i2c_commands(I2CDriver *sd, int argc, char *argv[]);
 
@@ -0,0 +1,218 @@
+/*   Copyright (C) 2022  Matthias S. Benkmann
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+// Measures the throughput of the capture decoder in MB/s of raw capture stream
+// and compares it with the nibble-by-nibble decoder that --capture used before.
+// Both decoders are fed the same synthetic stream and their output must match.
+//
+// Usage: bench_capture [<megabytes>] [<idle percent>]
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "capture.h"
+
+uint64_t micros()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+Color color;
+
+// The decoder used by --capture up to now, writing to out instead of stdout.
+void legacyDecodeCapture(uint8_t data, FILE* out)
+{
+    const char* ACKNACK[2] = {color.ACK, color.NACK};
+    const char acknack[2] = {'.', '\''};
+    static int count = 0;
+    static unsigned cur = 0;
+    static bool inData = false;
+
+    for (int i = 4; i >= 0; i -= 4)
+    {
+        uint8_t b = (data >> i) & 0xF;
+
+        bool idle = (count == 0);
+
+        if (count > 0 && b < 8)
+        { // premature flush
+            fprintf(out, "%s%2X/%d%s\n", color.ERR, cur, count * 3, color.DEFAULT);
+            cur = 0;
+            count = 0;
+            inData = false;
+        }
+
+        if (b >= 8)
+        {
+            cur = (cur << 3) | (b - 8);
+            if (++count == 3)
+            { // 3 triplets => 1 byte done
+                int ack = cur & 1;
+                cur >>= 1;
+                if (!inData)
+                { // byte is address
+                    char rw = (cur & 1) == 0 ? 'W' : 'R';
+                    cur >>= 1;
+                    fprintf(out, "%s%c%s", color.RW, rw, color.ADDR);
+                }
+                else
+                    fprintf(out, "%s", color.DATA);
+
+                fprintf(out, "%02X%s%s%c%s", cur, color.DEFAULT, ACKNACK[ack], acknack[ack], color.DEFAULT);
+
+                cur = 0;
+                count = 0;
+                inData = true;
+            }
+        }
+        else if (b == 0) // Bus IDLE
+        {
+            if (!idle)
+                fprintf(out, "\n");
+            inData = false;
+        }
+        else if (b == 2) // STOP
+        {
+            fprintf(out, "%sP%s\n", color.STOP, color.DEFAULT);
+            inData = false;
+        }
+        else if (b == 1) // START
+        {
+            fprintf(out, "%sS%s", color.START, color.DEFAULT);
+            inData = false;
+        }
+        else if (b >= 3 && b < 8) // undocumented code
+        {
+            fprintf(out, "%s%x%s ", color.ERR, b, color.DEFAULT);
+        }
+    }
+}
+
+// Appends tokens to a stream of nibbles.
+struct Tokens
+{
+    uint8_t* buf;
+    size_t size;
+    size_t nibbles = 0;
+
+    bool full() { return nibbles / 2 + 8 >= size; }
+
+    void add(uint8_t t)
+    {
+        if (nibbles & 1)
+            buf[nibbles / 2] |= t;
+        else
+            buf[nibbles / 2] = t << 4;
+        nibbles++;
+    }
+
+    void addByte(uint8_t b, int nak)
+    {
+        unsigned bits = (b << 1) | nak;
+        add(8 + ((bits >> 6) & 7));
+        add(8 + ((bits >> 3) & 7));
+        add(8 + (bits & 7));
+    }
+};
+
+// Fills buf with random transactions, separated by runs of idle tokens that make
+// up roughly idle_percent of the stream. About 1% of transactions are truncated
+// by a glitch to exercise the partial byte and undocumented token paths.
+void generate(uint8_t* buf, size_t size, int idle_percent)
+{
+    Tokens t{buf, size};
+    srand(42);
+    while (!t.full())
+    {
+        size_t before = t.nibbles;
+        t.add(1); // START
+        t.addByte((0x08 + rand() % 0x70) << 1 | (rand() & 1), rand() % 8 == 0);
+        int len = rand() % 32;
+        for (int i = 0; i < len && !t.full(); i++)
+            t.addByte(rand(), i + 1 == len);
+        if (rand() % 100 == 0)
+        {
+            t.add(8 + rand() % 8);
+            t.add(3 + rand() % 5);
+        }
+        t.add(2); // STOP
+        size_t busy = t.nibbles - before;
+        size_t idle = idle_percent >= 100 ? 0 : busy * idle_percent / (100 - idle_percent);
+        for (size_t i = 0; i < idle && !t.full(); i++)
+            t.add(0);
+    }
+    while (t.nibbles / 2 < size)
+        t.add(0);
+}
+
+int main(int argc, char* argv[])
+{
+    size_t mb = argc > 1 ? strtoul(argv[1], nullptr, 10) : 16;
+    int idle_percent = argc > 2 ? atoi(argv[2]) : 50;
+    size_t size = mb << 20;
+    uint8_t* stream = (uint8_t*)malloc(size);
+    generate(stream, size, idle_percent);
+
+    char* legacy_text;
+    size_t legacy_len;
+    FILE* legacy = open_memstream(&legacy_text, &legacy_len);
+    uint64_t t0 = micros();
+    for (size_t i = 0; i < size; i++)
+        legacyDecodeCapture(stream[i], legacy);
+    fflush(legacy);
+    uint64_t t1 = micros();
+
+    char* text;
+    size_t len;
+    FILE* f = open_memstream(&text, &len);
+    {
+        CaptureDecoder decoder;
+        CaptureText formatter(color);
+        OutBuf out(f);
+        static const size_t CHUNK = 4096;
+        static CaptureEvent ev[CaptureDecoder::MAX_EVENTS_PER_BYTE * CHUNK];
+        uint64_t t2 = micros();
+        for (size_t i = 0; i < size; i += CHUNK)
+        {
+            size_t count = decoder.decode(stream + i, (size - i < CHUNK) ? size - i : CHUNK, ev);
+            formatter.format(ev, count, out);
+        }
+        out.flush();
+        fflush(f);
+        uint64_t t3 = micros();
+
+        CaptureDecoder decoder2;
+        uint64_t events = 0;
+        uint64_t t4 = micros();
+        for (size_t i = 0; i < size; i += CHUNK)
+            events += decoder2.decode(stream + i, (size - i < CHUNK) ? size - i : CHUNK, ev);
+        uint64_t t5 = micros();
+
+        auto rate = [&](uint64_t us) { return us ? (double)size / us : 0.0; }; // bytes/us == MB/s
+        fprintf(stdout, "%zu MB capture stream, %d%% idle, %" PRIu64 " events\n", mb, idle_percent, events);
+        fprintf(stdout, "legacy decoder:              %8.1f MB/s\n", rate(t1 - t0));
+        fprintf(stdout, "table decoder + text output: %8.1f MB/s\n", rate(t3 - t2));
+        fprintf(stdout, "table decoder only:          %8.1f MB/s\n", rate(t5 - t4));
+    }
+
+    fclose(legacy);
+    fclose(f);
+    bool same = (len == legacy_len && memcmp(text, legacy_text, len) == 0);
+    fprintf(stdout, "output %s (%zu bytes)\n", same ? "identical" : "DIFFERS", len);
+    return same ? 0 : 1;
+}
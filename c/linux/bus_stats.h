@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2022 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BUS_STATS_H
+#define BUS_STATS_H
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+
+struct AddrStats
+{
+    uint64_t reads;         // read messages
+    uint64_t writes;        // write messages
+    uint64_t read_bytes;    // data bytes read
+    uint64_t written_bytes; // data bytes written
+    uint64_t naks;          // messages whose address was NAKed
+
+    uint64_t messages() const { return reads + writes; }
+};
+
+// Counters for a period of capturing.
+struct BusCounters
+{
+    AddrStats addr[128];
+    uint64_t bytes;      // bytes of capture stream
+    uint64_t idle_bytes; // bytes of it that were all idle tokens
+    uint64_t partial;    // bytes cut short by an unexpected token
+    uint64_t undoc[5];   // undocumented tokens 3-7
+    uint64_t lost;       // bytes of capture stream dropped
+
+    void clear() { memset(this, 0, sizeof(*this)); }
+
+    void add(const BusCounters& c)
+    {
+        for (int a = 0; a < 128; a++)
+        {
+            addr[a].reads += c.addr[a].reads;
+            addr[a].writes += c.addr[a].writes;
+            addr[a].read_bytes += c.addr[a].read_bytes;
+            addr[a].written_bytes += c.addr[a].written_bytes;
+            addr[a].naks += c.addr[a].naks;
+        }
+        bytes += c.bytes;
+        idle_bytes += c.idle_bytes;
+        partial += c.partial;
+        for (int i = 0; i < 5; i++)
+            undoc[i] += c.undoc[i];
+        lost += c.lost;
+    }
+};
+
+// Aggregates decoded capture events into per-address counters for
+// --capture-stats and prints them every interval seconds of capture time,
+// either as a table that replaces the previous one on a terminal (top) or as
+// a series of snapshots. Counting costs O(1) per event, the work of a snapshot
+// is independent of the amount of traffic.
+class BusStats
+{
+    BusCounters total; // everything up to the last snapshot
+    BusCounters cur;   // since the last snapshot
+    uint64_t interval_ns;
+    bool top;
+    uint64_t start_ns = 0; // CLOCK_MONOTONIC at the start of cur
+    uint64_t last_mono_ns = 0;
+    uint64_t last_real_ns = 0;
+    int cur_addr = -1; // address of the message being received, -1 if none
+    bool cur_rd = false;
+
+  public:
+    BusStats(uint64_t interval_secs, bool top) : interval_ns(interval_secs * 1000000000), top(top)
+    {
+        total.clear();
+        cur.clear();
+    }
+
+    // Counts n events decoded from len bytes of capture stream, idle_bytes of
+    // which consisted of idle tokens only.
+    void feed(const CaptureEvent* ev, size_t n, size_t len, uint64_t idle_bytes)
+    {
+        cur.bytes += len;
+        cur.idle_bytes += idle_bytes;
+        for (size_t i = 0; i < n; i++)
+        {
+            CaptureEvent e = ev[i];
+            switch (e.type())
+            {
+                case CAPTURE_ADDR:
+                {
+                    cur_addr = e.value() >> 1;
+                    cur_rd = e.value() & 1;
+                    AddrStats& s = cur.addr[cur_addr];
+                    if (cur_rd)
+                        s.reads++;
+                    else
+                        s.writes++;
+                    s.naks += e.nak();
+                    break;
+                }
+                case CAPTURE_DATA:
+                    if (cur_addr < 0)
+                        break;
+                    if (cur_rd)
+                        cur.addr[cur_addr].read_bytes++;
+                    else
+                        cur.addr[cur_addr].written_bytes++;
+                    break;
+                case CAPTURE_PARTIAL:
+                    cur.partial++;
+                    cur_addr = -1;
+                    break;
+                case CAPTURE_UNDOC:
+                    cur.undoc[(e.value() - 3) % 5]++;
+                    break;
+                case CAPTURE_START:
+                case CAPTURE_STOP:
+                case CAPTURE_IDLE:
+                    cur_addr = -1;
+                    break;
+            }
+        }
+    }
+
+    void lost(uint64_t bytes)
+    {
+        cur.lost += bytes;
+        cur_addr = -1;
+    }
+
+    // Called after each block of capture data with the time it was read. Prints
+    // a snapshot to out if the interval is over.
+    void tick(uint64_t mono_ns, uint64_t real_ns, FILE* out)
+    {
+        last_mono_ns = mono_ns;
+        last_real_ns = real_ns;
+        if (start_ns == 0)
+            start_ns = mono_ns;
+        else if (interval_ns != 0 && mono_ns - start_ns >= interval_ns)
+        {
+            print(mono_ns - start_ns, out);
+            start_ns = mono_ns;
+        }
+    }
+
+    // Prints the final snapshot.
+    void finish(FILE* out) { print(last_mono_ns - start_ns, out); }
+
+  private:
+    // Prints the rates of cur over the elapsed_ns since the last snapshot and the
+    // totals including cur, then starts a new interval.
+    void print(uint64_t elapsed_ns, FILE* out)
+    {
+        total.add(cur);
+        double secs = elapsed_ns / 1e9;
+        auto rate = [secs](uint64_t n) { return secs > 0 ? n / secs : 0.0; };
+
+        uint8_t order[128];
+        int count = 0;
+        for (int a = 0; a < 128; a++)
+            if (total.addr[a].messages() != 0)
+                order[count++] = a;
+        // most active in this interval first, then most active overall
+        auto cmp = [this](uint8_t a, uint8_t b) {
+            uint64_t ca = cur.addr[a].messages(), cb = cur.addr[b].messages();
+            if (ca != cb)
+                return ca > cb;
+            return total.addr[a].messages() > total.addr[b].messages();
+        };
+        for (int i = 1; i < count; i++) // insertion sort, at most 128 entries
+            for (int k = i; k > 0 && cmp(order[k], order[k - 1]); k--)
+            {
+                uint8_t t = order[k];
+                order[k] = order[k - 1];
+                order[k - 1] = t;
+            }
+
+        char when[32];
+        time_t t = last_real_ns / 1000000000;
+        struct tm tm;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+
+        uint64_t msgs = 0;
+        for (int a = 0; a < 128; a++)
+            msgs += cur.addr[a].messages();
+        double busy = cur.bytes == 0 ? 0.0 : 100.0 * (cur.bytes - cur.idle_bytes) / cur.bytes;
+
+        if (top)
+            fputs("\x1B[H\x1B[2J", out);
+        fprintf(out, "%s  busy %5.1f%%  %.0f msg/s  partial %" PRIu64 "  undoc", when, busy, rate(msgs),
+                total.partial);
+        for (int i = 0; i < 5; i++)
+            fprintf(out, " %d:%" PRIu64, i + 3, total.undoc[i]);
+        fprintf(out, "  lost %" PRIu64 "\n", total.lost);
+        fprintf(out, "ADDR    MSG/s   RD B/s   WR B/s   NAK%%        MSGS    RD BYTES    WR BYTES\n");
+        for (int i = 0; i < count; i++)
+        {
+            const AddrStats& c = cur.addr[order[i]];
+            const AddrStats& s = total.addr[order[i]];
+            fprintf(out, "0x%02X %8.0f %8.0f %8.0f %6.1f %11" PRIu64 " %11" PRIu64 " %11" PRIu64 "\n", order[i],
+                    rate(c.messages()), rate(c.read_bytes), rate(c.written_bytes), 100.0 * s.naks / s.messages(),
+                    s.messages(), s.read_bytes, s.written_bytes);
+        }
+        if (!top)
+            fputc('\n', out);
+        fflush(out);
+        cur.clear();
+    }
+};
+
+#endif
@@ -0,0 +1,428 @@
+/*
+ * Copyright (C) 2022 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// In capture mode the I2CDriver sends a stream of 4 bit tokens, 2 per byte with
+// the high nibble first:
+//
+//   0       bus idle (sent periodically while nothing happens)
+//   1       START
+//   2       STOP
+//   3-7     undocumented
+//   8-15    3 data bits (token - 8), most significant first
+//
+// 3 triplets make up 1 byte on the bus: 8 bits followed by the ACK bit (1 = NAK).
+// The first byte after a START is the address with the R/W bit.
+
+enum CaptureEventType : uint8_t
+{
+    CAPTURE_START,
+    CAPTURE_STOP,
+    CAPTURE_ADDR,    // value = address byte incl. R/W bit
+    CAPTURE_DATA,    // value = data byte
+    CAPTURE_PARTIAL, // value = bits received before an unexpected token, bits() says how many
+    CAPTURE_UNDOC,   // value = undocumented token 3-7
+    CAPTURE_IDLE,    // bus went idle; bits() != 0 if this interrupted a partial byte
+};
+
+// A decoded capture event packed into 16 bits:
+//   15-13 type, 12 ack (1 = NAK), 11-8 bits (for PARTIAL and IDLE), 7-0 value
+struct CaptureEvent
+{
+    uint16_t raw;
+
+    static CaptureEvent make(CaptureEventType type, unsigned value = 0, unsigned ack = 0, unsigned bits = 0)
+    {
+        return CaptureEvent{(uint16_t)((type << 13) | (ack << 12) | (bits << 8) | (value & 0xff))};
+    }
+
+    CaptureEventType type() const { return (CaptureEventType)(raw >> 13); }
+    uint8_t value() const { return raw & 0xff; }
+    bool nak() const { return (raw >> 12) & 1; }
+    unsigned bits() const { return (raw >> 8) & 0xf; }
+};
+
+// Decodes the capture token stream using a table that maps (state, byte) to the
+// next state and the events emitted for both nibbles of the byte. The state
+// consists of the number of triplets received so far, their bits and whether we
+// are past the address byte, which makes for 2 + 16 + 128 states.
+// While the bus is idle, runs of 0x00 bytes are skipped 16 at a time.
+class CaptureDecoder
+{
+  public:
+    static const int MAX_EVENTS_PER_BYTE = 3;
+
+  private:
+    static const int NUM_STATES = 2 + 16 + 128;
+    static const uint8_t REST = 0; // idle, no partial byte, next byte is an address
+
+    struct Transition
+    {
+        uint8_t next;
+        uint8_t count;
+        CaptureEvent events[MAX_EVENTS_PER_BYTE];
+    };
+
+    uint8_t state = REST;
+    uint64_t idle_bytes = 0;
+
+    // Decoder state in the form the table is computed from.
+    struct Unpacked
+    {
+        int count;   // triplets received
+        unsigned cur; // their bits
+        bool inData;
+    };
+
+    static Unpacked unpack(int s)
+    {
+        if (s < 2)
+            return {0, 0, s == 1};
+        if (s < 18)
+            return {1, (unsigned)(s - 2) & 7, s - 2 >= 8};
+        return {2, (unsigned)(s - 18) & 63, s - 18 >= 64};
+    }
+
+    static uint8_t pack(const Unpacked& u)
+    {
+        if (u.count == 0)
+            return u.inData;
+        if (u.count == 1)
+            return 2 + u.inData * 8 + u.cur;
+        return 18 + u.inData * 64 + u.cur;
+    }
+
+    // Processes 1 token the way the original nibble-by-nibble decoder did.
+    static void step(Unpacked& u, uint8_t b, Transition& t)
+    {
+        bool idle = (u.count == 0);
+        int partial_bits = u.count * 3;
+
+        if (u.count > 0 && b < 8)
+        { // premature flush
+            t.events[t.count++] = CaptureEvent::make(CAPTURE_PARTIAL, u.cur, 0, partial_bits);
+            u.cur = 0;
+            u.count = 0;
+            u.inData = false;
+        }
+
+        if (b >= 8)
+        {
+            u.cur = (u.cur << 3) | (b - 8);
+            if (++u.count == 3)
+            { // 3 triplets => 1 byte done
+                t.events[t.count++] =
+                    CaptureEvent::make(u.inData ? CAPTURE_DATA : CAPTURE_ADDR, u.cur >> 1, u.cur & 1);
+                u.cur = 0;
+                u.count = 0;
+                u.inData = true;
+            }
+        }
+        else if (b == 0) // Bus IDLE
+        {
+            if (!idle || u.inData)
+                t.events[t.count++] = CaptureEvent::make(CAPTURE_IDLE, 0, 0, idle ? 0 : partial_bits);
+            u.inData = false;
+        }
+        else if (b == 2) // STOP
+        {
+            t.events[t.count++] = CaptureEvent::make(CAPTURE_STOP);
+            u.inData = false;
+        }
+        else if (b == 1) // START
+        {
+            t.events[t.count++] = CaptureEvent::make(CAPTURE_START);
+            u.inData = false;
+        }
+        else // undocumented code
+        {
+            t.events[t.count++] = CaptureEvent::make(CAPTURE_UNDOC, b);
+        }
+    }
+
+    static const Transition* buildTable()
+    {
+        Transition* t = new Transition[NUM_STATES * 256];
+        for (int s = 0; s < NUM_STATES; s++)
+            for (int byte = 0; byte < 256; byte++)
+            {
+                Transition& tr = t[s * 256 + byte];
+                tr.count = 0;
+                Unpacked u = unpack(s);
+                step(u, byte >> 4, tr);
+                step(u, byte & 0xf, tr);
+                tr.next = pack(u);
+            }
+        return t;
+    }
+
+    static const Transition* table()
+    {
+        static const Transition* tab = buildTable();
+        return tab;
+    }
+
+    template <bool POS> size_t decode(const uint8_t* data, size_t n, CaptureEvent* ev, uint16_t* pos)
+    {
+        const Transition* tab = table();
+        CaptureEvent* out = ev;
+        size_t i = 0;
+        while (i < n)
+        {
+            if (state == REST && data[i] == 0)
+            {
+                size_t run = idleRun(data + i, n - i);
+                idle_bytes += run;
+                i += run;
+                continue;
+            }
+            const Transition& tr = tab[state * 256 + data[i]];
+            for (int k = 0; k < tr.count; k++)
+            {
+                if (POS)
+                    pos[out - ev] = i;
+                *out++ = tr.events[k];
+            }
+            state = tr.next;
+            i++;
+        }
+        return out - ev;
+    }
+
+  public:
+    // Returns the number of 0x00 bytes at the start of data[0..n).
+    static size_t idleRun(const uint8_t* data, size_t n)
+    {
+        size_t i = 0;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+            unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+            if (mask != 0xffff)
+                return i + __builtin_ctz(~mask);
+        }
+#endif
+        while (i < n && data[i] == 0)
+            i++;
+        return i;
+    }
+
+    CaptureDecoder() { table(); }
+
+    // Decodes n bytes of the token stream and stores the resulting events in ev,
+    // which must have room for MAX_EVENTS_PER_BYTE * n events. Returns the number
+    // of events stored. The state carries over to the next call.
+    size_t decode(const uint8_t* data, size_t n, CaptureEvent* ev) { return decode<false>(data, n, ev, nullptr); }
+
+    // Like decode() above, but also stores in pos[i] the index of the byte of data
+    // that produced ev[i], e.g. for timestamping the events.
+    size_t decode(const uint8_t* data, size_t n, CaptureEvent* ev, uint16_t* pos)
+    {
+        return decode<true>(data, n, ev, pos);
+    }
+
+    // Number of 0x00 bytes skipped while the bus was idle.
+    uint64_t idleBytes() const { return idle_bytes; }
+
+    void reset() { state = REST; }
+
+    // The state between 2 bytes of the stream, so that decoding can be resumed
+    // there later with restore().
+    uint8_t checkpoint() const { return state; }
+    void restore(uint8_t s) { state = s < NUM_STATES ? s : REST; }
+};
+
+// Output buffer for a FILE that is written with a single fwrite() when full or
+// when flush() is called.
+class OutBuf
+{
+    FILE* f;
+    char* buf;
+    size_t cap;
+    size_t len = 0;
+
+  public:
+    OutBuf(FILE* file, size_t capacity = 65536) : f(file), buf(new char[capacity]), cap(capacity) {}
+    ~OutBuf() { delete[] buf; }
+
+    OutBuf(const OutBuf&) = delete;
+    OutBuf& operator=(const OutBuf&) = delete;
+
+    // Makes sure that n bytes can be appended without overflowing.
+    void reserve(size_t n)
+    {
+        if (len + n > cap)
+            flush();
+    }
+
+    void put(char c) { buf[len++] = c; }
+
+    void put(const char* s, size_t n)
+    {
+        memcpy(buf + len, s, n);
+        len += n;
+    }
+
+    void put(const char* s) { put(s, strlen(s)); }
+
+    void hex2(uint8_t x)
+    {
+        static const char HEX[] = "0123456789ABCDEF";
+        buf[len++] = HEX[x >> 4];
+        buf[len++] = HEX[x & 15];
+    }
+
+    void dec(uint64_t x)
+    {
+        char digits[20];
+        int n = 0;
+        do
+        {
+            digits[n++] = '0' + x % 10;
+            x /= 10;
+        } while (x != 0);
+        while (n > 0)
+            buf[len++] = digits[--n];
+    }
+
+    size_t size() const { return len; }
+
+    void flush()
+    {
+        if (len > 0)
+            fwrite(buf, 1, len, f);
+        len = 0;
+    }
+};
+
+// ANSI color strings used for decoded output. They are similar to those used by
+// the I²Cdriver device's physical display for monitor mode.
+struct Color
+{
+    const char* ERR = "\x1B[1;31m\x1B[7m";
+    const char* START = "\x1B[33m\x1B[7m";
+    const char* STOP = "\x1B[36m\x1B[7m";
+    const char* RW = START;
+    const char* DEFAULT = "\x1B[0m";
+    const char* DATA = "\x1B[1;37m";
+    const char* ACK = "\x1B[1;32m";
+    const char* NACK = "\x1B[1;31m";
+    const char* ADDR = "\x1B[0;1m\x1B[7m";
+};
+
+// Renders CaptureEvents as the colored text that --capture prints.
+class CaptureText
+{
+    struct Str
+    {
+        const char* s;
+        size_t n;
+        Str(const char* str) : s(str), n(strlen(str)) {}
+    };
+
+    Str ERR, START, STOP, RW, DEFAULT, DATA, ACK, NACK, ADDR;
+    static const size_t MAX_EVENT_TEXT = 64; // more than any event needs with the colors above
+
+    void put(OutBuf& out, const Str& str) const { out.put(str.s, str.n); }
+
+  public:
+    CaptureText(const Color& c)
+        : ERR(c.ERR), START(c.START), STOP(c.STOP), RW(c.RW), DEFAULT(c.DEFAULT), DATA(c.DATA), ACK(c.ACK),
+          NACK(c.NACK), ADDR(c.ADDR)
+    {
+    }
+
+    void format(const CaptureEvent* ev, size_t n, OutBuf& out) const
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            out.reserve(MAX_EVENT_TEXT);
+            CaptureEvent e = ev[i];
+            switch (e.type())
+            {
+                case CAPTURE_ADDR:
+                    put(out, RW);
+                    out.put((e.value() & 1) ? 'R' : 'W');
+                    put(out, ADDR);
+                    out.hex2(e.value() >> 1);
+                    goto ack;
+                case CAPTURE_DATA:
+                    put(out, DATA);
+                    out.hex2(e.value());
+                ack:
+                    put(out, DEFAULT);
+                    put(out, e.nak() ? NACK : ACK);
+                    out.put(e.nak() ? '\'' : '.');
+                    put(out, DEFAULT);
+                    break;
+                case CAPTURE_PARTIAL:
+                    put(out, ERR);
+                    if (e.value() < 16) // like "%2X"
+                    {
+                        out.put(' ');
+                        out.put("0123456789ABCDEF"[e.value()]);
+                    }
+                    else
+                        out.hex2(e.value());
+                    out.put('/');
+                    out.put('0' + e.bits());
+                    put(out, DEFAULT);
+                    out.put('\n');
+                    break;
+                case CAPTURE_IDLE:
+                    if (e.bits() != 0)
+                        out.put('\n');
+                    break;
+                case CAPTURE_STOP:
+                    put(out, STOP);
+                    out.put('P');
+                    put(out, DEFAULT);
+                    out.put('\n');
+                    break;
+                case CAPTURE_START:
+                    put(out, START);
+                    out.put('S');
+                    put(out, DEFAULT);
+                    break;
+                case CAPTURE_UNDOC:
+                    put(out, ERR);
+                    out.put("0123456789abcdef"[e.value() & 15]);
+                    put(out, DEFAULT);
+                    out.put(' ');
+                    break;
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,420 @@
+/*
+ * Copyright (C) 2022 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef CAPTURE_ARCHIVE_H
+#define CAPTURE_ARCHIVE_H
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+
+#include "capture_file.h"
+#include "spsc_ring.h"
+
+// Records capture data for --capture-out as a series of RLE compressed capture
+// files. The capture thread only compresses, a background thread does the file
+// I/O, so that a slow disk can not hold up the capture. If rotate_bytes or
+// rotate_secs are not 0, a new file is started when the current one reaches the
+// size or age, and the UTC start time is inserted into the name before the
+// extension (bus.cap => bus-20221018T071500.000Z.cap), so that the names sort by
+// time. Names are unique even if files start within the same ms. If keep
+// is not 0, only the newest keep files with the same naming pattern are kept.
+// Every file ends with an index for seeking and queries. The capture thread
+// decodes the stream to fill in the addresses of the index entries, which costs
+// little next to the compression.
+class CaptureArchive
+{
+    static const size_t CHUNK_SIZE = 1 << 18;
+
+    struct Chunk
+    {
+        bool new_file;     // close the current file and continue with a new one ...
+        uint64_t start_ns; // ... that starts at this CLOCK_REALTIME
+        size_t len;
+        uint8_t data[CHUNK_SIZE];
+    };
+
+    const char* path;
+    uint64_t rotate_bytes;
+    uint64_t rotate_ns;
+    unsigned keep;
+    int latency_timer; // of the TTY in ms, recorded in the file header
+
+    SpscRing<Chunk, 16> ring;
+    std::thread writer;
+    std::atomic<bool> failed{false};
+    uint64_t last_ms = 0; // writer thread: time in the name of the last rotated file
+
+    // capture thread state
+    Chunk* chunk = nullptr; // being filled
+    bool started = false;
+    uint64_t file_bytes = 0;
+    uint64_t file_start_ns = 0; // CLOCK_MONOTONIC of the first block in the file
+    RleFrameEncoder frame;
+    CaptureIndexEntry* index = nullptr; // host byte order
+    size_t index_len = 0;
+    size_t index_cap = 0;
+    CaptureIndexEntry entry; // of the frame being encoded
+    CaptureDecoder decoder;
+    CaptureEvent events[CaptureDecoder::MAX_EVENTS_PER_BYTE * CAPTURE_BLOCK_SIZE];
+    int cur_addr = -1;     // address of the message being received, -1 if none
+    bool cur_rd = false;   // it is a read
+    size_t cur_frame = 0;  // index of the entry of the frame it started in
+    bool cur_nak = false;  // it has already been marked as NAKed
+
+    // Makes sure there is a chunk to fill. If the writer thread is that far
+    // behind, waiting is the only option.
+    void getChunk()
+    {
+        if (chunk != nullptr)
+            return;
+        while ((chunk = ring.writable()) == nullptr)
+            usleep(1000);
+        chunk->new_file = false;
+        chunk->len = 0;
+    }
+
+    void append(const void* data, size_t n)
+    {
+        const uint8_t* p = (const uint8_t*)data;
+        while (n > 0)
+        {
+            getChunk();
+            size_t k = CHUNK_SIZE - chunk->len;
+            if (k > n)
+                k = n;
+            memcpy(chunk->data + chunk->len, p, k);
+            chunk->len += k;
+            p += k;
+            n -= k;
+            if (chunk->len == CHUNK_SIZE)
+                submit();
+        }
+    }
+
+    void submit()
+    {
+        if (chunk != nullptr && (chunk->len != 0 || chunk->new_file))
+        {
+            ring.commit();
+            chunk = nullptr;
+        }
+    }
+
+    // Stores the name of the rotated file with the time ms (since the epoch) in name.
+    void fileName(uint64_t ms, char* name)
+    {
+        char when[32];
+        time_t t = ms / 1000;
+        struct tm tm;
+        strftime(when, sizeof(when), "-%Y%m%dT%H%M%S", gmtime_r(&t, &tm));
+        snprintf(name, PATH_MAX, "%.*s%s.%03uZ%s", (int)(extension() - path), path, when, (unsigned)(ms % 1000),
+                 extension());
+    }
+
+    // Creates the file that starts at real_ns and stores its name in name. A
+    // rotated file never replaces an existing one: if the name is taken, the time
+    // in it is advanced by 1 ms until it is free, which keeps the order.
+    FILE* openFile(uint64_t real_ns, char* name)
+    {
+        if (rotate_bytes == 0 && rotate_ns == 0)
+        {
+            snprintf(name, PATH_MAX, "%s", path);
+            return fopen(name, "wb");
+        }
+        uint64_t ms = real_ns / 1000000;
+        if (ms <= last_ms)
+            ms = last_ms + 1;
+        for (;; ms++)
+        {
+            fileName(ms, name);
+            int fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0666);
+            if (fd >= 0)
+            {
+                last_ms = ms;
+                FILE* f = fdopen(fd, "wb");
+                if (f == nullptr)
+                    ::close(fd);
+                return f;
+            }
+            if (errno != EEXIST)
+                return nullptr;
+        }
+    }
+
+    // Returns the extension of path, including the '.', or "".
+    const char* extension()
+    {
+        const char* dot = strrchr(path, '.');
+        if (dot == nullptr || strchr(dot, '/') != nullptr || dot == path || dot[-1] == '/')
+            return path + strlen(path);
+        return dot;
+    }
+
+    void startFile(const CaptureBlock& block)
+    {
+        submit();
+        getChunk();
+        chunk->new_file = true;
+        chunk->start_ns = block.real_ns;
+
+        CaptureFileHeader h;
+        memcpy(h.magic, CAPTURE_FILE_MAGIC, sizeof(h.magic));
+        h.version = htole32(CAPTURE_FILE_VERSION);
+        h.header_size = htole32(sizeof(h));
+        h.latency_timer = (int32_t)htole32(latency_timer);
+        append(&h, sizeof(h));
+        file_bytes = sizeof(h);
+        file_start_ns = block.mono_ns;
+        index_len = 0;
+        cur_addr = -1; // its start is in the previous file
+        started = true;
+    }
+
+    // Marks the addresses of the messages in block in the index entries.
+    void scan(const CaptureBlock& block)
+    {
+        if (frame.empty())
+        {
+            memset(&entry, 0, sizeof(entry));
+            entry.state = decoder.checkpoint();
+        }
+        if (block.lost != 0)
+        {
+            decoder.reset();
+            cur_addr = -1;
+        }
+        size_t n = decoder.decode(block.data, block.len, events);
+        for (size_t i = 0; i < n; i++)
+        {
+            CaptureEvent e = events[i];
+            switch (e.type())
+            {
+                case CAPTURE_ADDR:
+                    cur_addr = e.value() >> 1;
+                    cur_rd = e.value() & 1;
+                    cur_frame = index_len;
+                    cur_nak = false;
+                    CaptureIndexEntry::set(entry.addrs, cur_addr);
+                    if (e.nak())
+                        nak();
+                    break;
+                case CAPTURE_DATA:
+                    if (cur_addr >= 0 && !cur_rd && e.nak())
+                        nak();
+                    break;
+                case CAPTURE_PARTIAL:
+                case CAPTURE_START:
+                case CAPTURE_STOP:
+                case CAPTURE_IDLE:
+                    cur_addr = -1;
+                    break;
+                case CAPTURE_UNDOC:
+                    break;
+            }
+        }
+    }
+
+    // Marks the current message as NAKed in the entry of the frame it started
+    // in, which may have been finished already.
+    void nak()
+    {
+        if (cur_nak)
+            return;
+        cur_nak = true;
+        CaptureIndexEntry::set(cur_frame < index_len ? index[cur_frame].naks : entry.naks, cur_addr);
+    }
+
+    void finishFrame()
+    {
+        if (frame.empty())
+            return;
+        if (index_len == index_cap)
+        {
+            index_cap = index_cap == 0 ? 4096 : 2 * index_cap;
+            CaptureIndexEntry* bigger = new CaptureIndexEntry[index_cap];
+            memcpy(bigger, index, index_len * sizeof(*index));
+            delete[] index;
+            index = bigger;
+        }
+        CaptureIndexEntry& e = index[index_len++];
+        e = entry;
+        e.mono_ns = frame.monoNs();
+        e.real_ns = frame.realNs();
+        e.offset = file_bytes;
+
+        size_t size;
+        const uint8_t* data = frame.finish(size);
+        append(data, size);
+        file_bytes += size;
+        frame.clear();
+    }
+
+    void finishFile()
+    {
+        finishFrame();
+        CaptureFrameHeader h;
+        h.sync = htole32(CAPTURE_FRAME_SYNC);
+        h.type = htole16(FRAME_INDEX);
+        h.reserved = htole16(sizeof(*index));
+        h.len = htole32(index_len * sizeof(*index));
+        h.lost = 0;
+        h.mono_ns = 0;
+        h.real_ns = 0;
+        CaptureFileTrailer t;
+        memcpy(t.magic, CAPTURE_INDEX_MAGIC, sizeof(t.magic));
+        t.index_offset = htole64(file_bytes);
+        append(&h, sizeof(h));
+        for (size_t i = 0; i < index_len; i++)
+        {
+            CaptureIndexEntry e = index[i];
+            e.mono_ns = htole64(e.mono_ns);
+            e.real_ns = htole64(e.real_ns);
+            e.offset = htole64(e.offset);
+            for (int k = 0; k < 2; k++)
+            {
+                e.addrs[k] = htole64(e.addrs[k]);
+                e.naks[k] = htole64(e.naks[k]);
+            }
+            append(&e, sizeof(e));
+        }
+        append(&t, sizeof(t));
+        file_bytes += sizeof(h) + index_len * sizeof(*index) + sizeof(t);
+    }
+
+    // Deletes the oldest files of the rotation beyond keep.
+    void expire()
+    {
+        char pattern[PATH_MAX];
+        const char* date = "[0-9][0-9][0-9][0-9][0-9][0-9][0-9][0-9]";
+        const char* hms = "[0-9][0-9][0-9][0-9][0-9][0-9]";
+        const char* ms = "[0-9][0-9][0-9]";
+        snprintf(pattern, sizeof(pattern), "%.*s-%sT%s.%sZ%s", (int)(extension() - path), path, date, hms, ms,
+                 extension());
+        glob_t g;
+        if (glob(pattern, 0, nullptr, &g) == 0)
+            for (size_t i = 0; i + keep < g.gl_pathc; i++) // glob() sorts, oldest first
+                if (unlink(g.gl_pathv[i]) != 0)
+                    perror(g.gl_pathv[i]);
+        globfree(&g);
+    }
+
+    void closeFile(FILE* out, const char* name)
+    {
+        if (out != nullptr && (ferror(out) | fclose(out)))
+        {
+            perror(name);
+            failed = true;
+        }
+    }
+
+    // Body of the writer thread.
+    void write()
+    {
+        FILE* out = nullptr;
+        char name[PATH_MAX] = "";
+        Chunk* c;
+        while ((c = ring.waitReadable()) != nullptr)
+        {
+            if (c->new_file)
+            {
+                closeFile(out, name);
+                out = openFile(c->start_ns, name);
+                if (out == nullptr)
+                {
+                    perror(name);
+                    failed = true;
+                }
+                if (keep != 0)
+                    expire();
+            }
+            if (out != nullptr && fwrite(c->data, 1, c->len, out) != c->len)
+            {
+                perror(name);
+                fclose(out);
+                out = nullptr;
+                failed = true;
+            }
+            ring.release();
+            if (out != nullptr && ring.readable() == nullptr) // caught up => make it safe from a crash
+                fflush(out);
+        }
+        closeFile(out, name);
+    }
+
+  public:
+    CaptureArchive(const char* path, uint64_t rotate_bytes, uint64_t rotate_secs, unsigned keep, int latency_timer)
+        : path(path), rotate_bytes(rotate_bytes), rotate_ns(rotate_secs * 1000000000), keep(keep),
+          latency_timer(latency_timer)
+    {
+        writer = std::thread(&CaptureArchive::write, this);
+    }
+
+    ~CaptureArchive() { delete[] index; }
+
+    // Records a block.
+    void add(const CaptureBlock& block)
+    {
+        if (started && ((rotate_bytes != 0 && file_bytes >= rotate_bytes) ||
+                        (rotate_ns != 0 && block.mono_ns - file_start_ns >= rotate_ns)))
+        {
+            finishFile();
+            started = false;
+        }
+        if (!started)
+            startFile(block);
+        if (frame.full(block))
+            finishFrame();
+        scan(block);
+        frame.add(block);
+    }
+
+    // Hands everything recorded so far to the writer thread.
+    void flush()
+    {
+        finishFrame();
+        submit();
+    }
+
+    // Completes the current file and waits for the writer thread. Returns false
+    // if a file could not be written.
+    bool close()
+    {
+        if (started)
+            finishFile();
+        submit();
+        ring.close();
+        writer.join();
+        return !failed;
+    }
+};
+
+#endif
@@ -0,0 +1,623 @@
+/*
+ * Copyright (C) 2022 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef CAPTURE_FILE_H
+#define CAPTURE_FILE_H
+
+#include <endian.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+
+// Capture files (--capture-out) contain the token stream exactly as read from
+// the I2CDriver, so that recording costs no decoding. All numbers are little
+// endian.
+//
+//   file header   8 bytes magic "I2CDCAP\n", uint32 version, uint32 header size,
+//                 int32 USB latency timer of the TTY in ms (-1 unknown)
+//   frames        each a CaptureFrameHeader followed by len bytes of payload
+//   index         optional FRAME_INDEX frame and CaptureFileTrailer at the end
+//
+// Every frame starts with FRAME_SYNC, which allows a reader to skip damage
+// (e.g. the truncated last frame of a capture that was killed).
+//
+// Version 1 files contain only FRAME_TOKENS frames, 1 per block read from the
+// I2CDriver. Version 2 files are written with FRAME_RLE frames, each of which
+// packs the blocks of up to about 1 second. Its payload is a sequence of records
+// that start with a varint (7 bits per byte, least significant first) tag. The
+// low 2 bits of the tag are the record type, the rest is n:
+//
+//   RLE_LITERAL   n bytes of token stream follow
+//   RLE_IDLE      n 0x00 bytes of token stream (idle bus)
+//   RLE_REPEAT    the same bytes as the literal n places back in the history of
+//                 the last RLE_HISTORY literals and repeats, so that polling the
+//                 same registers over and over costs 1 byte per transaction
+//   RLE_BLOCK     end of a block, n bytes were lost before it. A varint follows
+//                 with the nanoseconds from the frame's timestamps to the block's.
+//
+// The frame header's timestamps are those of the first block and lost is 0. The
+// history starts empty in every frame, so that each frame can be decoded on its
+// own. The FRAME_INDEX frame at the end lists the timestamps and file offsets
+// of all frames, so that a reader can start at a given time without reading the
+// whole file. Its entries also tell the decoder state at the start of the frame
+// and which addresses the frame has messages (and NAKs) for, so that a query
+// can skip the frames that can't contain a match. The reserved field of the
+// FRAME_INDEX header is the size of an entry. 0 means the 24 bytes of the
+// first entries, which had only the timestamps and offset.
+//
+// Files written before the latency timer was recorded have a 16 byte header.
+// Readers skip header size bytes, so fields may be appended to the header.
+
+const char CAPTURE_FILE_MAGIC[8] = {'I', '2', 'C', 'D', 'C', 'A', 'P', '\n'};
+const char CAPTURE_INDEX_MAGIC[8] = {'I', '2', 'C', 'D', 'I', 'D', 'X', '\n'};
+const uint32_t CAPTURE_FILE_VERSION = 2;
+const uint32_t CAPTURE_FRAME_SYNC = 0xA55A4652; // "RFZ\xA5" on disk
+
+enum CaptureFrameType : uint16_t
+{
+    FRAME_TOKENS = 1, // payload is capture token stream
+    FRAME_RLE = 2,    // payload is run-length encoded capture blocks
+    FRAME_INDEX = 3,  // payload is CaptureIndexEntry[], 1 per frame
+};
+
+enum CaptureRleRecord
+{
+    RLE_LITERAL = 0,
+    RLE_IDLE = 1,
+    RLE_REPEAT = 2,
+    RLE_BLOCK = 3,
+};
+
+const int RLE_HISTORY = 8;
+
+struct CaptureFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    int32_t latency_timer; // ms, -1 if unknown
+};
+
+// Size of the header of files that don't record the latency timer.
+const size_t CAPTURE_FILE_HEADER_MIN = offsetof(CaptureFileHeader, latency_timer);
+
+struct CaptureFrameHeader
+{
+    uint32_t sync;
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t len;     // payload bytes
+    uint32_t lost;    // bytes dropped right before this frame (saturates)
+    uint64_t mono_ns; // CLOCK_MONOTONIC when the read of the payload completed
+    uint64_t real_ns; // CLOCK_REALTIME at the same time
+};
+
+struct CaptureIndexEntry
+{
+    uint64_t mono_ns; // timestamps of the frame
+    uint64_t real_ns;
+    uint64_t offset;   // file offset of the frame header
+    uint64_t addrs[2]; // bit a % 64 of addrs[a / 64] is set if a message to address a starts in the frame
+    uint64_t naks[2];  // the same for messages whose address or a written byte was NAKed
+    uint8_t state;     // CaptureDecoder::checkpoint() at the start of the frame
+    uint8_t reserved[7];
+
+    static const size_t OLD_SIZE = 24; // without the fields from addrs on
+
+    static bool has(const uint64_t* bits, int addr) { return (bits[addr / 64] >> (addr % 64)) & 1; }
+    static void set(uint64_t* bits, int addr) { bits[addr / 64] |= (uint64_t)1 << (addr % 64); }
+};
+
+// Last bytes of a file with index.
+struct CaptureFileTrailer
+{
+    char magic[8];
+    uint64_t index_offset; // file offset of the FRAME_INDEX frame header
+};
+
+const size_t CAPTURE_BLOCK_SIZE = 4096;
+
+// Unit of capture data as read from the I2CDriver in one go.
+struct CaptureBlock
+{
+    size_t len;       // number of valid bytes in data
+    uint64_t lost;    // bytes that had to be dropped before this block
+    uint64_t mono_ns; // CLOCK_MONOTONIC when the read completed
+    uint64_t real_ns; // CLOCK_REALTIME when the read completed
+    uint8_t data[CAPTURE_BLOCK_SIZE];
+
+    void timestamp()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        mono_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        real_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+};
+
+// The most recent literals of a FRAME_RLE frame, [0] is the newest.
+struct RleHistory
+{
+    const uint8_t* data[RLE_HISTORY];
+    size_t len[RLE_HISTORY];
+    int n = 0;
+
+    // Returns the index of the entry equal to the n bytes at p or -1.
+    int find(const uint8_t* p, size_t bytes) const
+    {
+        for (int i = 0; i < n; i++)
+            if (len[i] == bytes && memcmp(data[i], p, bytes) == 0)
+                return i;
+        return -1;
+    }
+
+    // Moves entry i (n to add a new one) to the front.
+    void toFront(int i, const uint8_t* p, size_t bytes)
+    {
+        if (i == RLE_HISTORY)
+            i--;
+        else if (i == n)
+            n++;
+        for (; i > 0; i--)
+        {
+            data[i] = data[i - 1];
+            len[i] = len[i - 1];
+        }
+        data[0] = p;
+        len[0] = bytes;
+    }
+};
+
+// Builds a FRAME_RLE frame from CaptureBlocks.
+class RleFrameEncoder
+{
+  public:
+    static const size_t FULL = 1 << 16;                        // payload size at which to start a new frame
+    static const size_t MAX_LEN = FULL + 2 * CAPTURE_BLOCK_SIZE; // upper bound of the payload size
+    static const uint64_t SPAN_NS = 1000000000;                // time span at which to start a new frame
+
+  private:
+    uint8_t buf[sizeof(CaptureFrameHeader) + MAX_LEN];
+    size_t len = 0; // bytes in buf, including the header
+    uint64_t mono_ns = 0;
+    uint64_t real_ns = 0;
+    RleHistory hist;
+
+    void putVarint(uint64_t v)
+    {
+        while (v >= 0x80)
+        {
+            buf[len++] = (v & 0x7f) | 0x80;
+            v >>= 7;
+        }
+        buf[len++] = v;
+    }
+
+    void putTag(CaptureRleRecord type, uint64_t n) { putVarint(n << 2 | type); }
+
+    void putLiteral(const uint8_t* data, size_t n)
+    {
+        int i = hist.find(data, n);
+        if (i >= 0)
+        {
+            putTag(RLE_REPEAT, i);
+            hist.toFront(i, hist.data[i], n);
+            return;
+        }
+        putTag(RLE_LITERAL, n);
+        memcpy(buf + len, data, n);
+        hist.toFront(hist.n, buf + len, n);
+        len += n;
+    }
+
+  public:
+    RleFrameEncoder() { clear(); }
+
+    void clear()
+    {
+        len = sizeof(CaptureFrameHeader);
+        hist.n = 0;
+    }
+
+    bool empty() const { return len == sizeof(CaptureFrameHeader); }
+
+    uint64_t monoNs() const { return mono_ns; }
+    uint64_t realNs() const { return real_ns; }
+
+    // Returns true if block does not belong into this frame anymore.
+    bool full(const CaptureBlock& block) const
+    {
+        return !empty() && (len >= FULL || block.mono_ns - mono_ns >= SPAN_NS || block.mono_ns < mono_ns);
+    }
+
+    void add(const CaptureBlock& block)
+    {
+        if (empty())
+        {
+            mono_ns = block.mono_ns;
+            real_ns = block.real_ns;
+        }
+        const uint8_t* data = block.data;
+        size_t i = 0;
+        while (i < block.len)
+        {
+            size_t run = CaptureDecoder::idleRun(data + i, block.len - i);
+            if (run != 0)
+            {
+                putTag(RLE_IDLE, run);
+                i += run;
+                continue;
+            }
+            const uint8_t* zero = (const uint8_t*)memchr(data + i, 0, block.len - i);
+            size_t n = (zero == nullptr ? data + block.len : zero) - (data + i);
+            putLiteral(data + i, n);
+            i += n;
+        }
+        putTag(RLE_BLOCK, block.lost);
+        putVarint(block.mono_ns - mono_ns);
+    }
+
+    // Fills in the frame header and returns the frame. Its size is stored in size.
+    const uint8_t* finish(size_t& size)
+    {
+        CaptureFrameHeader f;
+        f.sync = htole32(CAPTURE_FRAME_SYNC);
+        f.type = htole16(FRAME_RLE);
+        f.reserved = 0;
+        f.len = htole32(len - sizeof(f));
+        f.lost = 0;
+        f.mono_ns = htole64(mono_ns);
+        f.real_ns = htole64(real_ns);
+        memcpy(buf, &f, sizeof(f));
+        size = len;
+        return buf;
+    }
+};
+
+// Unpacks the blocks of a FRAME_RLE frame.
+class RleFrameDecoder
+{
+    const uint8_t* payload = nullptr;
+    size_t len = 0;
+    size_t pos = 0;
+    uint64_t mono_ns;
+    uint64_t real_ns;
+    RleHistory hist;
+
+    bool getVarint(uint64_t& v)
+    {
+        v = 0;
+        for (int shift = 0; pos < len && shift < 64; shift += 7)
+        {
+            uint8_t b = payload[pos++];
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if ((b & 0x80) == 0)
+                return true;
+        }
+        return false;
+    }
+
+  public:
+    // Starts on the frame with header h and the len bytes of payload at p, which
+    // must stay valid while its blocks are unpacked.
+    void start(const CaptureFrameHeader& h, const uint8_t* p, size_t n)
+    {
+        payload = p;
+        len = n;
+        pos = 0;
+        hist.n = 0;
+        mono_ns = le64toh(h.mono_ns);
+        real_ns = le64toh(h.real_ns);
+    }
+
+    void clear() { pos = len = 0; }
+
+    // Unpacks the next block. Returns false at the end of the frame. Damage ends
+    // the frame and adds the bytes left out to skipped.
+    bool next(CaptureBlock& block, uint64_t& skipped)
+    {
+        block.len = 0;
+        uint64_t tag;
+        while (pos < len)
+        {
+            size_t start = pos;
+            if (!getVarint(tag))
+                break;
+            uint64_t n = tag >> 2;
+            switch (tag & 3)
+            {
+                case RLE_LITERAL:
+                    if (n > len - pos || n > CAPTURE_BLOCK_SIZE - block.len)
+                        goto damaged;
+                    memcpy(block.data + block.len, payload + pos, n);
+                    hist.toFront(hist.n, payload + pos, n);
+                    block.len += n;
+                    pos += n;
+                    break;
+                case RLE_IDLE:
+                    if (n > CAPTURE_BLOCK_SIZE - block.len)
+                        goto damaged;
+                    memset(block.data + block.len, 0, n);
+                    block.len += n;
+                    break;
+                case RLE_REPEAT:
+                    if (n >= (uint64_t)hist.n || hist.len[n] > CAPTURE_BLOCK_SIZE - block.len)
+                        goto damaged;
+                    memcpy(block.data + block.len, hist.data[n], hist.len[n]);
+                    block.len += hist.len[n];
+                    hist.toFront(n, hist.data[n], hist.len[n]);
+                    break;
+                case RLE_BLOCK:
+                {
+                    uint64_t delta;
+                    if (!getVarint(delta))
+                        goto damaged;
+                    block.lost = n;
+                    block.mono_ns = mono_ns + delta;
+                    block.real_ns = real_ns + delta;
+                    return true;
+                }
+            }
+            continue;
+        damaged:
+            skipped += len - start;
+            break;
+        }
+        pos = len;
+        return false;
+    }
+};
+
+// Returns true if h looks like the header of a frame that a reader can handle.
+inline bool captureFrameValid(const CaptureFrameHeader& h)
+{
+    uint32_t len = le32toh(h.len);
+    return le32toh(h.sync) == CAPTURE_FRAME_SYNC && len <= RleFrameEncoder::MAX_LEN &&
+           (le16toh(h.type) != FRAME_TOKENS || len <= CAPTURE_BLOCK_SIZE);
+}
+
+// Returns true if h is the header of the index, which comes after all capture data.
+inline bool captureFrameIsIndex(const CaptureFrameHeader& h)
+{
+    return le32toh(h.sync) == CAPTURE_FRAME_SYNC && le16toh(h.type) == FRAME_INDEX;
+}
+
+// Checks the file header at the start of the size bytes at data. Returns the
+// offset of the first frame or 0 and sets err. If latency_timer is not null, it
+// is set to the USB latency timer the file was recorded with (-1 if unknown).
+inline size_t captureFileStart(const void* data, size_t size, const char*& err, int* latency_timer = nullptr)
+{
+    CaptureFileHeader h;
+    if (size < CAPTURE_FILE_HEADER_MIN || memcmp(data, CAPTURE_FILE_MAGIC, sizeof(h.magic)) != 0)
+    {
+        err = "not a capture file";
+        return 0;
+    }
+    memcpy(&h, data, size < sizeof(h) ? size : sizeof(h));
+    if (le32toh(h.version) == 0 || le32toh(h.version) > CAPTURE_FILE_VERSION)
+    {
+        err = "unsupported capture file version";
+        return 0;
+    }
+    size_t header_size = le32toh(h.header_size);
+    if (header_size < CAPTURE_FILE_HEADER_MIN || header_size > size)
+    {
+        err = "corrupt capture file header";
+        return 0;
+    }
+    if (latency_timer != nullptr)
+        *latency_timer = header_size >= sizeof(h) && size >= sizeof(h) ? (int32_t)le32toh(h.latency_timer) : -1;
+    return header_size;
+}
+
+// Reads the frames of a capture file back as CaptureBlocks.
+class CaptureFileReader
+{
+    FILE* f = nullptr;
+    const char* err = nullptr;
+    uint8_t* payload = nullptr;
+    RleFrameDecoder rle;   // the FRAME_RLE frame being unpacked
+    uint64_t frame_offset; // of the frame the last block came from
+    int latency = -1;      // USB latency timer from the file header
+
+    // Positions f at the entries of the index and sets h to its header. Returns
+    // false if the file has none, in which case the position is undefined.
+    bool findIndex(CaptureFrameHeader& h, size_t& entry_size)
+    {
+        CaptureFileTrailer t;
+        if (fseek(f, -(long)sizeof(t), SEEK_END) != 0 || fread(&t, sizeof(t), 1, f) != 1 ||
+            memcmp(t.magic, CAPTURE_INDEX_MAGIC, sizeof(t.magic)) != 0 ||
+            fseek(f, le64toh(t.index_offset), SEEK_SET) != 0 || fread(&h, sizeof(h), 1, f) != 1 ||
+            !captureFrameIsIndex(h))
+            return false;
+        entry_size = le16toh(h.reserved);
+        if (entry_size == 0)
+            entry_size = CaptureIndexEntry::OLD_SIZE;
+        return entry_size >= CaptureIndexEntry::OLD_SIZE;
+    }
+
+  public:
+    uint64_t skipped = 0; // bytes skipped to find the next frame after damage
+
+    ~CaptureFileReader()
+    {
+        if (f != nullptr)
+            fclose(f);
+        delete[] payload;
+    }
+
+    // Opens path and checks the file header. Returns false and sets error() on failure.
+    bool open(const char* path)
+    {
+        f = fopen(path, "rb");
+        if (f == nullptr)
+        {
+            err = strerror(errno);
+            return false;
+        }
+        CaptureFileHeader h;
+        size_t size = fread(&h, 1, sizeof(h), f);
+        size_t start = captureFileStart(&h, size, err, &latency);
+        if (start == 0)
+            return false;
+        fseek(f, start, SEEK_SET);
+        return true;
+    }
+
+    const char* error() { return err; }
+
+    // USB latency timer in ms of the TTY the file was recorded from, -1 if unknown.
+    int latencyTimer() { return latency; }
+
+    // Positions the reader at the last frame that starts at or before the
+    // CLOCK_REALTIME real_ns according to the file's index, so that next()
+    // returns the blocks from real_ns on after skipping at most 1 frame's worth.
+    // Returns false if the file has no index (e.g. because the capture was
+    // killed), in which case the reader stays at the start.
+    bool seek(uint64_t real_ns)
+    {
+        CaptureFrameHeader h;
+        size_t entry_size;
+        long here = ftell(f);
+        if (!findIndex(h, entry_size))
+        {
+            fseek(f, here, SEEK_SET);
+            return false;
+        }
+        // binary search for the last entry <= real_ns
+        size_t lo = 0;
+        size_t hi = le32toh(h.len) / entry_size;
+        long base = ftell(f);
+        CaptureIndexEntry e;
+        uint64_t offset = here;
+        while (lo < hi)
+        {
+            size_t mid = lo + (hi - lo) / 2;
+            if (fseek(f, base + mid * entry_size, SEEK_SET) != 0 || fread(&e, CaptureIndexEntry::OLD_SIZE, 1, f) != 1)
+                break;
+            if (le64toh(e.real_ns) <= real_ns)
+            {
+                offset = le64toh(e.offset);
+                lo = mid + 1;
+            }
+            else
+                hi = mid;
+        }
+        seekFrame(offset);
+        return true;
+    }
+
+    // Reads the index into a new[]ed array in host byte order and returns the
+    // number of entries, 0 if the file has no index. The entries of old files
+    // claim every address and the idle decoder state.
+    size_t loadIndex(CaptureIndexEntry*& index)
+    {
+        CaptureFrameHeader h;
+        size_t entry_size;
+        long here = ftell(f);
+        size_t n = 0;
+        index = nullptr;
+        if (findIndex(h, entry_size))
+        {
+            n = le32toh(h.len) / entry_size;
+            index = new CaptureIndexEntry[n];
+            size_t size = entry_size < sizeof(*index) ? entry_size : sizeof(*index);
+            for (size_t i = 0; i < n; i++)
+            {
+                CaptureIndexEntry& e = index[i];
+                memset(&e, 0, sizeof(e));
+                if (fread(&e, size, 1, f) != 1 || fseek(f, entry_size - size, SEEK_CUR) != 0)
+                {
+                    n = i;
+                    break;
+                }
+                e.mono_ns = le64toh(e.mono_ns);
+                e.real_ns = le64toh(e.real_ns);
+                e.offset = le64toh(e.offset);
+                for (int k = 0; k < 2; k++)
+                {
+                    e.addrs[k] = size > CaptureIndexEntry::OLD_SIZE ? le64toh(e.addrs[k]) : ~(uint64_t)0;
+                    e.naks[k] = size > CaptureIndexEntry::OLD_SIZE ? le64toh(e.naks[k]) : ~(uint64_t)0;
+                }
+            }
+        }
+        fseek(f, here, SEEK_SET);
+        return n;
+    }
+
+    // Continues reading with the frame at offset, e.g. an entry of loadIndex().
+    void seekFrame(uint64_t offset)
+    {
+        fseek(f, offset, SEEK_SET);
+        rle.clear();
+    }
+
+    // Returns the file offset of the frame the last block returned by next() is from.
+    uint64_t frameOffset() const { return frame_offset; }
+
+    // Reads the next block. Returns false at the end of the capture data.
+    bool next(CaptureBlock& block)
+    {
+        if (rle.next(block, skipped))
+            return true;
+
+        CaptureFrameHeader h;
+        for (;;)
+        {
+            frame_offset = ftell(f);
+            if (fread(&h, sizeof(h), 1, f) != 1 || captureFrameIsIndex(h))
+                return false;
+            if (!captureFrameValid(h))
+            { // damaged => try again 1 byte further
+                fseek(f, 1 - (long)sizeof(h), SEEK_CUR);
+                skipped++;
+                continue;
+            }
+            uint32_t n = le32toh(h.len);
+            if (payload == nullptr)
+                payload = new uint8_t[RleFrameEncoder::MAX_LEN];
+            if (fread(payload, 1, n, f) != n)
+                return false; // truncated last frame
+            if (le16toh(h.type) == FRAME_TOKENS)
+            {
+                memcpy(block.data, payload, n);
+                block.len = n;
+                block.lost = le32toh(h.lost);
+                block.mono_ns = le64toh(h.mono_ns);
+                block.real_ns = le64toh(h.real_ns);
+                return true;
+            }
+            if (le16toh(h.type) != FRAME_RLE)
+                continue;
+            rle.start(h, payload, n);
+            if (rle.next(block, skipped))
+                return true;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2022 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef CAPTURE_MERGE_H
+#define CAPTURE_MERGE_H
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "capture_file.h"
+
+// Merges the text output of several I2CDrivers capturing at the same time
+// (--capture with several --tty) into 1 stream ordered by CLOCK_MONOTONIC. Each
+// line (a transaction up to its STOP, or an error) is prefixed with its time
+// since the start of the capture and the name of the adapter. The TTY driver
+// hands data over in bursts, so the bytes of a block are taken to have arrived
+// evenly spread over the time since the previous block of the same adapter, as
+// --replay does. A line is printed once every adapter has delivered its data up
+// to the time of the line, so that no earlier line can come after it.
+class CaptureMerger
+{
+  public:
+    static const int MAX_ADAPTERS = 8;
+
+  private:
+    static const size_t SLICE = 64;
+
+    struct Line
+    {
+        uint64_t ts_ns; // when its first event arrived
+        size_t end;     // offset in text after its '\n'
+    };
+
+    struct Adapter
+    {
+        const char* name;
+        CaptureDecoder decoder;
+        FILE* mem = nullptr; // appends to text
+        OutBuf* out = nullptr;
+        char* text = nullptr; // formatted, from the oldest line not yet printed on
+        size_t len = 0;
+        size_t cap = 0;
+        Line* lines = nullptr; // complete lines in text
+        size_t nlines = 0;
+        size_t lines_cap = 0;
+        bool pending = false; // text ends with a line that is not complete yet
+        uint64_t pending_ns;  // when it started
+        uint64_t prev_ns = 0; // time of the previous block
+        uint64_t watermark = 0; // lines still to come are not older than this
+        bool finished = false;
+
+        // for the estimate of the USB latency
+        uint64_t reads = 0;
+        double gap_sum = 0;  // ns between reads
+        double gap_sum2 = 0; // squares of them
+        uint64_t gap_max = 0;
+        int latency_timer = -1; // ms, from sysfs
+
+        static ssize_t write(void* cookie, const char* data, size_t n)
+        {
+            Adapter* a = (Adapter*)cookie;
+            if (a->len + n > a->cap)
+            {
+                a->cap = a->len + n > 2 * a->cap ? a->len + n : 2 * a->cap;
+                a->text = (char*)realloc(a->text, a->cap);
+            }
+            memcpy(a->text + a->len, data, n);
+            a->len += n;
+            return n;
+        }
+
+        void addLine(uint64_t ts_ns, size_t end)
+        {
+            if (nlines == lines_cap)
+            {
+                lines_cap = lines_cap == 0 ? 256 : 2 * lines_cap;
+                lines = (Line*)realloc(lines, lines_cap * sizeof(Line));
+            }
+            lines[nlines++] = {ts_ns, end};
+        }
+
+        // Splits the text appended since old_len, which arrived at ts_ns, into lines.
+        void split(size_t old_len, uint64_t ts_ns)
+        {
+            size_t start = old_len;
+            const char* nl;
+            while ((nl = (const char*)memchr(text + start, '\n', len - start)) != nullptr)
+            {
+                addLine(pending ? pending_ns : ts_ns, nl + 1 - text);
+                pending = false;
+                start = nl + 1 - text;
+            }
+            if (start < len && !pending)
+            {
+                pending = true;
+                pending_ns = ts_ns;
+            }
+        }
+    };
+
+    const CaptureText& ctext;
+    const Color& color;
+    Adapter adapters[MAX_ADAPTERS];
+    int nadapters = 0;
+    uint64_t start_ns;
+    OutBuf out;
+    CaptureEvent ev[CaptureDecoder::MAX_EVENTS_PER_BYTE * SLICE];
+
+    // Prints the lines that no adapter can precede anymore.
+    void emit()
+    {
+        uint64_t limit = UINT64_MAX;
+        for (int i = 0; i < nadapters; i++)
+            if (!adapters[i].finished && adapters[i].watermark < limit)
+                limit = adapters[i].watermark;
+        size_t next[MAX_ADAPTERS] = {};
+        for (;;)
+        {
+            int best = -1;
+            for (int i = 0; i < nadapters; i++)
+            {
+                Adapter& a = adapters[i];
+                if (next[i] < a.nlines && a.lines[next[i]].ts_ns <= limit &&
+                    (best < 0 || a.lines[next[i]].ts_ns < adapters[best].lines[next[best]].ts_ns))
+                    best = i;
+            }
+            if (best < 0)
+                break;
+            Adapter& a = adapters[best];
+            const Line& l = a.lines[next[best]];
+            size_t begin = next[best] == 0 ? 0 : a.lines[next[best] - 1].end;
+            char prefix[64];
+            int n = snprintf(prefix, sizeof(prefix), "%11.6f %-8s ", (l.ts_ns - start_ns) / 1e9, a.name);
+            out.reserve(n + l.end - begin);
+            out.put(prefix, n);
+            if (l.end - begin > 65536 - (size_t)n) // longer than OutBuf can hold
+            {
+                out.flush();
+                fwrite(a.text + begin, 1, l.end - begin, stdout);
+            }
+            else
+                out.put(a.text + begin, l.end - begin);
+            next[best]++;
+        }
+        // forget what has been printed
+        for (int i = 0; i < nadapters; i++)
+        {
+            Adapter& a = adapters[i];
+            if (next[i] == 0)
+                continue;
+            size_t done = a.lines[next[i] - 1].end;
+            memmove(a.text, a.text + done, a.len - done);
+            a.len -= done;
+            a.nlines -= next[i];
+            for (size_t k = 0; k < a.nlines; k++)
+                a.lines[k] = {a.lines[k + next[i]].ts_ns, a.lines[k + next[i]].end - done};
+        }
+    }
+
+  public:
+    CaptureMerger(const CaptureText& text, const Color& color, uint64_t start_ns)
+        : ctext(text), color(color), start_ns(start_ns), out(stdout)
+    {
+    }
+
+    ~CaptureMerger()
+    {
+        for (int i = 0; i < nadapters; i++)
+        {
+            delete adapters[i].out;
+            fclose(adapters[i].mem);
+            free(adapters[i].text);
+            free(adapters[i].lines);
+        }
+    }
+
+    // Adds an adapter and returns its number for add(). name is used as its tag
+    // and latency_timer is the USB latency timer of its TTY in ms (-1 if unknown).
+    int addAdapter(const char* name, int latency_timer)
+    {
+        Adapter& a = adapters[nadapters];
+        const char* slash = strrchr(name, '/');
+        a.name = slash ? slash + 1 : name;
+        a.latency_timer = latency_timer;
+        cookie_io_functions_t io = {nullptr, Adapter::write, nullptr, nullptr};
+        a.mem = fopencookie(&a, "w", io);
+        setvbuf(a.mem, nullptr, _IONBF, 0); // OutBuf does the buffering
+        a.out = new OutBuf(a.mem);
+        return nadapters++;
+    }
+
+    // Decodes a block read from adapter k and prints the lines that are ready.
+    void add(int k, const CaptureBlock& block)
+    {
+        Adapter& a = adapters[k];
+        uint64_t prev = a.prev_ns;
+        if (prev != 0 && block.mono_ns > prev)
+        {
+            uint64_t gap = block.mono_ns - prev;
+            a.reads++;
+            a.gap_sum += gap;
+            a.gap_sum2 += (double)gap * gap;
+            if (gap > a.gap_max)
+                a.gap_max = gap;
+        }
+        if (prev == 0 || prev > block.mono_ns || block.lost != 0)
+            prev = block.mono_ns;
+        if (block.lost != 0)
+        {
+            a.decoder.reset();
+            size_t old_len = a.len;
+            a.out->reserve(64);
+            if (a.pending)
+                a.out->put('\n');
+            a.out->put(color.ERR);
+            a.out->put('[');
+            a.out->dec(block.lost);
+            a.out->put(" bytes lost]");
+            a.out->put(color.DEFAULT);
+            a.out->put('\n');
+            a.out->flush();
+            a.split(old_len, prev);
+        }
+        for (size_t off = 0; off < block.len; off += SLICE)
+        {
+            size_t n = block.len - off < SLICE ? block.len - off : SLICE;
+            uint64_t ts = prev + (block.mono_ns - prev) * (off + n) / block.len;
+            size_t count = a.decoder.decode(block.data + off, n, ev);
+            if (count == 0)
+                continue;
+            size_t old_len = a.len;
+            ctext.format(ev, count, *a.out);
+            a.out->flush();
+            a.split(old_len, ts);
+        }
+        a.prev_ns = block.mono_ns;
+        a.watermark = a.pending ? a.pending_ns : block.mono_ns;
+        emit();
+    }
+
+    // Tells that adapter k has stopped delivering data.
+    void finish(int k)
+    {
+        Adapter& a = adapters[k];
+        if (a.pending)
+        {
+            a.out->put('\n');
+            a.out->flush();
+            a.split(a.len - 1, a.pending_ns);
+        }
+        a.finished = true;
+        emit();
+    }
+
+    void flush() { out.flush(); }
+
+    // Prints for each adapter how often data came and how old it was on average
+    // when it was read, and the difference to the first adapter: the skew its
+    // timestamps would have without spreading the bytes of a block.
+    void reportLatency(FILE* f)
+    {
+        double age0 = 0;
+        for (int i = 0; i < nadapters; i++)
+        {
+            Adapter& a = adapters[i];
+            if (a.reads == 0)
+                continue;
+            // Data arrives at a steady rate, so it waits half a gap on average,
+            // weighted with the length of the gap.
+            double age = a.gap_sum2 / (2 * a.gap_sum) / 1e6;
+            if (i == 0)
+                age0 = age;
+            fprintf(f, "%s: %" PRIu64 " reads, every %.1f ms on average (max %.1f ms)", a.name, a.reads,
+                    a.gap_sum / a.reads / 1e6, a.gap_max / 1e6);
+            if (a.latency_timer >= 0)
+                fprintf(f, ", latency_timer %d ms", a.latency_timer);
+            fprintf(f, ", data %.1f ms old when read", age);
+            if (i > 0)
+                fprintf(f, ", skew %+.1f ms to %s", age - age0, adapters[0].name);
+            fputc('\n', f);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ * Copyright (C) 2022 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef COLLAPSE_H
+#define COLLAPSE_H
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "capture.h"
+
+// Collapses repeated transactions (START up to STOP) in the --capture text
+// output for --collapse. Each transaction is hashed and looked up among the
+// last HISTORY different ones. A new one is printed right away, a repeat is
+// only counted. Every interval_ns of capture time, and when a transaction drops
+// out of the history, its repeats are printed as 1 line with the count and the
+// rate, e.g. "[1000x 200.0/s] SW48.00.SR48.1A.2B'P". Looking beyond the
+// previous transaction lets the round-robin polling of several devices
+// collapse, too. Everything that is not a complete transaction (errors,
+// messages cut off by idle bus) is passed through as is.
+class CaptureCollapser
+{
+  public:
+    static const int HISTORY = 8;
+    static const size_t MAX_EVENTS = 256; // longer transactions are not collapsed
+
+  private:
+    struct Seen
+    {
+        uint64_t hash;
+        size_t n;
+        CaptureEvent ev[MAX_EVENTS];
+        uint64_t repeats;  // since the last line printed for it
+        uint64_t since_ns; // time of that line
+        uint64_t last_ns;  // time of the last repeat
+    };
+
+    const CaptureText& text;
+    uint64_t interval_ns;
+    uint64_t report_ns = 0; // time of the last report, 0 before the first event
+
+    Seen* seen; // [0] is the most recent
+    int nseen = 0;
+
+    CaptureEvent cur[MAX_EVENTS]; // the transaction being received
+    size_t ncur = 0;
+    bool in_txn = false;
+    bool too_long = false; // cur has been printed and the rest is passed through
+    uint64_t cur_ns;       // when it started
+    uint64_t collapsed = 0;
+
+    static uint64_t hash(const CaptureEvent* ev, size_t n)
+    {
+        uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+        for (size_t i = 0; i < n; i++)
+        {
+            h = (h ^ (ev[i].raw & 0xff)) * 0x100000001b3ULL;
+            h = (h ^ (ev[i].raw >> 8)) * 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    void report(Seen& s, OutBuf& out)
+    {
+        if (s.repeats == 0)
+            return;
+        double secs = (s.last_ns - s.since_ns) / 1e9;
+        char count[64];
+        snprintf(count, sizeof(count), "[%" PRIu64 "x %.1f/s] ", s.repeats, secs > 0 ? s.repeats / secs : 0.0);
+        out.reserve(sizeof(count));
+        out.put(count);
+        text.format(s.ev, s.n, out);
+        s.repeats = 0;
+        s.since_ns = s.last_ns;
+    }
+
+    // Moves seen[i] (nseen to add a new one) to the front.
+    void toFront(int i, OutBuf& out)
+    {
+        if (i == nseen && nseen < HISTORY)
+            nseen++;
+        else if (i == nseen)
+            report(seen[--i], out); // drops out of the history
+        Seen s = seen[i];
+        for (; i > 0; i--)
+            seen[i] = seen[i - 1];
+        seen[0] = s;
+    }
+
+    // Prints cur, or counts it if it is a repeat.
+    void endTransaction(OutBuf& out)
+    {
+        in_txn = false;
+        if (too_long)
+        {
+            too_long = false;
+            return;
+        }
+        uint64_t h = hash(cur, ncur);
+        for (int i = 0; i < nseen; i++)
+            if (seen[i].hash == h && seen[i].n == ncur && memcmp(seen[i].ev, cur, ncur * sizeof(*cur)) == 0)
+            {
+                seen[i].repeats++;
+                seen[i].last_ns = cur_ns;
+                collapsed++;
+                toFront(i, out);
+                return;
+            }
+        toFront(nseen, out);
+        text.format(cur, ncur, out);
+        Seen& s = seen[0];
+        s.hash = h;
+        s.n = ncur;
+        memcpy(s.ev, cur, ncur * sizeof(*cur));
+        s.repeats = 0;
+        s.since_ns = s.last_ns = cur_ns;
+    }
+
+  public:
+    // Prints the repeats every interval_secs of capture time, never if 0.
+    CaptureCollapser(const CaptureText& text, uint64_t interval_secs)
+        : text(text), interval_ns(interval_secs * 1000000000), seen(new Seen[HISTORY])
+    {
+    }
+
+    ~CaptureCollapser() { delete[] seen; }
+
+    CaptureCollapser(const CaptureCollapser&) = delete;
+    CaptureCollapser& operator=(const CaptureCollapser&) = delete;
+
+    // Number of transactions that were not printed.
+    uint64_t count() const { return collapsed; }
+
+    // Processes n events received at ts_ns and prints the text to out.
+    void feed(const CaptureEvent* ev, size_t n, uint64_t ts_ns, OutBuf& out)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            CaptureEvent e = ev[i];
+            if (too_long)
+            {
+                text.format(&e, 1, out);
+                if (e.type() == CAPTURE_STOP || e.type() == CAPTURE_IDLE)
+                    endTransaction(out);
+                continue;
+            }
+            switch (e.type())
+            {
+                case CAPTURE_START:
+                    if (!in_txn)
+                    {
+                        in_txn = true;
+                        ncur = 0;
+                        cur_ns = ts_ns;
+                    }
+                    break;
+                case CAPTURE_ADDR:
+                case CAPTURE_DATA:
+                    break;
+                case CAPTURE_STOP:
+                    if (!in_txn)
+                        break;
+                    cur[ncur++] = e;
+                    endTransaction(out);
+                    continue;
+                default: // not a complete transaction after all
+                    end(out);
+                    break;
+            }
+            if (!in_txn)
+                text.format(&e, 1, out);
+            else if (ncur < MAX_EVENTS - 1) // leave room for the STOP
+                cur[ncur++] = e;
+            else
+            {
+                text.format(cur, ncur, out);
+                text.format(&e, 1, out);
+                too_long = true;
+            }
+        }
+
+        if (report_ns == 0)
+            report_ns = ts_ns;
+        else if (interval_ns != 0 && ts_ns - report_ns >= interval_ns)
+        {
+            for (int i = nseen - 1; i >= 0; i--)
+                report(seen[i], out);
+            report_ns = ts_ns;
+        }
+    }
+
+    // Prints the transaction being received as is, because the following events
+    // are not the ones that followed it on the bus.
+    void end(OutBuf& out)
+    {
+        if (in_txn && !too_long)
+            text.format(cur, ncur, out);
+        in_txn = false;
+        too_long = false;
+    }
+
+    // Prints what is left at the end of the capture.
+    void finish(OutBuf& out)
+    {
+        end(out);
+        for (int i = nseen - 1; i >= 0; i--)
+            report(seen[i], out);
+    }
+};
+
+#endif
@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2022 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+
+// One I2C message, i.e. the address byte and the data following it up to the
+// next (repeated) START or STOP.
+struct I2CMessage
+{
+    uint64_t ts_ns;      // CLOCK_REALTIME
+    uint64_t txn;        // messages of the same transaction (up to the STOP) share this number
+    bool host;           // issued by us (--xfer, --dev) rather than observed on the bus
+    int err;             // host messages: errno value of the transaction, 0 on success
+    uint8_t addr;        // 7 bit address
+    bool rd;             // read message
+    bool addr_nak;       // address was NAKed
+    bool last_nak;       // last data byte was NAKed
+    bool stop;           // message ended with a STOP (rather than a repeated START or idle bus)
+    uint32_t len;        // number of data bytes
+    uint32_t truncated;  // data bytes that did not fit into data
+    const uint8_t* data; // len bytes
+};
+
+inline uint64_t realtimeNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Receives messages and anomalies of the capture stream.
+class MessageSink
+{
+  public:
+    virtual ~MessageSink() {}
+    virtual void message(const I2CMessage& msg) = 0;
+    // A CAPTURE_PARTIAL or CAPTURE_UNDOC event
+    virtual void anomaly(uint64_t ts_ns, CaptureEvent ev) = 0;
+    // Capture data had to be dropped because we could not keep up.
+    virtual void lost(uint64_t ts_ns, uint64_t bytes) = 0;
+    virtual void flush() = 0;
+};
+
+// Groups CaptureEvents into I2CMessages. Uses a fixed buffer, so messages
+// longer than MAX_DATA bytes are truncated.
+class MessageAssembler
+{
+  public:
+    static const uint32_t MAX_DATA = 65536;
+
+  private:
+    MessageSink** sinks;
+    int nsinks;
+    I2CMessage msg;
+    bool open = false;   // msg has been started
+    bool in_txn = false; // a START has been seen without a STOP
+    uint64_t txn = 0;
+    uint8_t buf[MAX_DATA];
+
+    void emit(bool stop)
+    {
+        if (!open)
+            return;
+        msg.stop = stop;
+        for (int i = 0; i < nsinks; i++)
+            sinks[i]->message(msg);
+        open = false;
+    }
+
+  public:
+    MessageAssembler(MessageSink** sinks, int nsinks) : sinks(sinks), nsinks(nsinks)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.data = buf;
+    }
+
+    void feed(const CaptureEvent* ev, size_t n, uint64_t ts_ns)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            CaptureEvent e = ev[i];
+            switch (e.type())
+            {
+                case CAPTURE_START:
+                    emit(false);
+                    if (!in_txn)
+                        ++txn;
+                    in_txn = true;
+                    break;
+                case CAPTURE_ADDR:
+                    emit(false); // can only happen after a PARTIAL
+                    open = true;
+                    msg.ts_ns = ts_ns;
+                    msg.txn = txn;
+                    msg.addr = e.value() >> 1;
+                    msg.rd = e.value() & 1;
+                    msg.addr_nak = e.nak();
+                    msg.last_nak = false;
+                    msg.len = 0;
+                    msg.truncated = 0;
+                    break;
+                case CAPTURE_DATA:
+                    if (!open)
+                        break;
+                    if (msg.len < MAX_DATA)
+                        buf[msg.len++] = e.value();
+                    else
+                        msg.truncated++;
+                    msg.last_nak = e.nak();
+                    break;
+                case CAPTURE_STOP:
+                    emit(true);
+                    in_txn = false;
+                    break;
+                case CAPTURE_IDLE:
+                    emit(false);
+                    in_txn = false;
+                    break;
+                case CAPTURE_PARTIAL:
+                case CAPTURE_UNDOC:
+                    for (int s = 0; s < nsinks; s++)
+                        sinks[s]->anomaly(ts_ns, e);
+                    break;
+            }
+        }
+    }
+
+    // Forgets a partially received message, because the events following it
+    // are not the ones that followed it on the bus.
+    void skip()
+    {
+        open = false;
+        in_txn = false;
+    }
+
+    // Forgets a partially received message after capture data was lost.
+    void lost(uint64_t ts_ns, uint64_t bytes)
+    {
+        skip();
+        for (int i = 0; i < nsinks; i++)
+            sinks[i]->lost(ts_ns, bytes);
+    }
+
+    // Passes the messages of a transaction issued by the host to the sinks.
+    void host(I2CMessage* m, int n)
+    {
+        ++txn;
+        for (int k = 0; k < n; k++)
+        {
+            m[k].host = true;
+            m[k].txn = txn;
+            for (int i = 0; i < nsinks; i++)
+                sinks[i]->message(m[k]);
+        }
+    }
+};
+
+// Writes messages to a libpcap file with link type DLT_I2C_LINUX, which Wireshark
+// understands. Each packet is a 1 byte bus number and 4 bytes of flags (big
+// endian, I2C_M_RD = 1 for a read), followed by the address byte with the R/W bit
+// and the data. Anomalies are not representable and are skipped.
+class PcapWriter : public MessageSink
+{
+    static const uint32_t DLT_I2C_LINUX = 209;
+    static const uint32_t SNAPLEN = 5 + 1 + MessageAssembler::MAX_DATA;
+    OutBuf out;
+
+  public:
+    PcapWriter(FILE* f) : out(f, 1 << 20)
+    {
+        struct
+        {
+            uint32_t magic = 0xa1b23c4d; // native byte order, nanosecond timestamps
+            uint16_t version_major = 2;
+            uint16_t version_minor = 4;
+            int32_t thiszone = 0;
+            uint32_t sigfigs = 0;
+            uint32_t snaplen = SNAPLEN;
+            uint32_t network = DLT_I2C_LINUX;
+        } hdr;
+        out.put((const char*)&hdr, sizeof(hdr));
+    }
+
+    void message(const I2CMessage& msg) override
+    {
+        uint32_t caplen = 5 + 1 + msg.len;
+        out.reserve(16 + caplen);
+        uint32_t rec[4] = {(uint32_t)(msg.ts_ns / 1000000000), (uint32_t)(msg.ts_ns % 1000000000), caplen,
+                           caplen + msg.truncated};
+        out.put((const char*)rec, sizeof(rec));
+        uint8_t pseudo[6] = {0, 0, 0, 0, msg.rd, (uint8_t)(msg.addr << 1 | msg.rd)};
+        out.put((const char*)pseudo, sizeof(pseudo));
+        out.put((const char*)msg.data, msg.len);
+    }
+
+    void anomaly(uint64_t ts_ns, CaptureEvent ev) override {}
+    void lost(uint64_t ts_ns, uint64_t bytes) override {}
+
+    void flush() override { out.flush(); }
+};
+
+// Writes one JSON object per line for each message and anomaly, e.g.
+// {"ts":1665400000.123456789,"src":"bus","txn":7,"addr":80,"dir":"w","nak":false,"data":"1234","last_nak":false,"stop":true}
+class JsonlWriter : public MessageSink
+{
+    OutBuf out;
+
+    void put(const char* s) { out.put(s, strlen(s)); }
+    void boolean(bool b) { put(b ? "true" : "false"); }
+
+    void ts(uint64_t ts_ns)
+    {
+        char frac[9];
+        uint32_t ns = ts_ns % 1000000000;
+        for (int i = 8; i >= 0; i--, ns /= 10)
+            frac[i] = '0' + ns % 10;
+        put("{\"ts\":");
+        out.dec(ts_ns / 1000000000);
+        out.put('.');
+        out.put(frac, 9);
+    }
+
+  public:
+    JsonlWriter(FILE* f) : out(f, 1 << 20) {}
+
+    void message(const I2CMessage& msg) override
+    {
+        out.reserve(200 + 2 * msg.len);
+        ts(msg.ts_ns);
+        put(msg.host ? ",\"src\":\"host\",\"txn\":" : ",\"src\":\"bus\",\"txn\":");
+        out.dec(msg.txn);
+        put(",\"addr\":");
+        out.dec(msg.addr);
+        put(msg.rd ? ",\"dir\":\"r\",\"nak\":" : ",\"dir\":\"w\",\"nak\":");
+        boolean(msg.addr_nak);
+        put(",\"data\":\"");
+        for (uint32_t i = 0; i < msg.len; i++)
+            out.hex2(msg.data[i]);
+        put("\",\"last_nak\":");
+        boolean(msg.last_nak);
+        put(",\"stop\":");
+        boolean(msg.stop);
+        if (msg.truncated != 0)
+        {
+            put(",\"truncated\":");
+            out.dec(msg.truncated);
+        }
+        if (msg.host)
+        {
+            put(",\"err\":");
+            out.dec(msg.err);
+        }
+        put("}\n");
+    }
+
+    void anomaly(uint64_t ts_ns, CaptureEvent ev) override
+    {
+        out.reserve(100);
+        ts(ts_ns);
+        if (ev.type() == CAPTURE_PARTIAL)
+        {
+            put(",\"src\":\"bus\",\"error\":\"partial\",\"value\":");
+            out.dec(ev.value());
+            put(",\"bits\":");
+            out.dec(ev.bits());
+        }
+        else
+        {
+            put(",\"src\":\"bus\",\"error\":\"undocumented\",\"value\":");
+            out.dec(ev.value());
+        }
+        put("}\n");
+    }
+
+    void lost(uint64_t ts_ns, uint64_t bytes) override
+    {
+        out.reserve(100);
+        ts(ts_ns);
+        put(",\"src\":\"bus\",\"error\":\"lost\",\"bytes\":");
+        out.dec(bytes);
+        put("}\n");
+    }
+
+    void flush() override { out.flush(); }
+};
+
+#endif
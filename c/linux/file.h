@@ -69,6 +69,10 @@ class File
     // Set to true if this File's open() function is used.
     bool close_on_destruction;
 
+    // If not null, called with all data written and read. See setTap().
+    void (*tap)(void* context, bool out, const void* data, size_t n) = nullptr;
+    void* tap_context = nullptr;
+
     // Initializes err and errmsg to 0 if retval >= 0 and based on errno if
     // retval < 0.
     // Returns true iff retval >= 0.
@@ -122,9 +126,19 @@ class File
         fd = filedes;
         eof = false;
         close_on_destruction = false;
+        tap = nullptr;
         errmsg[0] = 0;
     }
 
+    // Sets a function that is called with tap_ctx and every chunk of data
+    // successfully written (out == true) or read (out == false), e.g. to log the
+    // traffic. nullptr removes it.
+    void setTap(void (*tap_func)(void* tap_ctx, bool out, const void* data, size_t n), void* tap_ctx)
+    {
+        tap = tap_func;
+        tap_context = tap_ctx;
+    }
+
     // Sets a title that will be included in potential error messages.
     // Example a title "opening file" will produce an error message like
     // "Error opening file /foo/bar: No such file or directory".
@@ -508,6 +522,8 @@ class File
                     break;
                 }
 
+                if (tap != nullptr)
+                    tap(tap_context, true, buf, retval);
                 n -= retval;
                 buf = (const char*)buf + retval;
             }
@@ -834,6 +850,8 @@ class File
             }
             else
             {
+                if (tap != nullptr)
+                    tap(tap_context, false, buf, retval);
                 buf = (char*)buf + retval;
                 n -= retval;
                 if (n == 0) // buffer full
@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2022 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+// Keeps the most recent bytes sent to and received from the I2CDriver with
+// their CLOCK_MONOTONIC time and the boundaries of the transactions performed
+// by i2c_rdwr() in a fixed-size ring, so that the last seconds before a failure
+// can be analyzed without running with --verbose all the time. Recording costs
+// a clock_gettime() and a memcpy() under an uncontended mutex. The ring is
+// written as text to <prefix>-<time>.txt by a background thread on SIGUSR1 and
+// when failed() is called, at most once per second for the latter.
+class FlightRecorder
+{
+  public:
+    enum Kind : uint8_t
+    {
+        TX,    // bytes written to the TTY
+        RX,    // bytes read from the TTY
+        BEGIN, // start of a transaction, data is 1 Msg per message
+        END,   // end of a transaction, err is its errno value
+    };
+
+    struct Msg
+    {
+        uint16_t addr;
+        uint16_t flags;
+        uint16_t len;
+    };
+
+  private:
+    struct Record
+    {
+        uint64_t mono_ns;
+        uint32_t len; // bytes of data following the record
+        uint8_t kind;
+        uint8_t reserved[3];
+        int32_t err;
+        uint32_t reserved2;
+    };
+
+    static const uint64_t AUTO_DUMP_INTERVAL_NS = 1000000000;
+
+    std::mutex mutex;
+    uint8_t* ring = nullptr;
+    size_t size = 0;
+    uint64_t head = 0; // bytes written since the start
+    uint64_t tail = 0; // start of the oldest record that has not been overwritten
+    uint64_t records = 0;
+
+    const char* prefix = nullptr;
+    int wake_fd = -1;
+    std::thread thread;
+    std::atomic<bool> stopping{false};
+    std::atomic<int> failed_err{0}; // error of a failed transaction still to be dumped
+    uint64_t last_auto_ns = 0;
+
+    static inline std::atomic<bool> signaled{false};
+    static inline int signal_fd = -1;
+
+    static uint64_t monoNs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    static void onSignal(int)
+    {
+        int saved = errno;
+        signaled.store(true);
+        uint64_t one = 1;
+        ssize_t ignored = write(signal_fd, &one, sizeof(one)); // nothing we could do about an error here
+        (void)ignored;
+        errno = saved;
+    }
+
+    void put(const void* data, size_t n)
+    {
+        if (n == 0)
+            return;
+        size_t at = head % size;
+        size_t first = n < size - at ? n : size - at;
+        memcpy(ring + at, data, first);
+        memcpy(ring, (const uint8_t*)data + first, n - first);
+        head += n;
+    }
+
+    void get(uint64_t pos, void* data, size_t n) const
+    {
+        size_t at = pos % size;
+        size_t first = n < size - at ? n : size - at;
+        memcpy(data, ring + at, first);
+        memcpy((uint8_t*)data + first, ring, n - first);
+    }
+
+    void add(Kind kind, int err, const void* data, size_t n)
+    {
+        if (size == 0)
+            return;
+        if (n > size / 4)
+            n = size / 4;
+        Record r;
+        memset(&r, 0, sizeof(r));
+        r.mono_ns = monoNs();
+        r.len = n;
+        r.kind = kind;
+        r.err = err;
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t end = head + sizeof(r) + n;
+        while (end - tail > size) // drop the records that get overwritten
+        {
+            Record old;
+            get(tail, &old, sizeof(old));
+            tail += sizeof(old) + old.len;
+            records--;
+        }
+        put(&r, sizeof(r));
+        put(data, n);
+        records++;
+    }
+
+    static void putTime(FILE* f, uint64_t real_ns)
+    {
+        char when[32];
+        time_t secs = real_ns / 1000000000;
+        struct tm tm;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&secs, &tm));
+        fprintf(f, "%s.%06u", when, (unsigned)(real_ns % 1000000000 / 1000));
+    }
+
+    // Writes the ring to a new file. err is the error of the failed transaction
+    // that caused the dump, 0 for SIGUSR1.
+    void dump(int err)
+    {
+        uint64_t n;
+        uint64_t count;
+        uint8_t* copy = new uint8_t[size];
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            n = head - tail;
+            count = records;
+            get(tail, copy, n);
+        }
+        struct timespec rt;
+        clock_gettime(CLOCK_REALTIME, &rt);
+        uint64_t real_ns = (uint64_t)rt.tv_sec * 1000000000 + rt.tv_nsec;
+        uint64_t offset_ns = real_ns - monoNs();
+
+        char path[PATH_MAX];
+        char when[32];
+        time_t t = rt.tv_sec;
+        struct tm tm;
+        strftime(when, sizeof(when), "%Y%m%dT%H%M%S", localtime_r(&t, &tm));
+        snprintf(path, sizeof(path), "%s-%s-%03u.txt", prefix, when, (unsigned)(rt.tv_nsec / 1000000));
+        FILE* f = fopen(path, "w");
+        if (f == nullptr)
+        {
+            fprintf(stderr, "flight recorder: %s: %s\n", path, strerror(errno));
+            delete[] copy;
+            return;
+        }
+
+        fprintf(f, "# i2cdriver flight recorder, dumped because of %s\n", err != 0 ? strerror(err) : "SIGUSR1");
+        fprintf(f, "# %" PRIu64 " records at ", count);
+        putTime(f, real_ns);
+        fprintf(f, "\n");
+        for (uint64_t pos = 0; pos < n;)
+        {
+            Record r;
+            memcpy(&r, copy + pos, sizeof(r));
+            const uint8_t* data = copy + pos + sizeof(r);
+            pos += sizeof(r) + r.len;
+            putTime(f, r.mono_ns + offset_ns);
+            switch (r.kind)
+            {
+                case TX:
+                case RX:
+                    fputs(r.kind == TX ? " TX   " : " RX   ", f);
+                    for (uint32_t i = 0; i < r.len; i++)
+                        fprintf(f, " %02X", data[i]);
+                    break;
+                case BEGIN:
+                    fputs(" BEGIN", f);
+                    for (uint32_t i = 0; i + sizeof(Msg) <= r.len; i += sizeof(Msg))
+                    {
+                        Msg m;
+                        memcpy(&m, data + i, sizeof(m));
+                        fprintf(f, "%s %c 0x%02X %u", i == 0 ? "" : ",", (m.flags & I2C_M_RD) ? 'R' : 'W', m.addr,
+                                m.len);
+                    }
+                    break;
+                case END:
+                    fprintf(f, " END   %s", r.err == 0 ? "OK" : strerror(r.err));
+                    break;
+            }
+            fputc('\n', f);
+        }
+        bool ok = (fclose(f) == 0);
+        delete[] copy;
+        fprintf(stderr, ok ? "flight recorder dumped to %s\n" : "flight recorder: error writing %s\n", path);
+    }
+
+    void run()
+    {
+        struct pollfd pfd = {wake_fd, POLLIN, 0};
+        while (!stopping.load())
+        {
+            if (poll(&pfd, 1, -1) < 0)
+                continue;
+            uint64_t count;
+            if (read(wake_fd, &count, sizeof(count)) < 0)
+                continue;
+            if (signaled.exchange(false))
+                dump(0);
+            int err = failed_err.exchange(0);
+            if (err != 0 && monoNs() - last_auto_ns >= AUTO_DUMP_INTERVAL_NS)
+            {
+                last_auto_ns = monoNs();
+                dump(err);
+            }
+        }
+    }
+
+  public:
+    ~FlightRecorder()
+    {
+        stop();
+        delete[] ring;
+    }
+
+    // Allocates a ring of bytes bytes (0 disables recording) and installs the
+    // SIGUSR1 handler. Dumps are written to <path_prefix>-<time>.txt.
+    bool setup(size_t bytes, const char* path_prefix)
+    {
+        size = bytes;
+        prefix = path_prefix;
+        if (size == 0)
+            return true;
+        ring = new uint8_t[size];
+        wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (wake_fd < 0)
+        {
+            perror("eventfd");
+            return false;
+        }
+        signal_fd = wake_fd;
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = onSignal;
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &sa, nullptr);
+        return true;
+    }
+
+    // Starts the thread that writes the dumps. This must be done after
+    // daemonizing, because the thread would not survive the fork().
+    void start()
+    {
+        if (size != 0 && !thread.joinable())
+            thread = std::thread(&FlightRecorder::run, this);
+    }
+
+    void stop()
+    {
+        if (!thread.joinable())
+            return;
+        stopping.store(true);
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0)
+            perror("eventfd");
+        thread.join();
+    }
+
+    void sent(const void* data, size_t n) { add(TX, 0, data, n); }
+    void received(const void* data, size_t n) { add(RX, 0, data, n); }
+
+    void begin(const struct i2c_msg* msgs, unsigned nmsgs)
+    {
+        Msg m[I2C_RDWR_IOCTL_MAX_MSGS];
+        unsigned n = 0;
+        for (; n < nmsgs && n < I2C_RDWR_IOCTL_MAX_MSGS; n++)
+        {
+            m[n].addr = msgs[n].addr;
+            m[n].flags = msgs[n].flags;
+            m[n].len = msgs[n].len;
+        }
+        add(BEGIN, 0, m, n * sizeof(*m));
+    }
+
+    void end(int err) { add(END, err, nullptr, 0); }
+
+    // Requests a dump because a transaction failed with err.
+    void failed(int err)
+    {
+        if (size == 0 || !thread.joinable())
+            return;
+        failed_err.store(err);
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0)
+            perror("eventfd");
+    }
+
+    // For File::setTap().
+    static void tap(void* recorder, bool out, const void* data, size_t n)
+    {
+        FlightRecorder* r = (FlightRecorder*)recorder;
+        if (out)
+            r->sent(data, n);
+        else
+            r->received(data, n);
+    }
+};
+
+#endif
@@ -16,6 +16,7 @@
 #include <errno.h>
 #include <glob.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <linux/i2c-dev.h>
 #include <linux/i2c.h>
 #include <stdio.h>
@@ -25,9 +26,33 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include "bus_stats.h"
+#include "capture.h"
+#include "capture_archive.h"
+#include "capture_file.h"
+#include "capture_merge.h"
+#include "collapse.h"
+#include "export.h"
 #include "file.h"
+#include "flight_recorder.h"
+#include "parallel_decode.h"
+#include "protocol.h"
+#include "publish.h"
+#include "query.h"
+#include "realtime.h"
+#include "replay.h"
+#include "spsc_ring.h"
+#include "timebase.h"
+#include "trace.h"
+#include "trigger.h"
 #include <crc_pec.h>
 #include <cuse_lowlevel.h>
+#include <fuse_lowlevel.h>
 #include <optionparser.h>
 
 const char* tty = nullptr;
@@ -40,16 +65,22 @@ int nmsgs;
 bool add_pec = false;
 bool debug_cuse = false;
 int cuse_open_count = 0;
+uint64_t nak_ttl = 100000; // micros an address that NAKed its START is considered absent
+uint64_t retry_backoff = 1000; // micros before the 1st retry of a transaction for an I2C_RETRIES client
+uint64_t attr_cache = 1000000; // micros that --mount serves register values from cache
+int reg_block = 16;            // number of adjacent registers --mount reads in 1 transaction
 
 bool parse_transfer(int argc, const char* argv[], struct i2c_msg (&msgs)[I2C_RDWR_IOCTL_MAX_MSGS], int& nmsgs);
 int cuse(const char* devname, bool background);
+int regfs(const char* mountpoint, bool background);
+bool regfs_add_eeprom(const char* arg);
 
 uint64_t micros()
 {
     static uint64_t starttime(0);
-    struct timeval tv;
-    gettimeofday(&tv, 0);
-    uint64_t now = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
     if (starttime == 0)
         starttime = now;
     return now - starttime;
@@ -170,8 +201,38 @@ enum optionIndex
     SCAN,
     MONITOR,
     CAPTURE,
+    CAPTURE_OUT,
+    ROTATE_SIZE,
+    ROTATE_TIME,
+    ROTATE_KEEP,
+    CAPTURE_STATS,
+    COLLAPSE,
+    DECODE,
+    DECODE_THREADS,
+    SINCE,
+    UNTIL,
+    QUERY,
+    REPLAY,
+    REPLAY_RATE,
+    PCAP,
+    JSONL,
+    PUBLISH,
+    PROTOCOL,
+    TRIGGER,
+    PRE_TRIGGER,
+    POST_TRIGGER,
     TRANSFER,
     PEC,
+    NAK_TTL,
+    RETRY_BACKOFF,
+    FLIGHT_RECORDER,
+    FLIGHT_SIZE,
+    REALTIME,
+    REALTIME_CPUS,
+    MOUNT,
+    ATTR_CACHE,
+    REG_BLOCK,
+    EEPROM,
 };
 const option::Descriptor usage[] = {
     {UNKNOWN, 0, "", "", Arg::Unknown,
@@ -183,9 +244,25 @@ const option::Descriptor usage[] = {
     {DEV, 0, "d", "dev", Arg::Required,
      "  -d[<name>], \t--dev[=<name>]"
      "  \t(requires /dev/cuse permissions) create /dev/<name> to emulate a /dev/i2c-... bus device."},
-    {BACKGROUND, 0, "b", "background", Arg::None, "  -b, \t--background  \tHandle --dev in the background."},
+    {MOUNT, 0, "", "mount", Arg::Required,
+     "  \t--mount=<dir>"
+     "  \t(requires /dev/fuse permissions) present the devices on the bus as a filesystem mounted on <dir>, e.g. "
+     "<dir>/0x48/reg/0x00 ."},
+    {ATTR_CACHE, 0, "", "attr-cache", Arg::NonNegative,
+     "  \t--attr-cache=<ms>"
+     "  \tServe register values read via --mount from cache for <ms> milliseconds. Default: 1000."},
+    {REG_BLOCK, 0, "", "reg-block", Arg::NonNegative,
+     "  \t--reg-block=<n>"
+     "  \tWhen --mount needs to read a register, read the aligned block of <n> registers containing it in a "
+     "single transaction. Use 1 for devices whose registers have side effects when read. Default: 16."},
+    {EEPROM, 0, "", "eeprom", Arg::Required,
+     "  \t--eeprom=<addr>:<type>"
+     "  \tPresent the EEPROM at <addr> as file <dir>/<addr>/eeprom with --mount. <type> is one of 24c01, 24c02, "
+     "24c04, 24c08, 24c16, 24c32, 24c64, 24c128, 24c256, 24c512, 24cm01, 24cm02 or <size>/<pagesize>/<addressbytes>."},
+    {BACKGROUND, 0, "b", "background", Arg::None, "  -b, \t--background  \tHandle --dev or --mount in the background."},
     {TTY, 0, "t", "tty", Arg::Required,
-     "  -t <ttypath>, \t--tty=<ttypath>  \tPath to the ttyUSB device. Not required if there is only 1 possibility."},
+     "  -t <ttypath>, \t--tty=<ttypath>  \tPath to the ttyUSB device. Not required if there is only 1 possibility. "
+     "Can be given up to 8 times with --capture to merge the capture of several buses."},
     {PULLUPS, 0, "p", "pullups", Arg::Pullups,
      "  -p <kOhm>, \t--pullups=<kOhm>"
      "  \tSet pullups for SCL and SDA. Values are 0, 1.1, 1.5, 2.2, 4.3, 4.7 ."},
@@ -213,6 +290,81 @@ const option::Descriptor usage[] = {
     {CAPTURE, 0, "c", "capture", Arg::NonNegative,
      " -c <secs>, \t--capture=<secs>"
      "  \tAfter all transmissions, capture events for <secs> seconds and decode them to stdout."},
+    {CAPTURE_OUT, 0, "", "capture-out", Arg::Required,
+     "  \t--capture-out=<file>"
+     "  \tWith --capture, record the capture data with timestamps to <file> instead of decoding it. Idle bus and "
+     "repeated transactions are run-length compressed."},
+    {ROTATE_SIZE, 0, "", "rotate-size", Arg::NonNegative,
+     "  \t--rotate-size=<MB>"
+     "  \tWith --capture-out, start a new file whenever the current one reaches <MB> megabytes. The UTC start time is "
+     "inserted into the names, e.g. bus-20221018T071500.000Z.cap ."},
+    {ROTATE_TIME, 0, "", "rotate-time", Arg::NonNegative,
+     "  \t--rotate-time=<secs>"
+     "  \tLike --rotate-size, but start a new file every <secs> seconds."},
+    {ROTATE_KEEP, 0, "", "rotate-keep", Arg::NonNegative,
+     "  \t--rotate-keep=<n>"
+     "  \tWith --rotate-size or --rotate-time, delete all but the newest <n> files."},
+    {CAPTURE_STATS, 0, "", "capture-stats", Arg::NonNegative,
+     "  \t--capture-stats=<secs>"
+     "  \tWith --capture or --decode, show per-address statistics every <secs> seconds instead of the events. "
+     "0 shows them only at the end."},
+    {COLLAPSE, 0, "", "collapse", Arg::NonNegative,
+     "  \t--collapse=<secs>"
+     "  \tWith --capture or --decode, print repeats of a recent transaction only as 1 line with their number and "
+     "rate every <secs> seconds. 0 prints them only when the transaction is no longer among the last 8."},
+    {DECODE, 0, "", "decode", Arg::Required,
+     "  \t--decode=<file>"
+     "  \tDecode a <file> recorded with --capture-out to stdout. Does not access the I2CDriver. <file> may be a "
+     "pattern such as 'bus-*.cap' to decode all files of a rotated capture."},
+    {DECODE_THREADS, 0, "", "decode-threads", Arg::NonNegative,
+     "  \t--decode-threads=<n>"
+     "  \tDecode with <n> threads. Default: 1 per CPU core. Only plain --decode output is decoded in parallel."},
+    {SINCE, 0, "", "since", Arg::Required,
+     "  \t--since=<time>"
+     "  \tWith --decode or --replay, skip the capture data before <time>, given as seconds since the epoch, as "
+     "'YYYY-MM-DD HH:MM[:SS]' local time or as 'HH:MM[:SS]' today."},
+    {UNTIL, 0, "", "until", Arg::Required,
+     "  \t--until=<time>"
+     "  \tWith --decode or --replay, stop at <time>."},
+    {QUERY, 0, "", "query", Arg::Required,
+     "  \t--query=<expr>"
+     "  \tWith --decode, print only the transactions with a message that matches <expr> (see --trigger; "
+     "contains=<hex> finds bytes anywhere in the data). Uses the index of the file to decode only the parts that "
+     "can match. Can be given multiple times to match any of the expressions."},
+    {REPLAY, 0, "", "replay", Arg::Required,
+     "  \t--replay=<file>"
+     "  \tRe-issue the transactions recorded with --capture-out in <file> (or files matching a pattern) as bus "
+     "master, then report throughput, latency and responses that differ from the recording."},
+    {REPLAY_RATE, 0, "", "replay-rate", Arg::Required,
+     "  \t--replay-rate=<factor>"
+     "  \tWith --replay, issue the transactions <factor> times as fast as recorded. 0 means as fast as possible. "
+     "Default: 1."},
+    {PCAP, 0, "", "pcap", Arg::Required,
+     "  \t--pcap=<file>"
+     "  \tWrite captured messages and transactions performed by i2cdriver to <file> in libpcap format for "
+     "Wireshark instead of decoding them as text. '-' is stdout."},
+    {JSONL, 0, "", "jsonl", Arg::Required,
+     "  \t--jsonl=<file>"
+     "  \tLike --pcap, but write 1 JSON object per message to <file>."},
+    {PUBLISH, 0, "", "publish", Arg::Required,
+     "  \t--publish=<socket>"
+     "  \tWith --capture, serve the --jsonl lines to every process that connects to the Unix socket <socket>. "
+     "Subscribers that do not keep up lose the oldest lines instead of slowing down the capture."},
+    {PROTOCOL, 0, "", "protocol", Arg::Required,
+     "  \t--protocol=<name>[@<addr>]"
+     "  \tShow captured transactions with <addr> (default: all) as interpreted by protocol <name> instead of the "
+     "events, e.g. 'reg 0x05 of 0x48 read = 0x1A2B'. <name> is one of reg, reg16, smbus, smbus+pec, pmbus, "
+     "pmbus+pec."},
+    {TRIGGER, 0, "", "trigger", Arg::Required,
+     "  \t--trigger=<expr>"
+     "  \tOnly show the captured events around messages that match <expr>, a ','-separated list of conditions that "
+     "must all hold: <addr>, r, w, nak, nodata, data=<hex>, error. Multiple --trigger options match if any does."},
+    {PRE_TRIGGER, 0, "", "pre-trigger", Arg::NonNegative,
+     "  \t--pre-trigger=<n>"
+     "  \tWith --trigger, show up to <n> events before a match. Default: 256."},
+    {POST_TRIGGER, 0, "", "post-trigger", Arg::NonNegative,
+     "  \t--post-trigger=<n>"
+     "  \tWith --trigger, show <n> events after a match. Default: 256."},
     {TRANSFER, 0, "x", "xfer", Arg::Required,
      " -x, \t--xfer=<data>"
      "  \tPerform I2C transfer(s) according to <data>. See below for details."},
@@ -220,6 +372,29 @@ const option::Descriptor usage[] = {
      "  \t--pec"
      "  \tAttach a Packet Error Checking byte to each subsequent write-only --xfer datastream. Report PEC for read "
      "and write --xfers."},
+    {NAK_TTL, 0, "", "nak-ttl", Arg::NonNegative,
+     "  \t--nak-ttl=<ms>"
+     "  \tFor <ms> milliseconds after an address NAKed, transactions to it fail immediately with ENXIO "
+     "without touching the bus. Repeated NAKs extend this time exponentially. 0 disables. Default: 100."},
+    {RETRY_BACKOFF, 0, "", "retry-backoff", Arg::NonNegative,
+     "  \t--retry-backoff=<ms>"
+     "  \tIf a --dev client has set I2C_RETRIES, a transaction that was NAKed or lost arbitration is retried after "
+     "<ms> milliseconds. Each further retry waits twice as long. Default: 1."},
+    {FLIGHT_RECORDER, 0, "", "flight-recorder", Arg::Required,
+     "  \t--flight-recorder=<prefix>"
+     "  \tThe recent traffic with the I2CDriver is kept in memory and written to <prefix>-<time>.txt when a "
+     "transaction fails or on SIGUSR1. Default: /tmp/i2cdriver-flight"},
+    {FLIGHT_SIZE, 0, "", "flight-size", Arg::NonNegative,
+     "  \t--flight-size=<KB>"
+     "  \tSize of the --flight-recorder memory. 0 disables it. Default: 1024."},
+    {REALTIME, 0, "", "realtime", Arg::NonNegative,
+     "  \t--realtime=<prio>"
+     "  \tRun the threads that read --capture data or serve --dev and --mount with SCHED_FIFO priority <prio> "
+     "(1-99), lock the memory of the process and pre-fault buffers. At the end, latency histograms of the capture "
+     "reads and the transactions are printed to stderr. With 0, priority and memory are left alone, for comparison."},
+    {REALTIME_CPUS, 0, "", "realtime-cpus", Arg::Required,
+     "  \t--realtime-cpus=<list>"
+     "  \tPin the threads of --realtime to the CPUs in <list>, e.g. 2,3 or 2-3."},
     {UNKNOWN, 0, "", "", Arg::None,
      "\nTRANSFER DATA STRING:\n"
      "A transfer may consist of multiple messages and is started with a START condition and ends with a STOP "
@@ -369,22 +544,22 @@ void resetBus()
 // 0: if the I2CDriver is ready
 // 1: if the I2CDriver is not ready (but there are no I/O errors)
 // -1: if an I/O error occured accessing the TTY
-int waitReady()
+int waitReady(File& dev = i2cd)
 {
     int i;
     for (i = 0; i < 100; i++)
     {
         char buf[4];
-        i2cd.writeAll("@i e\n", 5);
-        if (i2cd.read(buf, sizeof(buf), 5, 100, 50) > 0 && buf[0] == '\n')
+        dev.writeAll("@i e\n", 5);
+        if (dev.read(buf, sizeof(buf), 5, 100, 50) > 0 && buf[0] == '\n')
         {
-            i2cd.writeAll("e\0", 2);
-            if (i2cd.read(buf, sizeof(buf), 5, 100, 50) > 0 && buf[0] == '\0')
+            dev.writeAll("e\0", 2);
+            if (dev.read(buf, sizeof(buf), 5, 100, 50) > 0 && buf[0] == '\0')
                 return 0;
         }
-        if (i2cd.hasError() && i2cd.errNo() != EWOULDBLOCK)
+        if (dev.hasError() && dev.errNo() != EWOULDBLOCK)
             return -1;
-        i2cd.clearError();
+        dev.clearError();
     }
     return 1;
 }
@@ -398,18 +573,106 @@ void reboot()
     fprintf(stdout, "I2CDriver reboot %s\n", success ? "SUCCESSFUL" : "FAILED");
 }
 
-void scan()
+// Bits of the status byte the I2CDriver sends in reply to START and write commands
+// and for each address during a scan.
+const uint8_t STATUS_OK = 0b110001;      // '1'
+const uint8_t STATUS_NAK = 0b110000;     // '0'
+const uint8_t STATUS_ACK_BIT = 1;
+const uint8_t STATUS_TIMEOUT_BIT = 2;
+const uint8_t STATUS_ARBLOST_BIT = 4;
+
+// Remembers addresses whose START condition was recently NAKed, so that repeated
+// transactions to absent devices can fail with ENXIO without occupying the bus.
+// Every consecutive NAK doubles the time an address is considered absent (up to
+// 2^MAX_BACKOFF * nak_ttl), which backs off clients that keep hammering an absent
+// address. When such a backed-off entry expires, the whole cache is refreshed
+// with a single 'd' scan instead of probing the address with a transaction.
+struct PresenceCache
+{
+    static const int MAX_BACKOFF = 6;
+
+    uint64_t expires[128] = {}; // micros() until which the address is considered absent
+    uint8_t strikes[128] = {};  // number of consecutive NAKs
+    uint64_t short_circuited = 0;
+    uint64_t scans = 0;
+
+    // Returns true if addr is known to be absent and the transaction should be refused.
+    bool absent(int addr)
+    {
+        if (nak_ttl == 0 || expires[addr] == 0)
+            return false;
+        if (micros() < expires[addr])
+        {
+            ++short_circuited;
+            return true;
+        }
+        return false;
+    }
+
+    // Returns true if addr's entry has expired after repeated NAKs, which means
+    // it is time to find out if it has appeared.
+    bool needsRefresh(int addr) { return expires[addr] != 0 && strikes[addr] > 1 && micros() >= expires[addr]; }
+
+    void nak(int addr)
+    {
+        if (nak_ttl == 0)
+            return;
+        if (strikes[addr] <= MAX_BACKOFF)
+            ++strikes[addr];
+        expires[addr] = micros() + (nak_ttl << (strikes[addr] - 1));
+    }
+
+    void ack(int addr)
+    {
+        strikes[addr] = 0;
+        expires[addr] = 0;
+    }
+
+    // Updates all entries from the result of a 'd' scan. Addresses that did not
+    // reply count as a NAK only if they were NAKing before. Others are merely
+    // remembered as absent for nak_ttl.
+    void update(const char (&result)[112])
+    {
+        ++scans;
+        for (int i = 0; i < 112; ++i)
+        {
+            int addr = i + 8;
+            if (result[i] == '1')
+                ack(addr);
+            else if (result[i] == '0')
+            {
+                if (strikes[addr] > 0)
+                    nak(addr);
+                else if (nak_ttl != 0)
+                    expires[addr] = micros() + nak_ttl;
+            }
+        }
+    }
+} presence;
+
+// Performs a 'd' scan and stores the status character of addresses 0x08 to 0x77
+// in result. Returns false if the I2CDriver did not reply properly.
+bool scanBus(char (&result)[112])
 {
     i2cd.action("scanning bus");
     i2cd.writeAll("d", 1);
     char buf[200];
     int sz = i2cd.read(buf, sizeof(buf), 20, -1, 500);
-    if (sz == 112)
+    if (sz != 112)
+        return false;
+    memcpy(result, buf, 112);
+    presence.update(result);
+    return true;
+}
+
+void scan()
+{
+    char result[112];
+    if (scanBus(result))
     {
-        buf[sz] = 0;
         for (int i = 0; i < 112; ++i)
         {
-            switch (buf[i])
+            switch (result[i])
             {
                 case '0':
                     break;
@@ -424,13 +687,13 @@ void scan()
     }
 }
 
-void maybeSet(unsigned char ch)
+void maybeSet(unsigned char ch, File& dev = i2cd)
 {
     if (ch != 255)
     {
-        i2cd.writeAll(&ch, 1);
-        i2cd.writeAll("\n", 1);
-        i2cd.writeAll(&ch, 1);
+        dev.writeAll(&ch, 1);
+        dev.writeAll("\n", 1);
+        dev.writeAll(&ch, 1);
     }
 }
 
@@ -446,156 +709,537 @@ void maybeSet2(unsigned char ch, unsigned char ch2)
     }
 }
 
-struct Color
+Color color;
+CaptureDecoder capture_decoder;
+CaptureTimebase capture_timebase; // timestamps of the events passed on by showCaptureBlock()
+CaptureText capture_text(color);
+OutBuf capture_out(stdout);
+TraceLogger tracer(capture_text, color, stdout); // transactions with --verbose or debug CUSE output
+FlightRecorder flight_recorder;
+Realtime realtime;
+
+// Decodes n bytes of the I2CDriver's capture token stream and appends the text
+// to capture_out, which needs to be flushed before anything else is written to stdout.
+void decodeCapture(const uint8_t* data, size_t n)
+{
+    static const size_t CHUNK = 4096;
+    CaptureEvent ev[CaptureDecoder::MAX_EVENTS_PER_BYTE * CHUNK];
+    while (n > 0)
+    {
+        size_t l = n > CHUNK ? CHUNK : n;
+        size_t count = capture_decoder.decode(data, l, ev);
+        capture_text.format(ev, count, capture_out);
+        data += l;
+        n -= l;
+    }
+}
+
+// 256 blocks of 4KiB buffer more than 10s of a busy bus.
+typedef SpscRing<CaptureBlock, 256> CaptureRing;
+
+struct CaptureStats
+{
+    uint64_t bytes = 0;    // bytes read from the TTY
+    uint64_t blocks = 0;   // blocks passed through the ring
+    uint64_t overruns = 0; // number of times the ring was full
+    uint64_t dropped = 0;  // bytes read while the ring was full
+    size_t max_fill = 0;   // maximum number of blocks waiting in the ring
+    LatencyHistogram gaps; // between the ends of 2 reads, for --realtime
+};
+
+// Reads the capture token stream from tty into ring until micros() reaches stop
+// or the TTY fails to deliver. This never waits for the consumer. If the ring is
+// full, the data is read anyway and dropped, so that the TTY's buffers can not
+// overrun, and the number of dropped bytes is passed on with the next block.
+void captureReader(File& tty, CaptureRing& ring, uint64_t stop, CaptureStats& stats)
+{
+    realtime.enterThread();
+    CaptureBlock scratch;
+    uint64_t lost = 0;
+    uint64_t prev_ns = 0;
+    while (micros() < stop)
+    {
+        CaptureBlock* block = ring.writable();
+        if (block == nullptr)
+            block = &scratch;
+        // Take whatever has arrived, so that blocks are large on a busy bus and
+        // still timely on a quiet one.
+        int n = tty.read(block->data, sizeof(block->data), 0, -1, 100);
+        if (n <= 0)
+            break; // We break even on EWOULDBLOCK, because idle tokens should always come
+        block->timestamp();
+        if (prev_ns != 0)
+            stats.gaps.add((block->mono_ns - prev_ns) / 1000);
+        prev_ns = block->mono_ns;
+        stats.bytes += n;
+        if (block != &scratch)
+        {
+            block->len = n;
+            block->lost = lost;
+            lost = 0;
+            ring.commit();
+            stats.blocks++;
+        }
+        else
+        {
+            if (lost == 0)
+                stats.overruns++;
+            lost += n;
+            stats.dropped += n;
+        }
+    }
+    ring.close();
+}
+
+MessageSink* exporters[4]; // --pcap, --jsonl, --publish and --protocol
+int num_exporters = 0;
+MessageAssembler* assembler = nullptr; // feeds exporters, nullptr if there are none
+bool text_output = true;               // false if an exporter writes to stdout
+
+// Opens path ("-" for stdout) for --pcap or --jsonl. Returns false on error.
+bool addExporter(const char* path, bool pcap)
 {
-    const char* ERR = "\x1B[1;31m\x1B[7m";
-    const char* START = "\x1B[33m\x1B[7m";
-    const char* STOP = "\x1B[36m\x1B[7m";
-    const char* RW = START;
-    const char* DEFAULT = "\x1B[0m";
-    const char* DATA = "\x1B[1;37m";
-    const char* ACK = "\x1B[1;32m";
-    const char* NACK = "\x1B[1;31m";
-    const char* ADDR = "\x1B[0;1m\x1B[7m";
-} color;
+    FILE* f = stdout;
+    if (strcmp(path, "-") == 0)
+        text_output = false;
+    else if ((f = fopen(path, "wb")) == nullptr)
+    {
+        perror(path);
+        return false;
+    }
+    exporters[num_exporters++] = pcap ? (MessageSink*)new PcapWriter(f) : new JsonlWriter(f);
+    return true;
+}
 
-void decodeCapture(uint8_t data)
+void flushExporters()
 {
-    const char* ACKNACK[2] = {color.ACK, color.NACK};
-    const char acknack[2] = {'.', '\''};
-    static int count = 0;
-    static unsigned cur = 0;
-    static bool inData = false;
+    for (int i = 0; i < num_exporters; i++)
+        exporters[i]->flush();
+}
 
-    for (int i = 4; i >= 0; i -= 4)
+// Passes the messages of a transaction performed by i2c_rdwr() to the exporters.
+// If err != 0, message failed is the one that failed.
+void exportTransaction(struct i2c_rdwr_ioctl_data& rdwr, unsigned failed, int err)
+{
+    I2CMessage m[I2C_RDWR_IOCTL_MAX_MSGS];
+    unsigned n = 0;
+    uint64_t now = realtimeNs();
+    for (unsigned i = 0; i < rdwr.nmsgs && i < I2C_RDWR_IOCTL_MAX_MSGS && (err == 0 || i <= failed); i++)
     {
-        uint8_t b = (data >> i) & 0xF;
+        struct i2c_msg& msg = rdwr.msgs[i];
+        if (msg.buf == nullptr)
+            continue;
+        I2CMessage& e = m[n++];
+        memset(&e, 0, sizeof(e));
+        e.ts_ns = now;
+        e.err = err;
+        e.addr = msg.addr & 0x7f;
+        e.rd = (msg.flags & I2C_M_RD) != 0;
+        e.data = msg.buf;
+        if (err != 0 && i == failed)
+            e.addr_nak = (err == ENXIO); // data of the failed message is unknown
+        else
+            e.len = (msg.flags & I2C_M_RECV_LEN) ? msg.buf[0] + 1 : msg.len;
+        e.last_nak = e.rd && e.len > 0;
+        e.stop = (i + 1 == rdwr.nmsgs) || (err != 0 && i == failed);
+    }
+    assembler->host(m, n);
+    flushExporters();
+}
 
-        bool idle = (count == 0);
+CaptureTrigger* trigger = nullptr;     // nullptr if there is no --trigger
+BusStats* bus_stats = nullptr;         // nullptr if there is no --capture-stats
+CaptureCollapser* collapser = nullptr; // nullptr if there is no --collapse
 
-        if (count > 0 && b < 8)
-        { // premature flush
-            fprintf(stdout, "%s%2X/%d%s\n", color.ERR, cur, count * 3, color.DEFAULT);
-            cur = 0;
-            count = 0;
-            inData = false;
-        }
+// Passes decoded capture events to capture_out or the exporters.
+void showCaptureEvents(const CaptureEvent* ev, size_t count, uint64_t ts_ns)
+{
+    if (assembler != nullptr)
+        assembler->feed(ev, count, ts_ns);
+    else if (collapser != nullptr)
+        collapser->feed(ev, count, ts_ns, capture_out);
+    else
+        capture_text.format(ev, count, capture_out);
+}
 
-        if (b >= 8)
-        {
-            cur = (cur << 3) | (b - 8);
-            if (++count == 3)
-            { // 3 triplets => 1 byte done
-                int ack = cur & 1;
-                cur >>= 1;
-                if (!inData)
-                { // byte is address
-                    char rw = (cur & 1) == 0 ? 'W' : 'R';
-                    cur >>= 1;
-                    fprintf(stdout, "%s%c%s", color.RW, rw, color.ADDR);
-                }
-                else
-                    fprintf(stdout, "%s", color.DATA);
+// Marks the start of a --trigger window that does not continue the previous one.
+void showTriggerGap(uint64_t skipped)
+{
+    if (assembler != nullptr)
+    {
+        assembler->skip();
+        return;
+    }
+    if (collapser != nullptr)
+        collapser->end(capture_out);
+    capture_out.flush();
+    if (trigger->count() > 1) // the previous window may have ended within a line
+        fprintf(stdout, "%s\n", color.DEFAULT);
+    fprintf(stdout, "%s[trigger %" PRIu64 ", %" PRIu64 " events skipped]%s\n", color.ERR, trigger->count(), skipped,
+            color.DEFAULT);
+}
 
-                fprintf(stdout, "%02X%s%s%c%s", cur, color.DEFAULT, ACKNACK[ack], acknack[ack], color.DEFAULT);
+// Passes the events ev[0..count) decoded from block, pos[i] being the byte that
+// produced ev[i], to out(const CaptureEvent* ev, size_t n, uint64_t ts_ns) in runs
+// of the same byte, with the CLOCK_REALTIME timebase estimates for that byte.
+template <typename Out>
+void timestampEvents(CaptureTimebase& timebase, const CaptureBlock& block, const CaptureEvent* ev,
+                     const uint16_t* pos, size_t count, Out out)
+{
+    uint64_t offset = block.real_ns - block.mono_ns;
+    for (size_t i = 0; i < count;)
+    {
+        size_t n = 1;
+        while (i + n < count && pos[i + n] == pos[i])
+            n++;
+        out(ev + i, n, offset + timebase.at(pos[i]));
+        i += n;
+    }
+}
 
-                cur = 0;
-                count = 0;
-                inData = true;
-            }
-        }
-        else if (b == 0) // Bus IDLE
-        {
-            if (!idle)
-                fprintf(stdout, "\n");
-            inData = false;
-        }
-        else if (b == 2) // STOP
+// Decodes a block of capture data to capture_out or the exporters.
+void showCaptureBlock(const CaptureBlock& block)
+{
+    if (block.lost != 0)
+    {
+        if (assembler != nullptr)
+            assembler->lost(block.real_ns, block.lost);
+        else if (bus_stats == nullptr)
         {
-            fprintf(stdout, "%sP%s\n", color.STOP, color.DEFAULT);
-            inData = false;
+            if (collapser != nullptr)
+                collapser->end(capture_out);
+            capture_out.flush();
+            fprintf(stdout, "%s[%" PRIu64 " bytes lost]%s\n", color.ERR, block.lost, color.DEFAULT);
         }
-        else if (b == 1) // START
+        capture_decoder.reset();
+        capture_timebase.reset();
+        if (trigger != nullptr)
+            trigger->reset();
+        if (bus_stats != nullptr)
+            bus_stats->lost(block.lost);
+    }
+    if (assembler == nullptr && trigger == nullptr && bus_stats == nullptr && collapser == nullptr)
+    {
+        decodeCapture(block.data, block.len);
+        return;
+    }
+
+    static CaptureEvent ev[CaptureDecoder::MAX_EVENTS_PER_BYTE * CAPTURE_BLOCK_SIZE];
+    static uint16_t pos[CaptureDecoder::MAX_EVENTS_PER_BYTE * CAPTURE_BLOCK_SIZE];
+    uint64_t idle_before = capture_decoder.idleBytes();
+    size_t count = capture_decoder.decode(block.data, block.len, ev, pos);
+    if (bus_stats != nullptr)
+    {
+        bus_stats->feed(ev, count, block.len, capture_decoder.idleBytes() - idle_before);
+        bus_stats->tick(block.mono_ns, block.real_ns, stdout);
+        if (assembler == nullptr) // the statistics replace the text output
+            return;
+    }
+    capture_timebase.block(block);
+    timestampEvents(capture_timebase, block, ev, pos, count, [](const CaptureEvent* e, size_t n, uint64_t ts_ns) {
+        if (trigger != nullptr)
+            trigger->filter(e, n, ts_ns, showCaptureEvents, showTriggerGap);
+        else
+            showCaptureEvents(e, n, ts_ns);
+    });
+}
+
+// Completes the output of showCaptureBlock() at the end of a capture.
+void finishCaptureOutput()
+{
+    if (bus_stats != nullptr)
+        bus_stats->finish(stdout);
+    if (assembler != nullptr)
+        flushExporters();
+    else if (bus_stats == nullptr)
+    {
+        if (collapser != nullptr)
+            collapser->finish(capture_out);
+        capture_out.flush();
+        fprintf(stdout, "%s\n", color.DEFAULT);
+    }
+}
+
+// Prints how often --trigger fired and how many transactions --collapse left out
+// after a capture, and how good the timestamps of the events were, if any of them
+// were used.
+void reportCounts()
+{
+    if (assembler != nullptr || trigger != nullptr || collapser != nullptr)
+        capture_timebase.report(stderr);
+    if (trigger != nullptr)
+        fprintf(stderr, "%" PRIu64 " trigger matches\n", trigger->count());
+    if (collapser != nullptr)
+        fprintf(stderr, "%" PRIu64 " repeated transactions collapsed\n", collapser->count());
+}
+
+// Captures for the given number of seconds and decodes to stdout or, if archive
+// is not null, records to archive. Reading the TTY happens on a separate thread,
+// so that a slow terminal, pipe or disk can not stall it.
+// Returns false if the archive could not be written.
+bool capture(long seconds, CaptureArchive* archive)
+{
+    uint64_t last_flush = micros();
+
+    CaptureRing ring;
+    CaptureStats stats;
+    if (realtime.active())
+        ring.prefault();
+    std::thread reader(captureReader, std::ref(i2cd), std::ref(ring), micros() + 1000000 * seconds,
+                       std::ref(stats));
+
+    CaptureBlock* block;
+    while ((block = ring.waitReadable()) != nullptr)
+    {
+        size_t fill = ring.fill();
+        if (fill > stats.max_fill)
+            stats.max_fill = fill;
+        if (archive != nullptr)
         {
-            fprintf(stdout, "%sS%s", color.START, color.DEFAULT);
-            inData = false;
+            archive->add(*block);
+            // Hand over to the writer at least once per second in case we are killed.
+            if (micros() - last_flush > 1000000)
+            {
+                archive->flush();
+                last_flush = micros();
+            }
         }
-        else if (b >= 3 && b < 8) // undocumented code
+        if (archive == nullptr || assembler != nullptr) // e.g. --publish while recording
+            showCaptureBlock(*block);
+        ring.release();
+        if (fill == 1) // caught up => show what we have
         {
-            fprintf(stdout, "%s%x%s ", color.ERR, b, color.DEFAULT);
+            capture_out.flush();
+            flushExporters();
+            fflush(stdout);
         }
     }
+    reader.join();
+
+    bool ok = true;
+    if (archive != nullptr)
+        ok = archive->close();
+    if (archive == nullptr || assembler != nullptr)
+        finishCaptureOutput();
+    if (stats.dropped != 0)
+        fprintf(stderr, "Output too slow: %" PRIu64 " bytes of capture data dropped in %" PRIu64 " overruns\n",
+                stats.dropped, stats.overruns);
+    reportCounts();
+    if (realtime.active())
+        stats.gaps.print(stderr, "Capture reads");
+    if (debug_cuse)
+        fprintf(stdout, "capture: %" PRIu64 " bytes in %" PRIu64 " blocks, at most %zu blocks buffered\n",
+                stats.bytes, stats.blocks, stats.max_fill);
+    return ok;
 }
 
-void i2c_rdwr_dump(struct i2c_rdwr_ioctl_data& rdwr, bool dumpwrites, uint8_t pec = 0)
+// Captures from the n I2CDrivers devs (TTY paths names) at once for the given
+// number of seconds and prints their output merged by time.
+void captureMerged(File** devs, const char** names, int n, long seconds)
 {
-    uint8_t delayed = 255;
-    decodeCapture(1);
-    for (unsigned i = 0; i < rdwr.nmsgs; i++)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    CaptureMerger merger(capture_text, color, (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+    CaptureRing* rings = new CaptureRing[n];
+    CaptureStats* stats = new CaptureStats[n];
+    std::thread* readers = new std::thread[n];
+    bool done[CaptureMerger::MAX_ADAPTERS] = {};
+    uint64_t stop = micros() + 1000000 * seconds;
+    for (int k = 0; k < n; k++)
     {
-        struct i2c_msg& msg = rdwr.msgs[i];
-        if (msg.buf == nullptr)
-            continue; // should not happen
-        if ((msg.flags & I2C_M_RD) == 0 && !dumpwrites)
-            continue;
-        int len = (msg.flags & I2C_M_RECV_LEN) ? msg.buf[0] + 1 : msg.len;
-        int rd = (msg.flags & I2C_M_RD);
-        int addr = ((msg.addr & 0x7f) << 1) | rd;
-        addr <<= 1;
-        uint8_t a = 8 + (addr >> 6);
-        uint8_t b = 8 + ((addr >> 3) & 7);
-        uint8_t c = 8 + (addr & 7);
-        uint8_t* buf = msg.buf;
-        if (delayed == 0)
+        merger.addAdapter(names[k], getUSBLatency(names[k]));
+        if (realtime.active())
+            rings[k].prefault();
+        readers[k] = std::thread(captureReader, std::ref(*devs[k]), std::ref(rings[k]), stop, std::ref(stats[k]));
+    }
+
+    int running = n;
+    while (running > 0)
+    {
+        bool idle = true;
+        for (int k = 0; k < n; k++)
         {
-            decodeCapture((1 << 4) | a);
-            decodeCapture((b << 4) | c);
-            goto skip;
+            if (done[k])
+                continue;
+            CaptureBlock* block;
+            while ((block = rings[k].readable()) != nullptr)
+            {
+                merger.add(k, *block);
+                rings[k].release();
+                idle = false;
+            }
+            if (rings[k].drained())
+            {
+                merger.finish(k);
+                done[k] = true;
+                running--;
+            }
         }
-        else if (delayed != 255)
+        if (idle) // caught up => show what we have
         {
-            decodeCapture(delayed);
+            merger.flush();
+            fflush(stdout);
+            usleep(1000);
         }
+    }
+    merger.flush();
+    fprintf(stdout, "%s\n", color.DEFAULT);
 
-        while (1)
-        {
-            decodeCapture((a << 4) | b);
+    for (int k = 0; k < n; k++)
+    {
+        readers[k].join();
+        if (stats[k].dropped != 0)
+            fprintf(stderr, "%s: output too slow: %" PRIu64 " bytes of capture data dropped in %" PRIu64 " overruns\n",
+                    names[k], stats[k].dropped, stats[k].overruns);
+    }
+    merger.reportLatency(stderr);
+    for (int k = 0; realtime.active() && k < n; k++)
+    {
+        char what[256];
+        snprintf(what, sizeof(what), "%s: capture reads", names[k]);
+        stats[k].gaps.print(stderr, what);
+    }
+    delete[] readers;
+    delete[] stats;
+    delete[] rings;
+}
 
-            if (len == 0)
-            {
-                delayed = (c << 4) | 1;
+// Decodes the part of a file recorded with --capture-out between the
+// CLOCK_REALTIME since_ns and until_ns to stdout. If the file has an index, the
+// part before since_ns is not read at all.
+bool decodeFile(const char* path, uint64_t since_ns, uint64_t until_ns)
+{
+    CaptureFileReader reader;
+    if (!reader.open(path))
+    {
+        fprintf(stderr, "%s: %s\n", path, reader.error());
+        return false;
+    }
+    capture_timebase.setLatency(reader.latencyTimer());
+    if (since_ns != 0)
+        reader.seek(since_ns);
+    CaptureBlock block;
+    while (reader.next(block) && block.real_ns <= until_ns)
+        if (block.real_ns >= since_ns)
+            showCaptureBlock(block);
+    if (reader.skipped != 0)
+        fprintf(stderr, "%s: %" PRIu64 " bytes of damaged data skipped\n", path, reader.skipped);
+    return true;
+}
+
+// Passes the messages of path between since_ns and until_ns to query. If the
+// file has an index, only the frames that may have a match according to it are
+// decoded, plus the frame after each of them for messages that cross into it.
+// Returns false if the file could not be read.
+bool queryFile(const char* path, QuerySink& query, uint64_t since_ns, uint64_t until_ns)
+{
+    static CaptureEvent ev[CaptureDecoder::MAX_EVENTS_PER_BYTE * CAPTURE_BLOCK_SIZE];
+    static uint16_t pos[CaptureDecoder::MAX_EVENTS_PER_BYTE * CAPTURE_BLOCK_SIZE];
+    static CaptureBlock block;
+    CaptureFileReader reader;
+    if (!reader.open(path))
+    {
+        fprintf(stderr, "%s: %s\n", path, reader.error());
+        return false;
+    }
+    CaptureIndexEntry* index;
+    size_t n = reader.loadIndex(index);
+    bool* wanted = new bool[n + 1]();
+    for (size_t i = 0; i < n; i++)
+        if (index[i].real_ns <= until_ns && (i + 1 == n || index[i + 1].real_ns >= since_ns) &&
+            query.mayMatch(index[i]))
+            wanted[i] = wanted[i + 1] = true;
+
+    MessageSink* sinks[1] = {&query};
+    MessageAssembler* parser = new MessageAssembler(sinks, 1);
+    CaptureDecoder decoder;
+    CaptureTimebase timebase;
+    timebase.setLatency(reader.latencyTimer());
+    size_t cur = 0;     // index entry of the frame being read
+    bool jump = n != 0; // continue with the next wanted frame
+    for (;;)
+    {
+        if (jump)
+        {
+            while (cur < n && !wanted[cur])
+                cur++;
+            if (cur == n)
                 break;
+            reader.seekFrame(index[cur].offset);
+            decoder.restore(index[cur].state);
+            timebase.reset();
+            parser->skip();
+            query.skip();
+            jump = false;
+        }
+        if (!reader.next(block) || block.real_ns > until_ns)
+            break;
+        if (n != 0)
+        {
+            while (cur + 1 < n && index[cur + 1].offset <= reader.frameOffset())
+                cur++;
+            if (!wanted[cur])
+            {
+                jump = true;
+                continue;
             }
+        }
+        if (block.lost != 0)
+        {
+            parser->lost(block.real_ns, block.lost);
+            decoder.reset();
+            timebase.reset();
+        }
+        size_t count = decoder.decode(block.data, block.len, ev, pos);
+        timebase.block(block);
+        if (block.real_ns >= since_ns)
+            timestampEvents(timebase, block, ev, pos, count,
+                            [parser](const CaptureEvent* e, size_t n, uint64_t ts_ns) { parser->feed(e, n, ts_ns); });
+    }
+    if (reader.skipped != 0)
+        fprintf(stderr, "%s: %" PRIu64 " bytes of damaged data skipped\n", path, reader.skipped);
+    query.skip();
+    delete parser;
+    delete[] wanted;
+    delete[] index;
+    return true;
+}
 
-            a = 8 + (*buf >> 5);
-            decodeCapture((c << 4) | a);
-            b = 8 + ((*buf >> 2) & 7);
-            c = 8 + ((*buf << 1) & 7) + (rd & (len == 1));
-            buf++;
-            len--;
-
-            decodeCapture((b << 4) | c);
-        skip:
-            if (len == 0)
+// Parses a --since or --until argument, either seconds since the epoch or local
+// time in the form "2022-10-18 09:15[:00]" (a 'T' instead of the ' ' works, too)
+// or "09:15[:00]" today. Returns false if str is neither.
+bool parseTime(const char* str, uint64_t& ns)
+{
+    char* end;
+    unsigned long long secs = strtoull(str, &end, 10);
+    if (end != str && *end == 0)
+    {
+        ns = secs * 1000000000;
+        return true;
+    }
+    struct tm tm;
+    for (const char* format : {"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M",
+                               "%H:%M:%S", "%H:%M"})
+    {
+        memset(&tm, 0, sizeof(tm));
+        end = strptime(str, format, &tm);
+        if (end != nullptr && *end == 0)
+        {
+            if (format[1] == 'H') // time of day => today
             {
-                delayed = 0;
-                break;
+                time_t now = time(nullptr);
+                struct tm today;
+                localtime_r(&now, &today);
+                tm.tm_year = today.tm_year;
+                tm.tm_mon = today.tm_mon;
+                tm.tm_mday = today.tm_mday;
             }
-
-            a = 8 + (*buf >> 5);
-            b = 8 + ((*buf >> 2) & 7);
-            c = 8 + ((*buf << 1) & 7) + (rd & (len == 1));
-            buf++;
-            len--;
+            tm.tm_isdst = -1;
+            ns = (uint64_t)mktime(&tm) * 1000000000;
+            return true;
         }
     }
-    if (delayed == 0 || delayed == 255)
-        decodeCapture(0x20);
-    else
-        decodeCapture(delayed + 1);
-    if (add_pec)
-        fprintf(stdout, "PEC: 0x%02X", pec);
-    fprintf(stdout, "%s\n", color.DEFAULT);
+    return false;
 }
 
 // Reads up to 2 bytes from i2cd and returns true if either no byte was
@@ -604,31 +1248,173 @@ bool i2cdriverErr()
 {
     uint8_t buf[2];
     int res = i2cd.read(buf, 2, 0, -1, 30);
-    if (res <= 0 || buf[0] != 0b110001 || (res > 1 && buf[1] != 0b110001))
+    if (res <= 0 || buf[0] != STATUS_OK || (res > 1 && buf[1] != STATUS_OK))
         return true;
     return false;
 }
 
-// Returns false if an I/O error occurred.
-bool i2c_rdwr(struct i2c_rdwr_ioctl_data& rdwr, bool dump = true)
+// Reads the status byte the I2CDriver sends in reply to a START command and
+// translates it into an errno value as described in the kernel's
+// Documentation/i2c/fault-codes: 0 if the address was ACKed, ENXIO if it was NAKed,
+// EAGAIN if arbitration was lost, ETIMEDOUT on bus timeout and EIO if the
+// I2CDriver did not reply properly.
+int i2cdriverStartErr()
+{
+    uint8_t buf[2];
+    int res = i2cd.read(buf, 2, 0, -1, 30);
+    if (res != 1 || (buf[0] & ~0b111) != STATUS_NAK)
+        return EIO;
+    if (buf[0] & STATUS_ARBLOST_BIT)
+        return EAGAIN;
+    if (buf[0] & STATUS_TIMEOUT_BIT)
+        return ETIMEDOUT;
+    if ((buf[0] & STATUS_ACK_BIT) == 0)
+        return ENXIO;
+    return 0;
+}
+
+// Serializes access to the I2CDriver (and the caches that go with it) between
+// the FUSE worker threads.
+std::timed_mutex bus_mutex;
+
+// Statistics about interrupted requests. The latency is the time from the kernel
+// telling us about the interrupt (e.g. because the client was killed) until the
+// STOP that frees the bus has been sent.
+struct InterruptStats
+{
+    uint64_t count = 0;
+    uint64_t total_latency = 0; // micros
+    uint64_t max_latency = 0;   // micros
+} interrupt_stats;
+
+// A FUSE request that accesses the bus. Constructing a BusRequest waits for the
+// bus and registers an interrupt handler. While the BusRequest exists on this
+// thread, i2c_rdwr() checks for an interrupt at every firmware command boundary
+// and aborts with a STOP and EINTR, so that a killed client does not hold the bus
+// for the rest of a long transfer. The same happens with ETIMEDOUT when the
+// optional deadline passes. A request aborted while it is still waiting for the
+// bus gives up without touching it.
+struct BusRequest
+{
+    static thread_local BusRequest* current; // the BusRequest on this thread or nullptr
+
+    std::atomic<bool> interrupted{false};
+    std::atomic<uint64_t> interrupt_time{0}; // micros() of the interrupt
+    uint64_t deadline;                       // micros() at which the request times out, 0 for none
+    std::unique_lock<std::timed_mutex> lock;
+
+    explicit BusRequest(fuse_req_t req, uint64_t deadline = 0) : deadline(deadline), lock(bus_mutex, std::defer_lock)
+    {
+        realtime.enterThread();
+        current = this;
+        fuse_req_interrupt_func(req, onInterrupt, this); // calls onInterrupt() immediately if already interrupted
+        acquire();
+    }
+
+    ~BusRequest() { current = nullptr; }
+
+    // Waits for the bus. Returns false if the request was aborted before it got it.
+    bool acquire()
+    {
+        while (!lock.owns_lock() && abortReason() == 0)
+            lock.try_lock_for(std::chrono::milliseconds(10));
+        return lock.owns_lock();
+    }
+
+    // Lets other requests use the bus until the next acquire().
+    void release() { lock.unlock(); }
+
+    // false if the request was aborted before it got the bus
+    bool acquired() const { return lock.owns_lock(); }
+
+    // Returns EINTR if the BusRequest on this thread was interrupted, ETIMEDOUT if
+    // its deadline has passed and 0 otherwise.
+    static int abortReason()
+    {
+        if (current == nullptr)
+            return 0;
+        if (current->interrupted)
+            return EINTR;
+        if (current->deadline != 0 && micros() >= current->deadline)
+            return ETIMEDOUT;
+        return 0;
+    }
+
+    // To be called after the STOP has been sent for an interrupted transfer.
+    static void busFreed()
+    {
+        uint64_t latency = micros() - current->interrupt_time;
+        interrupt_stats.count++;
+        interrupt_stats.total_latency += latency;
+        if (latency > interrupt_stats.max_latency)
+            interrupt_stats.max_latency = latency;
+        if (debug_cuse)
+            fprintf(stdout, "request interrupted, bus free after %" PRIu64 " us\n", latency);
+    }
+
+    static void onInterrupt(fuse_req_t req, void* data)
+    {
+        BusRequest* self = (BusRequest*)data;
+        self->interrupt_time = micros();
+        self->interrupted = true;
+    }
+};
+
+thread_local BusRequest* BusRequest::current = nullptr;
+
+// Returns 0 if the transfer was successful, otherwise an errno value as
+// described at i2cdriverStartErr(). If an address is known to be absent
+// (see PresenceCache), ENXIO is returned without accessing the bus unless
+// use_presence is false. If the BusRequest on this thread is aborted, the
+// transfer is stopped at the next firmware command boundary and
+// BusRequest::abortReason() is returned.
+int i2c_rdwr(struct i2c_rdwr_ioctl_data& rdwr, bool dump = true, bool use_presence = true)
 {
     if (rdwr.nmsgs == 0)
-        return true;
+        return 0;
+
+    for (unsigned i = 0; use_presence && i < rdwr.nmsgs; i++)
+    {
+        int addr = rdwr.msgs[i].addr & 0x7f;
+        if (presence.needsRefresh(addr))
+        {
+            char result[112];
+            scanBus(result);
+            i2cd.clearError();
+        }
+        if (presence.absent(addr))
+        {
+            if (dump && text_output)
+            {
+                tracer.drain(); // after the transactions before it
+                fprintf(stdout, "0x%02X NAK (cached)\n", addr);
+            }
+            if (assembler != nullptr)
+                exportTransaction(rdwr, i, ENXIO);
+            return ENXIO;
+        }
+    }
 
     CRC_PEC pec;
     uint8_t buf[32];
-    bool ioerror = false;
+    int err = 0;
     bool do_add_pec = add_pec;
+    uint64_t begin = micros();
+    flight_recorder.begin(rdwr.msgs, rdwr.nmsgs);
 
     i2cd.read(buf, sizeof(buf), 0, 0); // clear input buffer
     i2cd.clearError();                 // clear EWOULDBLOCK if nothing was read
 
-    for (unsigned i = 0; i < rdwr.nmsgs; i++)
+    unsigned i; // after the loop: index of the failed message if err != 0
+    for (i = 0; i < rdwr.nmsgs; i++)
     {
         struct i2c_msg& msg = rdwr.msgs[i];
         if (msg.buf == nullptr)
             continue; // should not happen
 
+        if ((err = BusRequest::abortReason()) != 0)
+            goto endoftransmission;
+
         int len = msg.len;
 
         // 0-length writes are not permitted. Convert to 0-length read.
@@ -640,9 +1426,12 @@ bool i2c_rdwr(struct i2c_rdwr_ioctl_data& rdwr, bool dump = true)
         i2cd.action("I2C START");
         i2cd.writeAll(buf, 2);
         pec.add(buf[1]); // use the time it takes to process the write to calculate the PEC
-        ioerror = i2cdriverErr();
-        if (ioerror)
+        err = i2cdriverStartErr();
+        if (err == ENXIO)
+            presence.nak(msg.addr & 0x7f);
+        if (err)
             goto endoftransmission;
+        presence.ack(msg.addr & 0x7f);
 
         int datidx = 0;
 
@@ -656,9 +1445,11 @@ bool i2c_rdwr(struct i2c_rdwr_ioctl_data& rdwr, bool dump = true)
                 buf[0] = 'a'; // i2cdriver read-all-ACK command
                 buf[1] = 1;
                 i2cd.writeAll(buf, 2);
-                ioerror = (1 != i2cd.read(msg.buf + datidx, 1, 30, -1, 100));
-                if (ioerror)
+                if (1 != i2cd.read(msg.buf + datidx, 1, 30, -1, 100))
+                {
+                    err = EIO;
                     goto endoftransmission;
+                }
 
                 pec.add((uint8_t)msg.buf[datidx]);
 
@@ -671,13 +1462,17 @@ bool i2c_rdwr(struct i2c_rdwr_ioctl_data& rdwr, bool dump = true)
 
             while (len > 64) // use i2cdriver's 'a' command until we have <=64 bytes left
             {
+                if ((err = BusRequest::abortReason()) != 0)
+                    goto endoftransmission;
                 int l = len > 255 ? 255 : len - 1; // -1 to make sure we have at least 1 byte left to NACK
                 buf[0] = 'a';                      // i2cdriver read-all-ACK command
                 buf[1] = l;
                 i2cd.writeAll(buf, 2);
-                ioerror = (l != i2cd.read(msg.buf + datidx, l, 30, -1, 100));
-                if (ioerror)
+                if (l != i2cd.read(msg.buf + datidx, l, 30, -1, 100))
+                {
+                    err = EIO;
                     goto endoftransmission;
+                }
 
                 pec.add(msg.buf + datidx, l);
 
@@ -688,9 +1483,11 @@ bool i2c_rdwr(struct i2c_rdwr_ioctl_data& rdwr, bool dump = true)
             // at this point 1 <= len <= 64
             buf[0] = (len - 1) | 0b10000000; // i2cdriver read-with-final-NACK command
             i2cd.writeAll(buf, 1);
-            ioerror = (len != i2cd.read(msg.buf + datidx, len, 30, -1, 100));
-            if (ioerror)
+            if (len != i2cd.read(msg.buf + datidx, len, 30, -1, 100))
+            {
+                err = EIO;
                 goto endoftransmission;
+            }
 
             pec.add(msg.buf + datidx, len);
         }
@@ -700,14 +1497,18 @@ bool i2c_rdwr(struct i2c_rdwr_ioctl_data& rdwr, bool dump = true)
 
             while (len > 0)
             {
+                if ((err = BusRequest::abortReason()) != 0)
+                    goto endoftransmission;
                 int l = len > 64 ? 64 : len;
                 buf[0] = (l - 1) | 0b11000000; // i2cdriver write command
                 i2cd.writeAll(buf, 1);
                 i2cd.writeAll(msg.buf + datidx, l);
                 pec.add(msg.buf + datidx, l); // use the time it takes to process the write to calculate the PEC
-                ioerror = i2cdriverErr();
-                if (ioerror)
+                if (i2cdriverErr())
+                {
+                    err = EIO;
                     goto endoftransmission;
+                }
 
                 len -= l;
                 datidx += l;
@@ -716,20 +1517,126 @@ bool i2c_rdwr(struct i2c_rdwr_ioctl_data& rdwr, bool dump = true)
     }
 
 endoftransmission:
-    if (do_add_pec && !ioerror)
+    if (do_add_pec && !err)
     {
         buf[0] = 0b11000000; // i2cdriver write command
         buf[1] = pec.sum();
         i2cd.action("I2C STOP");
         i2cd.writeAll(buf, 2);
-        ioerror = i2cdriverErr();
+        if (i2cdriverErr())
+            err = EIO;
     }
     i2cd.writeAll("p", 1); // STOP
+    if (err == EINTR)
+        BusRequest::busFreed();
+
+    realtime.transaction(micros() - begin);
+    flight_recorder.end(err);
+    if (err != 0 && err != ENXIO && err != EINTR) // absent devices and impatient clients are normal
+        flight_recorder.failed(err);
+    if (dump && text_output)
+        tracer.add(rdwr, i, err, add_pec, pec.sum());
+    if (assembler != nullptr)
+        exportTransaction(rdwr, i, err);
+
+    return err;
+}
 
-    if (dump)
-        i2c_rdwr_dump(rdwr, true, pec.sum());
+// Sends START conditions to addr until it ACKs or timeout_ms have passed. This is used
+// to wait for the end of an EEPROM's write cycle, during which it does not ACK.
+// Returns 0 or an errno value as described at i2cdriverStartErr().
+int ackPoll(int addr, int timeout_ms)
+{
+    uint64_t stop = micros() + 1000 * timeout_ms;
+    uint8_t buf[2] = {'s', (uint8_t)(addr << 1)};
+    for (;;)
+    {
+        i2cd.action("I2C ACK polling");
+        i2cd.writeAll(buf, 2);
+        int err = i2cdriverStartErr();
+        i2cd.writeAll("p", 1); // STOP
+        if (err != ENXIO)
+            return err;
+        if (micros() >= stop)
+            return ETIMEDOUT;
+    }
+}
 
-    return !ioerror;
+// Performs a transaction for --replay. It is neither dumped nor answered from the
+// presence cache, because the actual response is what gets compared.
+int replayTransaction(struct i2c_rdwr_ioctl_data& rdwr)
+{
+    return i2c_rdwr(rdwr, false, false);
+}
+
+// Re-issues the transactions recorded in the files matching pattern between
+// since_ns and until_ns (CLOCK_REALTIME) at rate times the recorded speed (0 =>
+// as fast as possible) and reports the results to stdout. Returns false if a
+// file could not be read.
+bool replay(const char* pattern, double rate, uint64_t since_ns, uint64_t until_ns)
+{
+    // Timestamps are per block, so the events of a block are spread in slices of
+    // this many bytes over the time since the previous block.
+    static const size_t SLICE = 64;
+    static CaptureEvent ev[CaptureDecoder::MAX_EVENTS_PER_BYTE * SLICE];
+
+    ReplaySink sink(replayTransaction, rate, stdout);
+    MessageSink* sinks[1] = {&sink};
+    MessageAssembler* parser = new MessageAssembler(sinks, 1);
+    CaptureDecoder decoder;
+    static CaptureBlock block;
+    bool ok = true;
+
+    glob_t g;
+    if (glob(pattern, GLOB_NOCHECK, nullptr, &g) != 0)
+    {
+        fprintf(stderr, "%s: no match\n", pattern);
+        delete parser;
+        return false;
+    }
+    uint64_t prev_ns = 0; // timestamp of the previous block
+    for (size_t i = 0; i < g.gl_pathc; i++)
+    {
+        CaptureFileReader reader;
+        if (!reader.open(g.gl_pathv[i]))
+        {
+            fprintf(stderr, "%s: %s\n", g.gl_pathv[i], reader.error());
+            ok = false;
+            continue;
+        }
+        capture_timebase.setLatency(reader.latencyTimer());
+        if (since_ns != 0)
+            reader.seek(since_ns);
+        while (reader.next(block) && block.real_ns <= until_ns)
+        {
+            if (block.real_ns < since_ns)
+                continue;
+            if (block.lost != 0 || prev_ns == 0)
+            {
+                if (block.lost != 0)
+                    parser->lost(block.real_ns, block.lost);
+                decoder.reset();
+            }
+            if (prev_ns == 0 || prev_ns > block.real_ns || block.lost != 0)
+                prev_ns = block.real_ns;
+            for (size_t off = 0; off < block.len; off += SLICE)
+            {
+                size_t n = block.len - off < SLICE ? block.len - off : SLICE;
+                size_t count = decoder.decode(block.data + off, n, ev);
+                parser->feed(ev, count, prev_ns + (block.real_ns - prev_ns) * (off + n) / block.len);
+            }
+            prev_ns = block.real_ns;
+        }
+        if (reader.skipped != 0)
+            fprintf(stderr, "%s: %" PRIu64 " bytes of damaged data skipped\n", g.gl_pathv[i], reader.skipped);
+    }
+    globfree(&g);
+    delete parser;
+
+    sink.flush();
+    sink.report(stdout);
+    flushExporters();
+    return ok;
 }
 
 void transfer(const char* carg)
@@ -758,7 +1665,7 @@ void transfer(const char* carg)
         struct i2c_rdwr_ioctl_data rdwr;
         rdwr.msgs = msgs;
         rdwr.nmsgs = nmsgs;
-        if (!i2c_rdwr(rdwr))
+        if (i2c_rdwr(rdwr) != 0)
         {
             fprintf(stderr, "I/O Error or No reply during transmission\n");
         }
@@ -803,11 +1710,221 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+    if (options[MOUNT].count() > 1)
+    {
+        fprintf(stderr, "At most one --mount argument is allowed\n");
+        return 1;
+    }
+
+    if (options[DEV] && options[MOUNT])
+    {
+        fprintf(stderr, "--dev and --mount can not be used together\n");
+        return 1;
+    }
+
     if (options[VERBOSE])
     {
         debug_cuse = true;
     }
 
+    if (options[CAPTURE_OUT] && !options[CAPTURE])
+    {
+        fprintf(stderr, "--capture-out requires --capture\n");
+        return 1;
+    }
+
+    if ((options[ROTATE_SIZE] || options[ROTATE_TIME] || options[ROTATE_KEEP]) && !options[CAPTURE_OUT])
+    {
+        fprintf(stderr, "--rotate-size, --rotate-time and --rotate-keep require --capture-out\n");
+        return 1;
+    }
+
+    if ((options[SINCE] || options[UNTIL]) && !options[DECODE] && !options[REPLAY])
+    {
+        fprintf(stderr, "--since and --until require --decode or --replay\n");
+        return 1;
+    }
+
+    uint64_t since_ns = 0;
+    uint64_t until_ns = UINT64_MAX;
+    if ((options[SINCE] && !parseTime(options[SINCE].last()->arg, since_ns)) ||
+        (options[UNTIL] && !parseTime(options[UNTIL].last()->arg, until_ns)))
+    {
+        fprintf(stderr, "Illegal --since or --until time\n");
+        return 1;
+    }
+
+    double replay_rate = 1;
+    if (options[REPLAY_RATE])
+    {
+        char* end;
+        replay_rate = strtod(options[REPLAY_RATE].last()->arg, &end);
+        if (*end != 0 || end == options[REPLAY_RATE].last()->arg || !(replay_rate >= 0))
+        {
+            fprintf(stderr, "Illegal --replay-rate: %s\n", options[REPLAY_RATE].last()->arg);
+            return 1;
+        }
+    }
+
+    if (options[QUERY] && !options[DECODE])
+    {
+        fprintf(stderr, "--query requires --decode\n");
+        return 1;
+    }
+
+    if (options[QUERY] && (options[TRIGGER] || options[CAPTURE_STATS] || options[PROTOCOL] || options[PCAP] ||
+                           options[JSONL]))
+    {
+        fprintf(stderr, "--query can not be used with --trigger, --capture-stats, --protocol, --pcap or --jsonl\n");
+        return 1;
+    }
+
+    if (options[REALTIME_CPUS] && !options[REALTIME])
+    {
+        fprintf(stderr, "--realtime-cpus requires --realtime\n");
+        return 1;
+    }
+
+    if (options[REALTIME] && !realtime.setup(strtol(options[REALTIME].last()->arg, nullptr, 10),
+                                             options[REALTIME_CPUS] ? options[REALTIME_CPUS].last()->arg : nullptr))
+    {
+        fprintf(stderr, "Illegal --realtime priority (0-99) or --realtime-cpus list\n");
+        return 1;
+    }
+
+    if (options[REPLAY] && options[DECODE])
+    {
+        fprintf(stderr, "--replay and --decode can not be used together\n");
+        return 1;
+    }
+
+    if (options[PCAP].count() > 1 || options[JSONL].count() > 1)
+    {
+        fprintf(stderr, "At most one --pcap and one --jsonl argument are allowed\n");
+        return 1;
+    }
+
+    if ((options[PCAP] && !addExporter(options[PCAP].arg, true)) ||
+        (options[JSONL] && !addExporter(options[JSONL].arg, false)))
+        return 1;
+    CapturePublisher* publisher = nullptr;
+    if (options[PUBLISH])
+    {
+        if (!options[CAPTURE] || options[PUBLISH].count() > 1)
+        {
+            fprintf(stderr, "--publish requires --capture and can only be given once\n");
+            return 1;
+        }
+        publisher = new CapturePublisher(options[PUBLISH].arg);
+        if (!publisher->start())
+            return 1;
+        exporters[num_exporters++] = new JsonlWriter(publisher->stream());
+    }
+    if (options[PROTOCOL])
+    {
+        ProtocolSink* protocols = new ProtocolSink(stdout);
+        // Decoders for specific addresses first, so that the others don't take them.
+        for (int pass = 0; pass < 2; pass++)
+            for (option::Option* opt = options[PROTOCOL]; opt != nullptr; opt = opt->next())
+                if ((strchr(opt->arg, '@') != nullptr) == (pass == 0) && !protocols->add(opt->arg))
+                {
+                    fprintf(stderr, "Illegal --protocol argument: %s\n", opt->arg);
+                    return 1;
+                }
+        exporters[num_exporters++] = protocols;
+    }
+    if (num_exporters > 0)
+        assembler = new MessageAssembler(exporters, num_exporters);
+
+    if (options[CAPTURE_STATS])
+    {
+        if (options[CAPTURE_OUT])
+        {
+            fprintf(stderr, "--capture-stats can not be used with --capture-out\n");
+            return 1;
+        }
+        // Redraw like top on a terminal, unless decoding a file, which is done in a flash.
+        bus_stats = new BusStats(strtoull(options[CAPTURE_STATS].last()->arg, nullptr, 10),
+                                 isatty(1) && !options[DECODE]);
+    }
+
+    if (options[COLLAPSE])
+    {
+        if (options[CAPTURE_OUT] || options[CAPTURE_STATS] || options[QUERY])
+        {
+            fprintf(stderr, "--collapse can not be used with --capture-out, --capture-stats or --query\n");
+            return 1;
+        }
+        collapser = new CaptureCollapser(capture_text, strtoull(options[COLLAPSE].last()->arg, nullptr, 10));
+    }
+
+    if (options[TRIGGER])
+    {
+        if (options[CAPTURE_OUT])
+        {
+            fprintf(stderr, "--trigger can not be used with --capture-out\n");
+            return 1;
+        }
+        trigger = new CaptureTrigger;
+        for (option::Option* opt = options[TRIGGER]; opt != nullptr; opt = opt->next())
+            if (!trigger->add(opt->arg))
+            {
+                fprintf(stderr, "Illegal --trigger expression: %s\n", opt->arg);
+                return 1;
+            }
+        trigger->setWindow(options[PRE_TRIGGER] ? strtoull(options[PRE_TRIGGER].last()->arg, nullptr, 10) : 256,
+                           options[POST_TRIGGER] ? strtoull(options[POST_TRIGGER].last()->arg, nullptr, 10) : 256);
+    }
+
+    if (options[DECODE])
+    {
+        bool ok = true;
+        int threads = options[DECODE_THREADS] ? strtol(options[DECODE_THREADS].last()->arg, nullptr, 10)
+                                              : std::thread::hardware_concurrency();
+        bool parallel = threads > 1 && assembler == nullptr && trigger == nullptr && bus_stats == nullptr &&
+                        collapser == nullptr && since_ns == 0 && until_ns == UINT64_MAX && !options[QUERY];
+        QuerySink* query = options[QUERY] ? new QuerySink(stdout) : nullptr;
+        for (option::Option* opt = options[QUERY]; opt != nullptr; opt = opt->next())
+            if (!query->add(opt->arg))
+            {
+                fprintf(stderr, "Illegal --query expression: %s\n", opt->arg);
+                return 1;
+            }
+        // Patterns like bus-*.cap select a rotated archive in the order of its files.
+        glob_t g;
+        int flags = GLOB_NOCHECK;
+        for (option::Option* opt = options[DECODE]; opt != nullptr; opt = opt->next(), flags |= GLOB_APPEND)
+            if (glob(opt->arg, flags, nullptr, &g) != 0)
+            {
+                fprintf(stderr, "%s: no match\n", opt->arg);
+                return 1;
+            }
+        ParallelDecoder* decoder = parallel ? new ParallelDecoder(capture_text, color) : nullptr;
+        for (size_t i = 0; parallel && i < g.gl_pathc; i++)
+            parallel = decoder->add(g.gl_pathv[i]);
+        if (query != nullptr)
+        {
+            for (size_t i = 0; i < g.gl_pathc; i++)
+                ok = queryFile(g.gl_pathv[i], *query, since_ns, until_ns) && ok;
+            query->flush();
+            fprintf(stderr, "%" PRIu64 " matching transactions\n", query->count());
+        }
+        else if (parallel)
+            decoder->decode(threads, stdout);
+        else
+            for (size_t i = 0; i < g.gl_pathc; i++)
+                ok = decodeFile(g.gl_pathv[i], since_ns, until_ns) && ok;
+        globfree(&g);
+        delete decoder;
+        if (query == nullptr)
+            finishCaptureOutput();
+        delete query;
+        reportCounts();
+        return ok ? 0 : 1;
+    }
+
+    const char* more_ttys[CaptureMerger::MAX_ADAPTERS];
+    int num_more_ttys = 0;
     switch (options[TTY].count())
     {
         case 0: // auto-detect
@@ -826,15 +1943,37 @@ int main(int argc, char* argv[])
                 return 1;
             }
             break;
-        default:
-            fprintf(stderr, "At most one --tty argument is allowed.\n");
-            return 1;
+        default: // several I2CDrivers capturing at once
+            if (options[TTY].count() > CaptureMerger::MAX_ADAPTERS || !options[CAPTURE] || options[CAPTURE_OUT] ||
+                options[TRIGGER] || options[CAPTURE_STATS] || options[COLLAPSE] || num_exporters > 0 ||
+                options[REPLAY] || options[DEV] || options[MOUNT])
+            {
+                fprintf(stderr, "Several --tty arguments (at most %d) are only allowed with a plain --capture.\n",
+                        CaptureMerger::MAX_ADAPTERS);
+                return 1;
+            }
+            for (option::Option* opt = options[TTY]; opt != nullptr; opt = opt->next())
+            {
+                const char* t = sanityCheckTTY(opt->arg);
+                if (t == nullptr)
+                {
+                    fprintf(stderr, "%s does not look like a valid I2Cdriver device.\n", opt->arg);
+                    return 1;
+                }
+                if (tty == nullptr)
+                    tty = t;
+                else
+                    more_ttys[num_more_ttys++] = t;
+            }
     }
 
     if (options[LATENCY])
     {
         if (!setLowLatency(tty))
             return 1;
+        for (int k = 0; k < num_more_ttys; k++)
+            if (!setLowLatency(more_ttys[k]))
+                return 1;
     }
 
     if (options[DEV])
@@ -853,7 +1992,18 @@ int main(int argc, char* argv[])
         close(fd);
     }
 
+    if (!flight_recorder.setup(
+            (options[FLIGHT_SIZE] ? strtoull(options[FLIGHT_SIZE].last()->arg, nullptr, 10) : 1024) << 10,
+            options[FLIGHT_RECORDER] ? options[FLIGHT_RECORDER].last()->arg : "/tmp/i2cdriver-flight"))
+        return 1;
+    if (!options[BACKGROUND]) // otherwise after daemonizing
+    {
+        flight_recorder.start();
+        realtime.start();
+    }
+
     i2cd.init(tty);
+    i2cd.setTap(FlightRecorder::tap, &flight_recorder);
     i2cd.action("connecting to TTY");
     i2cd.open();
     i2cd.setupTTY(B1000000);
@@ -874,6 +2024,20 @@ int main(int argc, char* argv[])
             return 1;
     }
 
+    File* more_devs[CaptureMerger::MAX_ADAPTERS];
+    for (int k = 0; k < num_more_ttys; k++)
+    {
+        more_devs[k] = new File(more_ttys[k]);
+        more_devs[k]->action("connecting to TTY");
+        more_devs[k]->open();
+        more_devs[k]->setupTTY(B1000000);
+        if (waitReady(*more_devs[k]) != 0)
+        {
+            fprintf(stderr, "%s\n", more_devs[k]->hasError() ? more_devs[k]->error() : "Protocol failure.");
+            return 1;
+        }
+    }
+
     for (int i = 0; i < parse.optionsCount(); ++i)
     {
         option::Option& opt = buffer[i];
@@ -890,6 +2054,26 @@ int main(int argc, char* argv[])
             case PEC:
                 add_pec = true;
                 break;
+            case NAK_TTL:
+                nak_ttl = 1000 * strtoull(opt.arg, nullptr, 10);
+                break;
+            case RETRY_BACKOFF:
+                retry_backoff = 1000 * strtoull(opt.arg, nullptr, 10);
+                break;
+            case ATTR_CACHE:
+                attr_cache = 1000 * strtoull(opt.arg, nullptr, 10);
+                break;
+            case EEPROM:
+                if (!regfs_add_eeprom(opt.arg))
+                    return 1;
+                break;
+            case REG_BLOCK:
+                reg_block = strtol(opt.arg, nullptr, 10);
+                if (reg_block < 1)
+                    reg_block = 1;
+                if (reg_block > 256)
+                    reg_block = 256;
+                break;
             case MONITOR:
                 monitor = 'm';
                 break;
@@ -913,6 +2097,7 @@ int main(int argc, char* argv[])
 
             case INFO:       // we only print info once after handling everything
             case DEV:        // will be handled later
+            case MOUNT:      // ditto
             case BACKGROUND: // ditto
             case CAPTURE:    // will be handled later
             case TTY:        // already handled
@@ -922,6 +2107,7 @@ int main(int argc, char* argv[])
                 break;
         }
 
+        tracer.drain(); // keep the order of the output
         if (i2cd.hasError())
             break;
     }
@@ -973,27 +2159,55 @@ int main(int argc, char* argv[])
         }
     }
 
-    if (options[CAPTURE])
+    if (options[REPLAY])
+    {
+        i2cd.action("replaying I2C transactions");
+        bool ok = true;
+        for (option::Option* opt = options[REPLAY]; opt != nullptr; opt = opt->next())
+            ok = replay(opt->arg, replay_rate, since_ns, until_ns) && ok;
+        if (!ok)
+            return 1;
+    }
+
+    if (options[CAPTURE]) // the capture stream would flood the flight recorder
+        i2cd.setTap(nullptr, nullptr);
+    if (options[CAPTURE] && num_more_ttys > 0)
     {
-        i2cd.action("capturing I2C events");
-        uint8_t data;
-        maybeSet('c');
-        auto stop = micros() + 1000000 * strtol(options[CAPTURE].last()->arg, nullptr, 10);
-        int flushcount = 0;
-        while (micros() < stop)
+        File* devs[CaptureMerger::MAX_ADAPTERS] = {&i2cd};
+        const char* names[CaptureMerger::MAX_ADAPTERS] = {tty};
+        for (int k = 0; k < num_more_ttys; k++)
         {
-            if (i2cd.read(&data, 1, 0, -1, 100) != 1)
-                break; // We break even on EWOULDBLOCK, because idle tokens should always come
-            decodeCapture(data);
-            if (++flushcount == 10)
-            {
-                fflush(stdout);
-                flushcount = 0;
-            }
+            devs[k + 1] = more_devs[k];
+            names[k + 1] = more_ttys[k];
         }
-
-        fprintf(stdout, "%s\n", color.DEFAULT);
+        for (int k = 0; k <= num_more_ttys; k++)
+        {
+            devs[k]->action("capturing I2C events");
+            maybeSet('c', *devs[k]);
+        }
+        captureMerged(devs, names, num_more_ttys + 1, strtol(options[CAPTURE].last()->arg, nullptr, 10));
+    }
+    else if (options[CAPTURE])
+    {
+        i2cd.action("capturing I2C events");
+        maybeSet('c');
+        int usb_latency = getUSBLatency(tty);
+        capture_timebase.setLatency(usb_latency);
+        CaptureArchive* archive = nullptr;
+        if (options[CAPTURE_OUT])
+            archive = new CaptureArchive(
+                options[CAPTURE_OUT].last()->arg,
+                options[ROTATE_SIZE] ? strtoull(options[ROTATE_SIZE].last()->arg, nullptr, 10) << 20 : 0,
+                options[ROTATE_TIME] ? strtoull(options[ROTATE_TIME].last()->arg, nullptr, 10) : 0,
+                options[ROTATE_KEEP] ? strtoul(options[ROTATE_KEEP].last()->arg, nullptr, 10) : 0, usb_latency);
+        bool ok = capture(strtol(options[CAPTURE].last()->arg, nullptr, 10), archive);
+        delete archive;
+        if (publisher != nullptr)
+            publisher->close();
+        if (!ok)
+            return 1;
     }
+    i2cd.setTap(FlightRecorder::tap, &flight_recorder);
 
     if (options[DEV])
     {
@@ -1006,7 +2220,8 @@ int main(int argc, char* argv[])
             fprintf(stderr, "cuse error\n");
             return 1;
         }
-        else if (debug_cuse)
+        tracer.drain();
+        if (debug_cuse)
             fprintf(stdout, "cuse device emulation terminated successfully\n");
 
         // Make sure we leave the device in the requested state
@@ -1018,6 +2233,22 @@ int main(int argc, char* argv[])
         maybeSet2(pullups[0], pullups[1]);
     }
 
+    if (options[MOUNT])
+    {
+        add_pec = false;
+        const char* mountpoint = options[MOUNT].last()->arg;
+        if (0 != regfs(mountpoint, options[BACKGROUND]))
+        {
+            fprintf(stderr, "fuse error\n");
+            return 1;
+        }
+        tracer.drain();
+        if (debug_cuse)
+            fprintf(stdout, "%s unmounted\n", mountpoint);
+        i2cd.clearError();
+    }
+    realtime.report(stderr);
+
     maybeSet(monitor);
 
     if (i2cd.hasError())
@@ -1043,12 +2274,20 @@ extern "C" void cuse_ioctl(fuse_req_t req, int cmd, void* arg, struct fuse_file_
 struct per_connection_data
 {
     int8_t slave_addr = -1;
+    unsigned long retries = 0; // set by I2C_RETRIES
+    unsigned long timeout = 0; // set by I2C_TIMEOUT in units of 10ms, 0 for none
+    uint64_t retried = 0;      // number of retries performed
+    uint64_t recovered = 0;    // transactions that succeeded after retrying
+    uint64_t timeouts = 0;     // transactions that failed with ETIMEDOUT
 };
 
 void cuse_open(fuse_req_t req, struct fuse_file_info* fi)
 {
     if (debug_cuse)
         fprintf(stdout, "cuse open\n");
+    BusRequest bus(req);
+    if (!bus.acquired())
+        return (void)fuse_reply_err(req, EINTR);
     fi->fh = (uintptr_t) new per_connection_data;
     if (fi->fh == 0)
         fuse_reply_err(req, ENOMEM);
@@ -1092,11 +2331,38 @@ void cuse_open(fuse_req_t req, struct fuse_file_info* fi)
     }
 }
 
+// Prints an error returned by i2c_rdwr(). ENXIO is what probing clients expect
+// for absent devices and EINTR goes to a client that is no longer interested, so
+// these are only reported in verbose mode.
+void cuse_report_error(const char* msg, int err)
+{
+    if ((err == ENXIO || err == EINTR) && !debug_cuse)
+        return;
+    fprintf(stderr, "%s: %s\n", msg, (err == EIO && i2cd.hasError()) ? i2cd.error() : strerror(err));
+}
+
 void cuse_close(fuse_req_t req, struct fuse_file_info* fi)
 {
+    std::lock_guard<std::timed_mutex> lock(bus_mutex);
+    tracer.drain();
     if (debug_cuse)
-        fprintf(stdout, "cuse close\n");
-    delete (per_connection_data*)fi->fh;
+    {
+        fprintf(stdout, "cuse close (%" PRIu64 " transactions to absent addresses short-circuited, %" PRIu64
+                        " presence scans)\n",
+                presence.short_circuited, presence.scans);
+        if (interrupt_stats.count > 0)
+            fprintf(stdout, "%" PRIu64 " interrupted requests, bus free after %" PRIu64 " us average, %" PRIu64
+                            " us max\n",
+                    interrupt_stats.count, interrupt_stats.total_latency / interrupt_stats.count,
+                    interrupt_stats.max_latency);
+    }
+    per_connection_data* conn = (per_connection_data*)fi->fh;
+    if (debug_cuse && (conn->retries != 0 || conn->timeout != 0))
+        fprintf(stdout,
+                "client: %" PRIu64 " retries, %" PRIu64 " transactions succeeded after retrying, %" PRIu64
+                " timeouts\n",
+                conn->retried, conn->recovered, conn->timeouts);
+    delete conn;
     if (--cuse_open_count == 0)
     {
         i2cd.close();
@@ -1105,6 +2371,47 @@ void cuse_close(fuse_req_t req, struct fuse_file_info* fi)
     fuse_reply_err(req, 0);
 }
 
+// Performs a transfer for a client, honoring its I2C_TIMEOUT and I2C_RETRIES
+// settings. The timeout covers the whole transaction including waiting for the bus
+// and all retries. Retries probe the bus even if the presence cache considers the
+// address absent, because the client explicitly asked for them. The bus is released
+// while backing off, so that other clients are not held up.
+int cuse_transfer(fuse_req_t req, per_connection_data* conn, i2c_rdwr_ioctl_data& rdwr)
+{
+    uint64_t start = micros();
+    BusRequest bus(req, conn->timeout ? start + 10000 * (uint64_t)conn->timeout : 0);
+    int err = bus.acquired() ? i2c_rdwr(rdwr, debug_cuse) : BusRequest::abortReason();
+    uint64_t backoff = retry_backoff;
+    for (unsigned long retry = 0; retry < conn->retries && (err == ENXIO || err == EAGAIN); retry++)
+    {
+        bus.release();
+        uint64_t wakeup = micros() + backoff;
+        while ((err = BusRequest::abortReason()) == 0)
+        {
+            uint64_t now = micros();
+            if (now >= wakeup)
+                break;
+            uint64_t left = wakeup - now;
+            usleep(left < 10000 ? left : 10000);
+        }
+        if (err != 0 || !bus.acquire())
+        {
+            err = BusRequest::abortReason();
+            break;
+        }
+        conn->retried++;
+        if (debug_cuse)
+            fprintf(stdout, "retry %lu after %" PRIu64 " us\n", retry + 1, micros() - start);
+        err = i2c_rdwr(rdwr, debug_cuse, false);
+        if (err == 0)
+            conn->recovered++;
+        backoff *= 2;
+    }
+    if (err == ETIMEDOUT)
+        conn->timeouts++;
+    return err;
+}
+
 void cuse_read(fuse_req_t req, size_t size, off_t off, struct fuse_file_info* fi)
 {
     int8_t slave = ((per_connection_data*)fi->fh)->slave_addr;
@@ -1123,10 +2430,11 @@ void cuse_read(fuse_req_t req, size_t size, off_t off, struct fuse_file_info* fi
         msg.addr = slave;
         msg.flags = I2C_M_RD;
         rdwr.msgs = &msg;
-        if (!i2c_rdwr(rdwr, debug_cuse))
+        int err = cuse_transfer(req, (per_connection_data*)fi->fh, rdwr);
+        if (err)
         {
-            fprintf(stderr, "cuse read error: %s\n", i2cd.error());
-            fuse_reply_err(req, EIO);
+            cuse_report_error("cuse read error", err);
+            fuse_reply_err(req, err);
         }
         else
             fuse_reply_buf(req, buf, size);
@@ -1150,17 +2458,19 @@ void cuse_write(fuse_req_t req, const char* buf, size_t size, off_t off, struct
         msg.addr = slave;
         msg.flags = 0;
         rdwr.msgs = &msg;
-        if (!i2c_rdwr(rdwr, debug_cuse))
+        int err = cuse_transfer(req, (per_connection_data*)fi->fh, rdwr);
+        if (err)
         {
-            fprintf(stderr, "cuse write error: %s\n", i2cd.error());
-            fuse_reply_err(req, EIO);
+            cuse_report_error("cuse write error", err);
+            fuse_reply_err(req, err);
         }
         else
             fuse_reply_write(req, size);
     }
 }
 
-void cuse_i2c_rdwr(fuse_req_t req, void* arg, const void* in_buf, size_t in_bufsz, size_t out_bufsz)
+void cuse_i2c_rdwr(fuse_req_t req, per_connection_data* conn, void* arg, const void* in_buf, size_t in_bufsz,
+                   size_t out_bufsz)
 {
     const uint8_t* inptr = (uint8_t*)in_buf;
     iovec in_iov[I2C_RDWR_IOCTL_MAX_MSGS + 3];
@@ -1270,12 +2580,12 @@ void cuse_i2c_rdwr(fuse_req_t req, void* arg, const void* in_buf, size_t in_bufs
 
     rdwr.msgs = numsgs;
 
-    bool okay = i2c_rdwr(rdwr, debug_cuse);
+    int err = cuse_transfer(req, conn, rdwr);
 
-    if (!okay)
+    if (err)
     {
-        fprintf(stderr, "cuse ioctl(I2C_RDWR) error: %s\n", i2cd.error());
-        fuse_reply_err(req, EIO);
+        cuse_report_error("cuse ioctl(I2C_RDWR) error", err);
+        fuse_reply_err(req, err);
     }
     else
         fuse_reply_ioctl_iov(req, rdwr.nmsgs, out_iov, out_idx);
@@ -1320,8 +2630,25 @@ void cuse_ioctl(fuse_req_t req, int cmd, void* arg, struct fuse_file_info* fi, u
             fuse_reply_ioctl(req, 0, NULL, 0);
             break;
 
+        case I2C_RETRIES:
+        case I2C_TIMEOUT:
+            if (debug_cuse)
+                fprintf(stdout, "cuse ioctl(%s, %lu)\n", cmd == I2C_RETRIES ? "I2C_RETRIES" : "I2C_TIMEOUT",
+                        (unsigned long)arg);
+            if ((unsigned long)arg > INT_MAX)
+            {
+                fuse_reply_err(req, EINVAL);
+                break;
+            }
+            if (cmd == I2C_RETRIES)
+                ((per_connection_data*)fi->fh)->retries = (unsigned long)arg;
+            else
+                ((per_connection_data*)fi->fh)->timeout = (unsigned long)arg;
+            fuse_reply_ioctl(req, 0, NULL, 0);
+            break;
+
         case I2C_RDWR:
-            cuse_i2c_rdwr(req, arg, in_buf, in_bufsz, out_bufsz);
+            cuse_i2c_rdwr(req, (per_connection_data*)fi->fh, arg, in_buf, in_bufsz, out_bufsz);
             break;
 
         default:
@@ -1329,6 +2656,13 @@ void cuse_ioctl(fuse_req_t req, int cmd, void* arg, struct fuse_file_info* fi, u
     }
 }
 
+// Called in the process that serves the device, i.e. after daemonizing with --background.
+void cuse_init_done(void* userdata)
+{
+    flight_recorder.start();
+    realtime.start();
+}
+
 int cuse(const char* devname, bool background)
 {
     char* dev_info_argv[1];
@@ -1341,7 +2675,7 @@ int cuse(const char* devname, bool background)
                            .flags = CUSE_UNRESTRICTED_IOCTL};
 
     static const struct cuse_lowlevel_ops clops = {.init = 0,
-                                                   .init_done = 0,
+                                                   .init_done = cuse_init_done,
                                                    .destroy = 0,
                                                    .open = cuse_open,
                                                    .read = cuse_read,
@@ -1364,8 +2698,9 @@ int cuse(const char* devname, bool background)
     if (se == NULL)
         return 1;
 
-    // we don't do multithreading
-    int res = fuse_session_loop(se);
+    // Requests are processed by multiple threads, so that an interrupt can reach a
+    // request that is busy on the bus. Bus access is serialized by BusRequest.
+    int res = fuse_session_loop_mt(se, 0);
 
     cuse_lowlevel_teardown(se);
     if (res == -1)
@@ -1378,6 +2713,688 @@ int cuse(const char* devname, bool background)
  * END OF CUSE CODE
  ***************************************************************************************/
 
+/****************************************************************************************
+ * START OF FUSE REGISTER FILESYSTEM CODE
+ ***************************************************************************************/
+
+// Layout of the filesystem presented by --mount:
+//
+//   /                  one directory per device found by a bus scan (any other address
+//                      can be looked up by name, too)
+//   /0x48/reg/0x00     register 0x00 of device 0x48 as text "0x1A\n". Writing a number
+//                      to the file writes the register.
+//   /0x48/regs         all 256 registers as a binary file. Offset = register number.
+//   /0x50/eeprom       contents of an EEPROM configured with --eeprom
+//
+// Inode numbers encode the path: ((addr + 1) << 12) | (kind << 8) | reg
+
+enum regfs_kind
+{
+    REGFS_DEVICE,
+    REGFS_REGDIR,
+    REGFS_REG,
+    REGFS_REGS,
+    REGFS_EEPROM,
+};
+
+const fuse_ino_t REGFS_ROOT = FUSE_ROOT_ID;
+const int REGFS_REG_SIZE = 5; // "0xNN\n"
+
+// Register values read via --mount. fetched[] is the micros() time the value was
+// read or written (0 if never).
+struct regfs_device
+{
+    uint8_t regs[256];
+    uint64_t fetched[256];
+} regfs_devices[128];
+
+bool regfs_listed[128]; // devices listed in the root directory
+
+// Describes an EEPROM type for --eeprom. Address bits beyond the addr_bytes sent
+// before the data select the device address (e.g. 24c04 to 24c16 occupy 2 to 8 addresses).
+struct eeprom_profile
+{
+    const char* name;
+    unsigned size;
+    unsigned page_size;
+    unsigned addr_bytes;
+};
+
+const eeprom_profile EEPROM_PROFILES[] = {
+    {"24c01", 128, 8, 1},     {"24c02", 256, 8, 1},      {"24c04", 512, 16, 1},      {"24c08", 1024, 16, 1},
+    {"24c16", 2048, 16, 1},   {"24c32", 4096, 32, 2},    {"24c64", 8192, 32, 2},     {"24c128", 16384, 64, 2},
+    {"24c256", 32768, 64, 2}, {"24c512", 65536, 128, 2}, {"24cm01", 131072, 256, 2}, {"24cm02", 262144, 256, 2},
+    {nullptr, 0, 0, 0}};
+
+// State of a page in regfs_eeprom's page cache
+enum eeprom_page_state : uint8_t
+{
+    PAGE_ABSENT,    // not read from the EEPROM yet
+    PAGE_CLEAN,     // data == orig == EEPROM contents
+    PAGE_DIRTY,     // data modified, orig == EEPROM contents
+    PAGE_DIRTY_NEW, // data completely overwritten without being read, orig unknown
+};
+
+// Write-back page cache of an EEPROM presented as file with --mount. The EEPROM
+// can only be changed by us, so cached pages never expire.
+struct regfs_eeprom
+{
+    eeprom_profile profile;
+    uint8_t* data;  // what the file contains
+    uint8_t* orig;  // what the EEPROM contains (for pages not PAGE_DIRTY_NEW)
+    uint8_t* state; // eeprom_page_state for each page
+    uint64_t pages_read = 0;
+    uint64_t pages_written = 0;
+    uint64_t pages_unchanged = 0; // dirty pages that turned out to be identical to the EEPROM
+};
+
+regfs_eeprom* regfs_eeproms[128];
+
+// Parses "<addr>:<type>" (see --eeprom) and sets up the page cache.
+// Prints an error and returns false if arg is invalid.
+bool regfs_add_eeprom(const char* arg)
+{
+    char* a = strdup(arg);
+    char* colon = strchr(a, ':');
+    int addr = -1;
+    eeprom_profile prof = {nullptr, 0, 0, 0};
+    if (colon != nullptr)
+    {
+        *colon = 0;
+        addr = Arg::Int7(a);
+        for (int i = 0; EEPROM_PROFILES[i].name != nullptr; i++)
+            if (strcasecmp(EEPROM_PROFILES[i].name, colon + 1) == 0)
+                prof = EEPROM_PROFILES[i];
+        if (prof.name == nullptr &&
+            3 == sscanf(colon + 1, "%u/%u/%u", &prof.size, &prof.page_size, &prof.addr_bytes) &&
+            prof.addr_bytes >= 1 && prof.addr_bytes <= 2 && prof.page_size > 0 && prof.page_size <= 256 &&
+            prof.size % prof.page_size == 0 && prof.size <= (1u << (8 * prof.addr_bytes + 3)))
+            prof.name = "custom";
+    }
+    free(a);
+
+    if (addr < 0 || prof.name == nullptr)
+    {
+        fprintf(stderr, "Invalid --eeprom argument \"%s\"\n", arg);
+        return false;
+    }
+
+    unsigned pages = prof.size / prof.page_size;
+    regfs_eeprom* ee = new regfs_eeprom;
+    ee->profile = prof;
+    ee->data = (uint8_t*)malloc(prof.size);
+    ee->orig = (uint8_t*)malloc(prof.size);
+    ee->state = (uint8_t*)calloc(pages, 1); // PAGE_ABSENT
+    if (ee->data == nullptr || ee->orig == nullptr || ee->state == nullptr)
+    {
+        fprintf(stderr, "Not enough memory for --eeprom\n");
+        return false;
+    }
+    delete regfs_eeproms[addr];
+    regfs_eeproms[addr] = ee;
+    return true;
+}
+
+// Computes the device address and the address bytes to send for offset off.
+// Returns the number of address bytes stored in abuf.
+int eeprom_address(int addr, const eeprom_profile& prof, unsigned off, uint8_t* abuf, int& dev)
+{
+    unsigned bits = 8 * prof.addr_bytes;
+    dev = addr | (off >> bits);
+    if (prof.addr_bytes == 2)
+        abuf[0] = off >> 8;
+    abuf[prof.addr_bytes - 1] = off;
+    return prof.addr_bytes;
+}
+
+// Reads pages [first, first+count) that are PAGE_ABSENT. Runs of absent pages are
+// read with a single transaction each (as far as the EEPROM's address bits permit).
+// Returns 0 or an errno value.
+int eeprom_load(int addr, unsigned first, unsigned count)
+{
+    regfs_eeprom* ee = regfs_eeproms[addr];
+    const eeprom_profile& prof = ee->profile;
+    unsigned block = 1u << (8 * prof.addr_bytes); // sequential reads wrap around at block boundaries
+    unsigned pg = first;
+    while (pg < first + count)
+    {
+        if (ee->state[pg] != PAGE_ABSENT)
+        {
+            pg++;
+            continue;
+        }
+
+        unsigned off = pg * prof.page_size;
+        unsigned n = 0;
+        while (pg + n < first + count && ee->state[pg + n] == PAGE_ABSENT && (n + 1) * prof.page_size <= 32768 &&
+               (off + (n + 1) * prof.page_size - 1) / block == off / block)
+            n++;
+
+        uint8_t abuf[2];
+        int dev;
+        int alen = eeprom_address(addr, prof, off, abuf, dev);
+        i2c_msg rmsgs[2] = {{(uint16_t)dev, 0, (uint16_t)alen, abuf},
+                            {(uint16_t)dev, I2C_M_RD, (uint16_t)(n * prof.page_size), ee->orig + off}};
+        i2c_rdwr_ioctl_data rdwr = {rmsgs, 2};
+        int err = i2c_rdwr(rdwr, debug_cuse);
+        if (err)
+            return err;
+
+        memcpy(ee->data + off, ee->orig + off, n * prof.page_size);
+        memset(ee->state + pg, PAGE_CLEAN, n);
+        ee->pages_read += n;
+        pg += n;
+    }
+    return 0;
+}
+
+// Writes all dirty pages back to the EEPROM, one page write per page followed by
+// ACK polling for the end of the write cycle. Pages whose data is identical to the
+// EEPROM's contents are not written. Returns 0 or an errno value.
+int eeprom_writeback(int addr)
+{
+    regfs_eeprom* ee = regfs_eeproms[addr];
+    if (ee == nullptr)
+        return 0;
+    const eeprom_profile& prof = ee->profile;
+    unsigned pages = prof.size / prof.page_size;
+    for (unsigned pg = 0; pg < pages; pg++)
+    {
+        if (ee->state[pg] != PAGE_DIRTY && ee->state[pg] != PAGE_DIRTY_NEW)
+            continue;
+
+        unsigned off = pg * prof.page_size;
+        if (ee->state[pg] == PAGE_DIRTY && memcmp(ee->data + off, ee->orig + off, prof.page_size) == 0)
+        {
+            ee->state[pg] = PAGE_CLEAN;
+            ee->pages_unchanged++;
+            continue;
+        }
+
+        uint8_t buf[2 + 256];
+        int dev;
+        int alen = eeprom_address(addr, prof, off, buf, dev);
+        memcpy(buf + alen, ee->data + off, prof.page_size);
+        i2c_msg wmsg = {(uint16_t)dev, 0, (uint16_t)(alen + prof.page_size), buf};
+        i2c_rdwr_ioctl_data rdwr = {&wmsg, 1};
+        int err = i2c_rdwr(rdwr, debug_cuse);
+        if (err == 0)
+            err = ackPoll(dev, 50);
+        if (err)
+            return err;
+
+        memcpy(ee->orig + off, ee->data + off, prof.page_size);
+        ee->state[pg] = PAGE_CLEAN;
+        ee->pages_written++;
+    }
+    return 0;
+}
+
+fuse_ino_t regfs_ino(int addr, regfs_kind kind, int reg = 0) { return ((addr + 1) << 12) | (kind << 8) | reg; }
+int regfs_addr(fuse_ino_t ino) { return (ino >> 12) - 1; }
+regfs_kind regfs_kind_of(fuse_ino_t ino) { return (regfs_kind)((ino >> 8) & 0xf); }
+int regfs_reg(fuse_ino_t ino) { return ino & 0xff; }
+
+// Returns true if registers [first, first+count) all have values younger than --attr-cache.
+bool regfs_fresh(int addr, int first, int count)
+{
+    uint64_t now = micros();
+    for (int r = first; r < first + count; r++)
+    {
+        uint64_t t = regfs_devices[addr].fetched[r];
+        if (t == 0 || now - t >= attr_cache)
+            return false;
+    }
+    return true;
+}
+
+// Reads registers [first, first+count) in a single transaction unless they are
+// all fresh in the cache. Returns 0 or an errno value.
+int regfs_fetch(int addr, int first, int count)
+{
+    if (regfs_fresh(addr, first, count))
+        return 0;
+
+    uint8_t reg = first;
+    i2c_msg rmsgs[2] = {{(uint16_t)addr, 0, 1, &reg},
+                        {(uint16_t)addr, I2C_M_RD, (uint16_t)count, regfs_devices[addr].regs + first}};
+    i2c_rdwr_ioctl_data rdwr = {rmsgs, 2};
+    int err = i2c_rdwr(rdwr, debug_cuse);
+    if (err)
+        return err;
+
+    regfs_listed[addr] = true;
+    uint64_t now = micros();
+    for (int r = first; r < first + count; r++)
+        regfs_devices[addr].fetched[r] = now;
+    return 0;
+}
+
+// Writes data to registers [first, first+count) in a single transaction and
+// updates the cache. Returns 0 or an errno value.
+int regfs_store(int addr, int first, const uint8_t* data, int count)
+{
+    uint8_t buf[257];
+    buf[0] = first;
+    memcpy(buf + 1, data, count);
+    i2c_msg wmsg = {(uint16_t)addr, 0, (uint16_t)(count + 1), buf};
+    i2c_rdwr_ioctl_data rdwr = {&wmsg, 1};
+    int err = i2c_rdwr(rdwr, debug_cuse);
+    if (err)
+        return err;
+
+    regfs_listed[addr] = true;
+    uint64_t now = micros();
+    memcpy(regfs_devices[addr].regs + first, data, count);
+    for (int r = first; r < first + count; r++)
+        regfs_devices[addr].fetched[r] = now;
+    return 0;
+}
+
+// Fills st for ino. Returns false if ino does not exist.
+bool regfs_stat(fuse_ino_t ino, struct stat* st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_ino = ino;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    if (ino == REGFS_ROOT)
+    {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+        return true;
+    }
+
+    int addr = regfs_addr(ino);
+    if (addr < 0 || addr > 127)
+        return false;
+
+    switch (regfs_kind_of(ino))
+    {
+        case REGFS_DEVICE:
+        case REGFS_REGDIR:
+            st->st_mode = S_IFDIR | 0755;
+            st->st_nlink = 2;
+            return true;
+        case REGFS_REG:
+            st->st_mode = S_IFREG | 0644;
+            st->st_nlink = 1;
+            st->st_size = REGFS_REG_SIZE;
+            return true;
+        case REGFS_REGS:
+            st->st_mode = S_IFREG | 0644;
+            st->st_nlink = 1;
+            st->st_size = 256;
+            return true;
+        case REGFS_EEPROM:
+            if (regfs_eeproms[addr] == nullptr)
+                return false;
+            st->st_mode = S_IFREG | 0644;
+            st->st_nlink = 1;
+            st->st_size = regfs_eeproms[addr]->profile.size;
+            return true;
+    }
+    return false;
+}
+
+// Parses name as a hex number "0x.." in [0,max]. Returns -1 if it is not.
+int regfs_parse_name(const char* name, int max)
+{
+    if (name[0] != '0' || (name[1] != 'x' && name[1] != 'X') || name[2] == 0)
+        return -1;
+    char* endptr;
+    long l = strtol(name + 2, &endptr, 16);
+    if (*endptr != 0 || l < 0 || l > max)
+        return -1;
+    return l;
+}
+
+void regfs_reply_entry(fuse_req_t req, fuse_ino_t ino)
+{
+    fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = ino;
+    e.attr_timeout = attr_cache / 1e6;
+    e.entry_timeout = attr_cache / 1e6;
+    regfs_stat(ino, &e.attr);
+    fuse_reply_entry(req, &e);
+}
+
+void regfs_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    int n;
+    if (parent == REGFS_ROOT)
+    {
+        n = regfs_parse_name(name, 127);
+        if (n >= 0)
+            return regfs_reply_entry(req, regfs_ino(n, REGFS_DEVICE));
+    }
+    else
+    {
+        int addr = regfs_addr(parent);
+        switch (regfs_kind_of(parent))
+        {
+            case REGFS_DEVICE:
+                if (strcmp(name, "reg") == 0)
+                    return regfs_reply_entry(req, regfs_ino(addr, REGFS_REGDIR));
+                if (strcmp(name, "regs") == 0)
+                    return regfs_reply_entry(req, regfs_ino(addr, REGFS_REGS));
+                if (strcmp(name, "eeprom") == 0 && regfs_eeproms[addr] != nullptr)
+                    return regfs_reply_entry(req, regfs_ino(addr, REGFS_EEPROM));
+                break;
+            case REGFS_REGDIR:
+                n = regfs_parse_name(name, 255);
+                if (n >= 0)
+                    return regfs_reply_entry(req, regfs_ino(addr, REGFS_REG, n));
+                break;
+            default:
+                break;
+        }
+    }
+    fuse_reply_err(req, ENOENT);
+}
+
+void regfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    struct stat st;
+    if (!regfs_stat(ino, &st))
+        fuse_reply_err(req, ENOENT);
+    else
+        fuse_reply_attr(req, &st, attr_cache / 1e6);
+}
+
+// Needed for O_TRUNC (e.g. "echo 0x12 >reg/0x05"). Sizes are fixed, so nothing changes.
+void regfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set, struct fuse_file_info* fi)
+{
+    regfs_getattr(req, ino, fi);
+}
+
+void regfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi)
+{
+    char buf[16384];
+    size_t len = 0; // of the reply in buf
+    size_t room = size < sizeof(buf) ? size : sizeof(buf);
+    off_t pos = 0; // offset of the next entry in the listing
+    bool full = false;
+    struct stat st;
+    char name[8];
+
+    // Adds the entry to the reply if it is at or after off and fits completely.
+    // Its offset is that of the entry after it, where a continued listing resumes.
+    auto add = [&](const char* entry, fuse_ino_t entry_ino) {
+        size_t entsize = fuse_add_direntry(req, nullptr, 0, entry, nullptr, 0);
+        pos += entsize;
+        if (pos - (off_t)entsize < off || full)
+            return;
+        if (len + entsize > room)
+        {
+            full = true;
+            return;
+        }
+        regfs_stat(entry_ino, &st);
+        fuse_add_direntry(req, buf + len, entsize, entry, &st, pos);
+        len += entsize;
+    };
+
+    std::lock_guard<std::timed_mutex> lock(bus_mutex); // regfs_listed[] is updated by transfers
+
+    add(".", ino);
+    if (ino != REGFS_ROOT && regfs_kind_of(ino) == REGFS_REGDIR)
+        add("..", regfs_ino(regfs_addr(ino), REGFS_DEVICE));
+    else
+        add("..", REGFS_ROOT);
+
+    if (ino == REGFS_ROOT)
+    {
+        for (int addr = 0; addr < 128; addr++)
+            if (regfs_listed[addr])
+            {
+                snprintf(name, sizeof(name), "0x%02X", addr);
+                add(name, regfs_ino(addr, REGFS_DEVICE));
+            }
+    }
+    else
+    {
+        int addr = regfs_addr(ino);
+        switch (regfs_kind_of(ino))
+        {
+            case REGFS_DEVICE:
+                add("reg", regfs_ino(addr, REGFS_REGDIR));
+                add("regs", regfs_ino(addr, REGFS_REGS));
+                if (regfs_eeproms[addr] != nullptr)
+                    add("eeprom", regfs_ino(addr, REGFS_EEPROM));
+                break;
+            case REGFS_REGDIR:
+                for (int reg = 0; reg < 256; reg++)
+                {
+                    snprintf(name, sizeof(name), "0x%02X", reg);
+                    add(name, regfs_ino(addr, REGFS_REG, reg));
+                }
+                break;
+            default:
+                fuse_reply_err(req, ENOTDIR);
+                return;
+        }
+    }
+
+    // off is the end of the last entry the kernel got, i.e. a byte offset into
+    // the whole listing, and buf holds the whole entries that follow it.
+    fuse_reply_buf(req, len == 0 ? nullptr : buf, len);
+}
+
+// Lets the kernel keep its page cache across opens only while our cached values are
+// fresh, so that repeated reads (e.g. "cat" from a monitoring script) are served by
+// the kernel without even reaching us.
+void regfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    std::lock_guard<std::timed_mutex> lock(bus_mutex);
+    int addr = regfs_addr(ino);
+    switch (regfs_kind_of(ino))
+    {
+        case REGFS_REG:
+            fi->keep_cache = regfs_fresh(addr, regfs_reg(ino), 1);
+            break;
+        case REGFS_REGS:
+            fi->keep_cache = regfs_fresh(addr, 0, 256);
+            break;
+        case REGFS_EEPROM:
+            fi->keep_cache = 1;
+            break;
+        default:
+            fuse_reply_err(req, EISDIR);
+            return;
+    }
+    fuse_reply_open(req, fi);
+}
+
+void regfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi)
+{
+    BusRequest bus(req);
+    if (!bus.acquired())
+        return (void)fuse_reply_err(req, EINTR);
+    int addr = regfs_addr(ino);
+    int err;
+    if (regfs_kind_of(ino) == REGFS_REG)
+    {
+        int reg = regfs_reg(ino);
+        int first = reg - reg % reg_block;
+        int count = (first + reg_block > 256) ? 256 - first : reg_block;
+        if (!regfs_fresh(addr, reg, 1) && (err = regfs_fetch(addr, first, count)) != 0)
+            return (void)fuse_reply_err(req, err);
+
+        char text[REGFS_REG_SIZE + 1];
+        snprintf(text, sizeof(text), "0x%02X\n", regfs_devices[addr].regs[reg]);
+        if (off >= REGFS_REG_SIZE)
+            size = 0;
+        else if (off + size > REGFS_REG_SIZE)
+            size = REGFS_REG_SIZE - off;
+        fuse_reply_buf(req, text + off, size);
+    }
+    else if (regfs_kind_of(ino) == REGFS_REGS)
+    {
+        if (off >= 256)
+            size = 0;
+        else if (off + size > 256)
+            size = 256 - off;
+        if (size > 0 && (err = regfs_fetch(addr, off, size)) != 0)
+            return (void)fuse_reply_err(req, err);
+        fuse_reply_buf(req, (const char*)regfs_devices[addr].regs + off, size);
+    }
+    else // REGFS_EEPROM
+    {
+        regfs_eeprom* ee = regfs_eeproms[addr];
+        unsigned esize = ee->profile.size;
+        unsigned psize = ee->profile.page_size;
+        if ((size_t)off >= esize)
+            size = 0;
+        else if (off + size > esize)
+            size = esize - off;
+        if (size > 0 && (err = eeprom_load(addr, off / psize, (off + size - 1) / psize - off / psize + 1)) != 0)
+            return (void)fuse_reply_err(req, err);
+        fuse_reply_buf(req, (const char*)ee->data + off, size);
+    }
+}
+
+void regfs_write(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size, off_t off, struct fuse_file_info* fi)
+{
+    BusRequest bus(req);
+    if (!bus.acquired())
+        return (void)fuse_reply_err(req, EINTR);
+    int addr = regfs_addr(ino);
+    int err;
+    if (regfs_kind_of(ino) == REGFS_REG)
+    {
+        char text[32];
+        size_t l = size < sizeof(text) - 1 ? size : sizeof(text) - 1;
+        memcpy(text, buf, l);
+        text[l] = 0;
+        char* endptr;
+        unsigned long val = strtoul(text, &endptr, 0);
+        while (*endptr != 0 && *endptr <= ' ')
+            endptr++;
+        if (endptr == text || *endptr != 0 || val > 0xff)
+            return (void)fuse_reply_err(req, EINVAL);
+        uint8_t b = val;
+        if ((err = regfs_store(addr, regfs_reg(ino), &b, 1)) != 0)
+            return (void)fuse_reply_err(req, err);
+    }
+    else if (regfs_kind_of(ino) == REGFS_REGS)
+    {
+        if (off >= 256 || off + size > 256)
+            return (void)fuse_reply_err(req, EFBIG);
+        if ((err = regfs_store(addr, off, (const uint8_t*)buf, size)) != 0)
+            return (void)fuse_reply_err(req, err);
+    }
+    else // REGFS_EEPROM
+    {
+        // Only update the cache. Dirty pages are written back on flush/fsync/unmount.
+        regfs_eeprom* ee = regfs_eeproms[addr];
+        unsigned psize = ee->profile.page_size;
+        if ((size_t)off >= ee->profile.size || off + size > ee->profile.size)
+            return (void)fuse_reply_err(req, EFBIG);
+        unsigned first = off / psize;
+        unsigned last = (off + size - 1) / psize;
+        // partially written pages must be read first, because we write back whole pages
+        if ((off % psize != 0 && (err = eeprom_load(addr, first, 1)) != 0) ||
+            ((off + size) % psize != 0 && (err = eeprom_load(addr, last, 1)) != 0))
+            return (void)fuse_reply_err(req, err);
+        memcpy(ee->data + off, buf, size);
+        for (unsigned pg = first; pg <= last; pg++)
+            ee->state[pg] = (ee->state[pg] == PAGE_ABSENT || ee->state[pg] == PAGE_DIRTY_NEW) ? PAGE_DIRTY_NEW
+                                                                                              : PAGE_DIRTY;
+    }
+    fuse_reply_write(req, size);
+}
+
+// An interrupted write-back leaves the remaining pages dirty for the next flush.
+void regfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    BusRequest bus(req);
+    int err = EINTR;
+    if (bus.acquired())
+        err = (regfs_kind_of(ino) == REGFS_EEPROM) ? eeprom_writeback(regfs_addr(ino)) : 0;
+    fuse_reply_err(req, err);
+}
+
+void regfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi)
+{
+    regfs_flush(req, ino, fi);
+}
+
+void regfs_destroy(void* userdata)
+{
+    tracer.drain();
+    for (int addr = 0; addr < 128; addr++)
+    {
+        regfs_eeprom* ee = regfs_eeproms[addr];
+        if (ee == nullptr)
+            continue;
+        int err = eeprom_writeback(addr);
+        if (err)
+            fprintf(stderr, "Error writing back EEPROM 0x%02X: %s\n", addr, strerror(err));
+        if (debug_cuse)
+            fprintf(stdout,
+                    "EEPROM 0x%02X: %" PRIu64 " pages read, %" PRIu64 " pages written, %" PRIu64
+                    " unchanged pages not written\n",
+                    addr, ee->pages_read, ee->pages_written, ee->pages_unchanged);
+    }
+}
+
+int regfs(const char* mountpoint, bool background)
+{
+    static struct fuse_lowlevel_ops ops; // all unused members 0
+    ops.destroy = regfs_destroy;
+    ops.lookup = regfs_lookup;
+    ops.getattr = regfs_getattr;
+    ops.setattr = regfs_setattr;
+    ops.open = regfs_open;
+    ops.read = regfs_read;
+    ops.write = regfs_write;
+    ops.flush = regfs_flush;
+    ops.fsync = regfs_fsync;
+    ops.readdir = regfs_readdir;
+
+    char result[112];
+    if (scanBus(result))
+        for (int i = 0; i < 112; i++)
+            regfs_listed[i + 8] = (result[i] == '1');
+    i2cd.clearError();
+    for (int addr = 0; addr < 128; addr++)
+        if (regfs_eeproms[addr] != nullptr)
+            regfs_listed[addr] = true;
+
+    const char* xargv[] = {"i2cdriver"};
+    struct fuse_args args = FUSE_ARGS_INIT(1, (char**)xargv);
+    struct fuse_session* se = fuse_session_new(&args, &ops, sizeof(ops), nullptr);
+    if (se == NULL)
+        return 1;
+
+    int res = -1;
+    if (fuse_set_signal_handlers(se) == 0)
+    {
+        if (fuse_session_mount(se, mountpoint) == 0)
+        {
+            fuse_daemonize(!background);
+            flight_recorder.start();
+            realtime.start();
+            // see cuse() for why we use multiple threads
+            res = fuse_session_loop_mt(se, 0);
+            fuse_session_unmount(se);
+        }
+        fuse_remove_signal_handlers(se);
+    }
+    fuse_session_destroy(se);
+
+    if (res != 0)
+        return 1;
+
+    return 0;
+}
+
+/****************************************************************************************
+ * END OF FUSE REGISTER FILESYSTEM CODE
+ ***************************************************************************************/
+
 /******************************************************************************************
  * The code below was taken and adapted from i2ctransfer.c from the package i2c-tools-4.3
  *****************************************************************************************/
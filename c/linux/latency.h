@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2022 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Histogram of latencies in microseconds. Values below 32 have their own
+// bucket, above that each power of 2 is split into 16 buckets, so that the
+// resolution is better than 7% over the whole range, adding a value is O(1) and
+// percentiles need no sorting.
+class LatencyHistogram
+{
+    static const int BUCKETS = 32 + 59 * 16;
+
+    uint64_t count[BUCKETS] = {};
+    uint64_t n = 0;
+    uint64_t sum = 0;
+    uint64_t min = UINT64_MAX;
+    uint64_t max = 0;
+
+    static int bucket(uint64_t us)
+    {
+        if (us < 32)
+            return us;
+        int e = 63 - __builtin_clzll(us); // >= 5
+        return 32 + (e - 5) * 16 + ((us >> (e - 4)) & 15);
+    }
+
+    // Smallest value that goes into bucket b.
+    static uint64_t lowest(int b)
+    {
+        if (b < 32)
+            return b;
+        int e = 5 + (b - 32) / 16;
+        return (uint64_t)(16 + (b - 32) % 16) << (e - 4);
+    }
+
+  public:
+    void add(uint64_t us)
+    {
+        count[bucket(us)]++;
+        n++;
+        sum += us;
+        if (us < min)
+            min = us;
+        if (us > max)
+            max = us;
+    }
+
+    uint64_t samples() const { return n; }
+
+    // Returns the value that p percent of the samples are below, rounded down to
+    // the histogram's resolution.
+    uint64_t percentile(double p) const
+    {
+        uint64_t rank = n * p / 100;
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS; b++)
+        {
+            seen += count[b];
+            if (seen > rank)
+                return lowest(b) < min ? min : lowest(b);
+        }
+        return max;
+    }
+
+    // Prints a line like "<what>: min 180us p50 250us ... max 2300us".
+    void print(FILE* out, const char* what) const
+    {
+        if (n == 0)
+        {
+            fprintf(out, "%s: no samples\n", what);
+            return;
+        }
+        fprintf(out,
+                "%s: min %" PRIu64 "us  avg %" PRIu64 "us  p50 %" PRIu64 "us  p90 %" PRIu64 "us  p99 %" PRIu64
+                "us  p99.9 %" PRIu64 "us  max %" PRIu64 "us\n",
+                what, min, sum / n, percentile(50), percentile(90), percentile(99), percentile(99.9), max);
+    }
+};
+
+#endif
@@ -0,0 +1,392 @@
+/*
+ * Copyright (C) 2022 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PARALLEL_DECODE_H
+#define PARALLEL_DECODE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+
+#include "capture.h"
+#include "capture_file.h"
+
+// Decodes capture files to text on all cores for --decode. The files are
+// memory-mapped and cut into chunks at frame boundaries, which are decoded by
+// worker threads with a CaptureDecoder each. The decoder's state after a 0x00
+// byte (2 idle tokens) is always the same, and so it is after the reset for lost
+// data, so the output of a chunk starts right after the first such point in it
+// and ends at the first such point after it, where the next chunk's output
+// begins. The chunks' output is written in order, with only a limited number of
+// chunks ahead in memory. The result is the same as decoding sequentially.
+class ParallelDecoder
+{
+    static const size_t CHUNK_SIZE = 1 << 18; // bytes of file per chunk
+    static const int MAX_FILES = 4096;
+
+    struct MappedFile
+    {
+        const char* path;
+        const uint8_t* data;
+        size_t size;
+        size_t start; // offset of the first frame
+        std::atomic<uint64_t> skipped{0};
+    };
+
+    // Position of a frame.
+    struct Pos
+    {
+        int file;
+        size_t off;
+
+        bool operator<(const Pos& p) const { return file < p.file || (file == p.file && off < p.off); }
+    };
+
+    struct Chunk
+    {
+        Pos start;
+        std::atomic<bool> done{false};
+    };
+
+    // Text of a chunk. The buffers are reused for every window-th chunk, so
+    // that the memory does not have to be faulted in again and again.
+    struct Text
+    {
+        char* buf = nullptr;
+        size_t len = 0;
+        size_t cap = 0;
+
+        static ssize_t write(void* cookie, const char* data, size_t n)
+        {
+            Text* t = (Text*)cookie;
+            if (t->len + n > t->cap)
+            {
+                t->cap = t->len + n > 2 * t->cap ? t->len + n : 2 * t->cap;
+                t->buf = (char*)realloc(t->buf, t->cap);
+            }
+            memcpy(t->buf + t->len, data, n);
+            t->len += n;
+            return n;
+        }
+    };
+
+    const CaptureText& text;
+    const Color& color;
+    MappedFile files[MAX_FILES];
+    int nfiles = 0;
+    Chunk* chunks = nullptr;
+    size_t nchunks = 0;
+    Text* texts = nullptr; // [window]
+    std::atomic<size_t> next_chunk{0};
+    std::atomic<size_t> written{0};
+    size_t window = 0; // chunks that may be decoded ahead of the output
+
+    // Reads the frame header at p. Returns false at the end of the capture data.
+    bool header(const Pos& p, CaptureFrameHeader& h) const
+    {
+        const MappedFile& f = files[p.file];
+        if (p.off + sizeof(h) > f.size)
+            return false;
+        memcpy(&h, f.data + p.off, sizeof(h));
+        return !captureFrameIsIndex(h);
+    }
+
+    // Returns true if there is a valid frame at p. If strict, it must also be
+    // followed by another frame or the end of the file, which makes it unlikely
+    // that payload that happens to look like a frame header is taken for one
+    // when looking for a chunk boundary in the middle of the file.
+    bool frameAt(const Pos& p, bool strict) const
+    {
+        CaptureFrameHeader h;
+        if (!header(p, h) || !captureFrameValid(h))
+            return false;
+        const MappedFile& f = files[p.file];
+        size_t end = p.off + sizeof(h) + le32toh(h.len);
+        if (!strict || end + sizeof(h) > f.size)
+            return true;
+        memcpy(&h, f.data + end, sizeof(h));
+        return le32toh(h.sync) == CAPTURE_FRAME_SYNC;
+    }
+
+    // Advances p from a frame to the next one like CaptureFileReader, skipping
+    // damaged data and counting it if count is true.
+    void advance(Pos& p, bool count)
+    {
+        CaptureFrameHeader h;
+        header(p, h);
+        p.off += sizeof(h) + le32toh(h.len);
+        sync(p, count, false);
+    }
+
+    // Moves p to the next frame at or after it, on to the next file at the end
+    // of the capture data.
+    void sync(Pos& p, bool count, bool strict)
+    {
+        while (p.file < nfiles)
+        {
+            CaptureFrameHeader h;
+            if (!header(p, h) ||
+                (captureFrameValid(h) && p.off + sizeof(h) + le32toh(h.len) > files[p.file].size))
+            { // end of the capture data or truncated last frame => next file
+                p.file++;
+                if (p.file < nfiles)
+                    p.off = files[p.file].start;
+                continue;
+            }
+            if (frameAt(p, strict))
+                return;
+            if (count)
+                files[p.file].skipped++;
+            p.off++;
+        }
+    }
+
+    static void lostMarker(OutBuf& out, const Color& color, uint64_t lost)
+    {
+        out.reserve(64);
+        out.put(color.ERR);
+        out.put('[');
+        out.dec(lost);
+        out.put(" bytes lost]");
+        out.put(color.DEFAULT);
+        out.put('\n');
+    }
+
+    // Decodes chunk k into its text.
+    void decodeChunk(size_t k)
+    {
+        static const size_t MAX_EVENTS = CaptureDecoder::MAX_EVENTS_PER_BYTE * CAPTURE_BLOCK_SIZE;
+        CaptureEvent* ev = new CaptureEvent[MAX_EVENTS];
+        CaptureBlock* unpacked = new CaptureBlock;
+        CaptureDecoder decoder;
+        RleFrameDecoder rle;
+        cookie_io_functions_t io = {nullptr, Text::write, nullptr, nullptr};
+        FILE* mem = fopencookie(&texts[k % window], "w", io);
+        setvbuf(mem, nullptr, _IONBF, 0); // OutBuf does the buffering
+        OutBuf out(mem);
+
+        Pos end = (k + 1 < nchunks) ? chunks[k + 1].start : Pos{nfiles, 0};
+        bool started = (k == 0); // past the first split point
+        bool tail = false;       // past end, looking for the split point where the next chunk begins
+        for (Pos p = chunks[k].start; p.file < nfiles; advance(p, !tail))
+        {
+            if (!tail && !(p < end))
+            {
+                if (!started)
+                    break; // no split point in the chunk => the previous chunk covers it all
+                tail = true;
+            }
+            CaptureFrameHeader h;
+            header(p, h);
+            const MappedFile& f = files[p.file];
+            const uint8_t* payload = f.data + p.off + sizeof(h);
+            uint16_t type = le16toh(h.type);
+            if (type == FRAME_RLE)
+                rle.start(h, payload, le32toh(h.len));
+            else if (type != FRAME_TOKENS)
+                continue;
+
+            uint64_t skipped = 0;
+            for (bool first = true;; first = false)
+            {
+                const uint8_t* data;
+                size_t len;
+                uint64_t lost;
+                if (type == FRAME_TOKENS)
+                {
+                    if (!first)
+                        break;
+                    data = payload;
+                    len = le32toh(h.len);
+                    lost = le32toh(h.lost);
+                }
+                else
+                {
+                    if (!rle.next(*unpacked, skipped))
+                        break;
+                    data = unpacked->data;
+                    len = unpacked->len;
+                    lost = unpacked->lost;
+                }
+
+                const uint8_t* zero = (lost != 0) ? nullptr : (const uint8_t*)memchr(data, 0, len);
+                if (!started)
+                {
+                    if (lost == 0)
+                    {
+                        if (zero == nullptr)
+                            continue;
+                        len -= zero + 1 - data;
+                        data = zero + 1;
+                    }
+                    started = true;
+                }
+                else if (tail)
+                {
+                    if (lost != 0)
+                        goto done;
+                    if (zero != nullptr)
+                    {
+                        size_t n = decoder.decode(data, zero + 1 - data, ev);
+                        text.format(ev, n, out);
+                        goto done;
+                    }
+                }
+                if (lost != 0)
+                {
+                    lostMarker(out, color, lost);
+                    decoder.reset();
+                }
+                size_t n = decoder.decode(data, len, ev);
+                text.format(ev, n, out);
+            }
+            if (!tail)
+                files[p.file].skipped += skipped;
+        }
+    done:
+        out.flush();
+        fclose(mem);
+        delete unpacked;
+        delete[] ev;
+        chunks[k].done.store(true, std::memory_order_release);
+        chunks[k].done.notify_one();
+    }
+
+    void work()
+    {
+        for (;;)
+        {
+            size_t k = next_chunk.fetch_add(1);
+            if (k >= nchunks)
+                return;
+            for (size_t w = written.load(); k >= w + window; w = written.load())
+                written.wait(w);
+            decodeChunk(k);
+        }
+    }
+
+  public:
+    ParallelDecoder(const CaptureText& text, const Color& color) : text(text), color(color) {}
+
+    ~ParallelDecoder()
+    {
+        for (int i = 0; i < nfiles; i++)
+            munmap((void*)files[i].data, files[i].size);
+        delete[] chunks;
+        if (texts != nullptr)
+            for (size_t i = 0; i < window; i++)
+                free(texts[i].buf);
+        delete[] texts;
+    }
+
+    // Maps the capture file path. Returns false with errno set if it can not be
+    // mapped, e.g. because it is a pipe, or with errno = 0 if it is not a capture
+    // file. In both cases the sequential reader will say what's wrong.
+    bool add(const char* path)
+    {
+        errno = 0;
+        if (nfiles == MAX_FILES)
+            return false;
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        void* data = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+            data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+            return false;
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        const char* err;
+        size_t start = captureFileStart(data, st.st_size, err);
+        if (start == 0)
+        {
+            munmap(data, st.st_size);
+            errno = 0;
+            return false;
+        }
+        MappedFile& f = files[nfiles++];
+        f.path = path;
+        f.data = (const uint8_t*)data;
+        f.size = st.st_size;
+        f.start = start;
+        return true;
+    }
+
+    // Decodes all files with nthreads threads and writes the text to out.
+    void decode(int nthreads, FILE* out)
+    {
+        size_t total = 0;
+        for (int i = 0; i < nfiles; i++)
+            total += files[i].size;
+        chunks = new Chunk[total / CHUNK_SIZE + nfiles + 1];
+        nchunks = 0;
+        for (int i = 0; i < nfiles; i++)
+            for (size_t off = files[i].start; off < files[i].size; off += CHUNK_SIZE)
+            {
+                Pos p = {i, off};
+                // at the start of a file like CaptureFileReader, elsewhere only at a frame that is surely one
+                bool first = (off == files[i].start);
+                sync(p, first, !first);
+                if (p.file >= nfiles || (nchunks > 0 && !(chunks[nchunks - 1].start < p)))
+                    continue;
+                chunks[nchunks++].start = p;
+            }
+        if (nchunks == 0)
+            return;
+        window = 4 * nthreads;
+        texts = new Text[window];
+
+        std::thread* workers = new std::thread[nthreads];
+        for (int i = 0; i < nthreads; i++)
+            workers[i] = std::thread(&ParallelDecoder::work, this);
+        for (size_t k = 0; k < nchunks; k++)
+        {
+            chunks[k].done.wait(false, std::memory_order_acquire);
+            Text& t = texts[k % window];
+            fwrite(t.buf, 1, t.len, out);
+            t.len = 0;
+            written.store(k + 1);
+            written.notify_all();
+        }
+        for (int i = 0; i < nthreads; i++)
+            workers[i].join();
+        delete[] workers;
+
+        for (int i = 0; i < nfiles; i++)
+            if (files[i].skipped != 0)
+                fprintf(stderr, "%s: %" PRIu64 " bytes of damaged data skipped\n", files[i].path,
+                        files[i].skipped.load());
+    }
+};
+
+#endif
@@ -0,0 +1,683 @@
+/*
+ * Copyright (C) 2022 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <crc_pec.h>
+
+#include "capture.h"
+#include "export.h"
+
+// A transaction from START to STOP as seen on the bus, consisting of messages
+// separated by repeated STARTs.
+struct Transaction
+{
+    static const int MAX_MSGS = 16;
+    static const uint32_t MAX_DATA = 4096;
+
+    I2CMessage msg[MAX_MSGS]; // data points into buf
+    int nmsgs;
+    bool stop;      // ended with a STOP rather than an idle bus or lost data
+    bool truncated; // messages or data did not fit
+    bool error;     // the capture stream had a partial byte or an undocumented token
+    uint32_t used;  // bytes of buf in use
+    uint8_t buf[MAX_DATA];
+
+    void clear()
+    {
+        nmsgs = 0;
+        stop = false;
+        truncated = false;
+        error = false;
+        used = 0;
+    }
+
+    void add(const I2CMessage& m)
+    {
+        if (nmsgs == MAX_MSGS || m.len > MAX_DATA - used)
+        {
+            truncated = true;
+            return;
+        }
+        I2CMessage& n = msg[nmsgs++];
+        n = m;
+        memcpy(buf + used, m.data, m.len);
+        n.data = buf + used;
+        used += m.len;
+        truncated |= (m.truncated != 0);
+    }
+
+    // SMBus Packet Error Code over all address and data bytes except the last
+    // data byte, which is where the PEC goes.
+    uint8_t pec() const
+    {
+        CRC_PEC crc;
+        for (int i = 0; i < nmsgs; i++)
+        {
+            crc.add((uint8_t)(msg[i].addr << 1 | msg[i].rd));
+            uint32_t len = msg[i].len;
+            if (i + 1 == nmsgs && len > 0)
+                len--;
+            for (uint32_t k = 0; k < len; k++)
+                crc.add(msg[i].data[k]);
+        }
+        return crc.sum();
+    }
+};
+
+// Helpers for the decoders' output.
+inline void putHex(OutBuf& out, unsigned x)
+{
+    char s[16];
+    snprintf(s, sizeof(s), "0x%02X", x);
+    out.put(s);
+}
+
+// Data as a single hex number if it is short, otherwise as a list of bytes.
+inline void putValue(OutBuf& out, const uint8_t* data, uint32_t len)
+{
+    if (len == 0)
+        out.put("nothing");
+    else if (len <= 8)
+    {
+        out.put("0x");
+        for (uint32_t i = 0; i < len; i++)
+            out.hex2(data[i]);
+    }
+    else
+        for (uint32_t i = 0; i < len; i++)
+        {
+            if (i > 0)
+                out.put(' ');
+            out.hex2(data[i]);
+        }
+}
+
+// The bytes of t like "S 0x50 W 00 10 Sr 0x50 R 41 42 P".
+inline void putRaw(OutBuf& out, const Transaction& t)
+{
+    for (int i = 0; i < t.nmsgs; i++)
+    {
+        const I2CMessage& m = t.msg[i];
+        out.put(i == 0 ? "S " : " Sr ");
+        putHex(out, m.addr);
+        out.put(m.rd ? " R" : " W");
+        if (m.addr_nak)
+            out.put(" NAK");
+        for (uint32_t k = 0; k < m.len; k++)
+        {
+            out.put(' ');
+            out.hex2(m.data[k]);
+        }
+        if (m.last_nak && !m.rd)
+            out.put('\'');
+    }
+    out.put(t.stop ? " P" : " (no STOP)");
+    if (t.truncated)
+        out.put(" (truncated)");
+    if (t.error)
+        out.put(" (capture error)");
+}
+
+// Interprets complete transactions of a device. Decoders are called for every
+// transaction with an address they have been assigned to, so they must not
+// allocate memory.
+class ProtocolDecoder
+{
+  public:
+    virtual ~ProtocolDecoder() {}
+
+    // Appends a description of t to out (without newline) and returns true, or
+    // returns false without touching out if t does not fit the protocol. t has
+    // at least 1 message, the first address was ACKed and there was no error.
+    virtual bool decode(const Transaction& t, OutBuf& out) = 0;
+};
+
+// Devices with a register pointer of 1 or 2 bytes (big endian) that is written
+// at the start of a write message, e.g. temperature sensors, RTCs and EEPROMs.
+// A read without pointer uses the pointer set by the previous transaction.
+class RegisterDecoder : public ProtocolDecoder
+{
+    int ptr_bytes;
+    int32_t ptr[128]; // last pointer set per address, -1 if unknown
+
+    void putReg(OutBuf& out, uint8_t addr, int32_t reg)
+    {
+        out.put("reg ");
+        if (reg < 0)
+            out.put('?');
+        else
+        {
+            out.put("0x");
+            if (ptr_bytes == 2)
+                out.hex2(reg >> 8);
+            out.hex2(reg);
+        }
+        out.put(" of ");
+        putHex(out, addr);
+    }
+
+  public:
+    RegisterDecoder(int pointer_bytes) : ptr_bytes(pointer_bytes)
+    {
+        for (int i = 0; i < 128; i++)
+            ptr[i] = -1;
+    }
+
+    bool decode(const Transaction& t, OutBuf& out) override
+    {
+        const I2CMessage& m = t.msg[0];
+        if (t.nmsgs == 1 && m.rd)
+        {
+            putReg(out, m.addr, ptr[m.addr]);
+            out.put(" read = ");
+            putValue(out, m.data, m.len);
+            return true;
+        }
+        if (m.rd || m.len < (uint32_t)ptr_bytes)
+            return false;
+
+        int32_t reg = (ptr_bytes == 2) ? (m.data[0] << 8 | m.data[1]) : m.data[0];
+        if (t.nmsgs == 1)
+        {
+            ptr[m.addr] = reg;
+            putReg(out, m.addr, reg);
+            if (m.len == (uint32_t)ptr_bytes)
+            {
+                out.put(" selected");
+                return true;
+            }
+            out.put(" write = ");
+            putValue(out, m.data + ptr_bytes, m.len - ptr_bytes);
+            if (m.last_nak)
+                out.put(" NAK");
+            return true;
+        }
+        const I2CMessage& r = t.msg[1];
+        if (t.nmsgs != 2 || m.len != (uint32_t)ptr_bytes || !r.rd || r.addr != m.addr || r.addr_nak)
+            return false;
+        ptr[m.addr] = reg;
+        putReg(out, m.addr, reg);
+        out.put(" read = ");
+        putValue(out, r.data, r.len);
+        return true;
+    }
+};
+
+// SMBus protocols: quick command, send/receive byte, write/read byte and word,
+// block write/read and process call. With pec, the last byte of each
+// transaction (except quick commands) is the Packet Error Code and is checked.
+class SmbusDecoder : public ProtocolDecoder
+{
+    bool pec;
+
+  protected:
+    // Name of a command code for the output, nullptr if it has none.
+    virtual const char* commandName(uint8_t addr, uint8_t cmd) { return nullptr; }
+
+    // Appends the value of a word read or written with command cmd.
+    virtual void putWord(OutBuf& out, uint8_t addr, uint8_t cmd, uint16_t w, bool write)
+    {
+        out.put("0x");
+        out.hex2(w >> 8);
+        out.hex2(w);
+    }
+
+    // Appends the data of a block read or written with command cmd.
+    virtual void putBlock(OutBuf& out, uint8_t addr, uint8_t cmd, const uint8_t* data, uint32_t len)
+    {
+        putValue(out, data, len);
+    }
+
+    // Called for byte values, so that a subclass can track device state.
+    virtual void putByte(OutBuf& out, uint8_t addr, uint8_t cmd, uint8_t b, bool write) { putHex(out, b); }
+
+  private:
+    void putCommand(OutBuf& out, uint8_t addr, uint8_t cmd)
+    {
+        const char* name = commandName(addr, cmd);
+        if (name != nullptr)
+            out.put(name);
+        else
+        {
+            out.put("cmd ");
+            putHex(out, cmd);
+        }
+        out.put(" of ");
+        putHex(out, addr);
+    }
+
+    void putPec(OutBuf& out, const Transaction& t)
+    {
+        if (!pec)
+            return;
+        const I2CMessage& last = t.msg[t.nmsgs - 1];
+        uint8_t expected = t.pec();
+        if (last.data[last.len - 1] == expected)
+            out.put(" PEC ok");
+        else
+        {
+            out.put(" PEC BAD, expected ");
+            putHex(out, expected);
+        }
+    }
+
+  public:
+    SmbusDecoder(bool with_pec) : pec(with_pec) {}
+
+    bool decode(const Transaction& t, OutBuf& out) override
+    {
+        const I2CMessage& w = t.msg[0];
+        uint8_t addr = w.addr;
+        if (t.nmsgs == 1 && w.len == 0)
+        {
+            out.put(w.rd ? "quick read of " : "quick write of ");
+            putHex(out, addr);
+            return true;
+        }
+
+        const I2CMessage& last = t.msg[t.nmsgs - 1];
+        if (pec && last.len == 0)
+            return false;
+        uint32_t last_len = last.len - pec; // without PEC
+
+        if (t.nmsgs == 1 && w.rd)
+        {
+            if (last_len != 1)
+                return false;
+            out.put("receive byte from ");
+            putHex(out, addr);
+            out.put(" = ");
+            putHex(out, w.data[0]);
+            putPec(out, t);
+            return true;
+        }
+
+        if (w.rd || w.len == 0) // every other command starts by writing its code
+            return false;
+        uint8_t cmd = w.data[0];
+        if (t.nmsgs == 1)
+        {
+            uint32_t n = last_len - 1; // bytes after the command code
+            if (n == 0)
+            {
+                out.put("send byte ");
+                putCommand(out, addr, cmd);
+            }
+            else if (n == 1)
+            {
+                putCommand(out, addr, cmd);
+                out.put(" write byte = ");
+                putByte(out, addr, cmd, w.data[1], true);
+            }
+            else if (n == 2)
+            {
+                putCommand(out, addr, cmd);
+                out.put(" write word = ");
+                putWord(out, addr, cmd, w.data[1] | w.data[2] << 8, true);
+            }
+            else if (w.data[1] == n - 1)
+            {
+                putCommand(out, addr, cmd);
+                out.put(" block write = ");
+                putBlock(out, addr, cmd, w.data + 2, n - 1);
+            }
+            else
+                return false;
+            if (w.last_nak)
+                out.put(" NAK");
+            putPec(out, t);
+            return true;
+        }
+
+        const I2CMessage& r = t.msg[1];
+        if (t.nmsgs != 2 || !r.rd || r.addr != addr || r.addr_nak)
+            return false;
+        uint32_t n = last_len;
+        if (w.len == 1 && n == 1)
+        {
+            putCommand(out, addr, cmd);
+            out.put(" read byte = ");
+            putByte(out, addr, cmd, r.data[0], false);
+        }
+        else if (w.len == 1 && n == 2)
+        {
+            putCommand(out, addr, cmd);
+            out.put(" read word = ");
+            putWord(out, addr, cmd, r.data[0] | r.data[1] << 8, false);
+        }
+        else if (w.len == 1 && n >= 1 && r.data[0] == n - 1)
+        {
+            putCommand(out, addr, cmd);
+            out.put(" block read = ");
+            putBlock(out, addr, cmd, r.data + 1, n - 1);
+        }
+        else if (w.len == 3 && n == 2)
+        {
+            putCommand(out, addr, cmd);
+            out.put(" process call ");
+            putWord(out, addr, cmd, w.data[1] | w.data[2] << 8, true);
+            out.put(" -> ");
+            putWord(out, addr, cmd, r.data[0] | r.data[1] << 8, false);
+        }
+        else
+            return false;
+        putPec(out, t);
+        return true;
+    }
+};
+
+// PMBus on top of SMBus: command names, LINEAR11 and LINEAR16 values and
+// ASCII manufacturer strings. The VOUT_MODE exponent needed for LINEAR16 is
+// taken from VOUT_MODE transactions seen on the bus.
+class PmbusDecoder : public SmbusDecoder
+{
+    enum Format : uint8_t
+    {
+        RAW,
+        LINEAR11,
+        LINEAR16, // exponent from VOUT_MODE
+        ASCII,
+        VOUT_MODE,
+    };
+
+    struct Command
+    {
+        uint8_t code;
+        const char* name;
+        Format format;
+    };
+
+    static const Command* commands()
+    {
+        static const Command cmds[] = {
+            {0x00, "PAGE", RAW},
+            {0x01, "OPERATION", RAW},
+            {0x02, "ON_OFF_CONFIG", RAW},
+            {0x03, "CLEAR_FAULTS", RAW},
+            {0x04, "PHASE", RAW},
+            {0x05, "PAGE_PLUS_WRITE", RAW},
+            {0x06, "PAGE_PLUS_READ", RAW},
+            {0x10, "WRITE_PROTECT", RAW},
+            {0x11, "STORE_DEFAULT_ALL", RAW},
+            {0x12, "RESTORE_DEFAULT_ALL", RAW},
+            {0x15, "STORE_USER_ALL", RAW},
+            {0x16, "RESTORE_USER_ALL", RAW},
+            {0x19, "CAPABILITY", RAW},
+            {0x1A, "QUERY", RAW},
+            {0x1B, "SMBALERT_MASK", RAW},
+            {0x20, "VOUT_MODE", VOUT_MODE},
+            {0x21, "VOUT_COMMAND", LINEAR16},
+            {0x22, "VOUT_TRIM", LINEAR16},
+            {0x23, "VOUT_CAL_OFFSET", LINEAR16},
+            {0x24, "VOUT_MAX", LINEAR16},
+            {0x25, "VOUT_MARGIN_HIGH", LINEAR16},
+            {0x26, "VOUT_MARGIN_LOW", LINEAR16},
+            {0x27, "VOUT_TRANSITION_RATE", LINEAR11},
+            {0x28, "VOUT_DROOP", LINEAR11},
+            {0x29, "VOUT_SCALE_LOOP", LINEAR11},
+            {0x2A, "VOUT_SCALE_MONITOR", LINEAR11},
+            {0x2B, "VOUT_MIN", LINEAR16},
+            {0x33, "FREQUENCY_SWITCH", LINEAR11},
+            {0x35, "VIN_ON", LINEAR11},
+            {0x36, "VIN_OFF", LINEAR11},
+            {0x38, "IOUT_CAL_GAIN", LINEAR11},
+            {0x39, "IOUT_CAL_OFFSET", LINEAR11},
+            {0x3A, "FAN_CONFIG_1_2", RAW},
+            {0x3B, "FAN_COMMAND_1", LINEAR11},
+            {0x3C, "FAN_COMMAND_2", LINEAR11},
+            {0x40, "VOUT_OV_FAULT_LIMIT", LINEAR16},
+            {0x41, "VOUT_OV_FAULT_RESPONSE", RAW},
+            {0x42, "VOUT_OV_WARN_LIMIT", LINEAR16},
+            {0x43, "VOUT_UV_WARN_LIMIT", LINEAR16},
+            {0x44, "VOUT_UV_FAULT_LIMIT", LINEAR16},
+            {0x45, "VOUT_UV_FAULT_RESPONSE", RAW},
+            {0x46, "IOUT_OC_FAULT_LIMIT", LINEAR11},
+            {0x47, "IOUT_OC_FAULT_RESPONSE", RAW},
+            {0x4A, "IOUT_OC_WARN_LIMIT", LINEAR11},
+            {0x4F, "OT_FAULT_LIMIT", LINEAR11},
+            {0x50, "OT_FAULT_RESPONSE", RAW},
+            {0x51, "OT_WARN_LIMIT", LINEAR11},
+            {0x55, "VIN_OV_FAULT_LIMIT", LINEAR11},
+            {0x56, "VIN_OV_FAULT_RESPONSE", RAW},
+            {0x57, "VIN_OV_WARN_LIMIT", LINEAR11},
+            {0x58, "VIN_UV_WARN_LIMIT", LINEAR11},
+            {0x59, "VIN_UV_FAULT_LIMIT", LINEAR11},
+            {0x5A, "VIN_UV_FAULT_RESPONSE", RAW},
+            {0x5D, "IIN_OC_WARN_LIMIT", LINEAR11},
+            {0x60, "TON_DELAY", LINEAR11},
+            {0x61, "TON_RISE", LINEAR11},
+            {0x64, "TOFF_DELAY", LINEAR11},
+            {0x65, "TOFF_FALL", LINEAR11},
+            {0x6A, "POUT_OP_WARN_LIMIT", LINEAR11},
+            {0x6B, "PIN_OP_WARN_LIMIT", LINEAR11},
+            {0x78, "STATUS_BYTE", RAW},
+            {0x79, "STATUS_WORD", RAW},
+            {0x7A, "STATUS_VOUT", RAW},
+            {0x7B, "STATUS_IOUT", RAW},
+            {0x7C, "STATUS_INPUT", RAW},
+            {0x7D, "STATUS_TEMPERATURE", RAW},
+            {0x7E, "STATUS_CML", RAW},
+            {0x7F, "STATUS_OTHER", RAW},
+            {0x80, "STATUS_MFR_SPECIFIC", RAW},
+            {0x81, "STATUS_FANS_1_2", RAW},
+            {0x86, "READ_EIN", RAW},
+            {0x87, "READ_EOUT", RAW},
+            {0x88, "READ_VIN", LINEAR11},
+            {0x89, "READ_IIN", LINEAR11},
+            {0x8A, "READ_VCAP", LINEAR11},
+            {0x8B, "READ_VOUT", LINEAR16},
+            {0x8C, "READ_IOUT", LINEAR11},
+            {0x8D, "READ_TEMPERATURE_1", LINEAR11},
+            {0x8E, "READ_TEMPERATURE_2", LINEAR11},
+            {0x8F, "READ_TEMPERATURE_3", LINEAR11},
+            {0x90, "READ_FAN_SPEED_1", LINEAR11},
+            {0x91, "READ_FAN_SPEED_2", LINEAR11},
+            {0x94, "READ_DUTY_CYCLE", LINEAR11},
+            {0x95, "READ_FREQUENCY", LINEAR11},
+            {0x96, "READ_POUT", LINEAR11},
+            {0x97, "READ_PIN", LINEAR11},
+            {0x98, "PMBUS_REVISION", RAW},
+            {0x99, "MFR_ID", ASCII},
+            {0x9A, "MFR_MODEL", ASCII},
+            {0x9B, "MFR_REVISION", ASCII},
+            {0x9C, "MFR_LOCATION", ASCII},
+            {0x9D, "MFR_DATE", ASCII},
+            {0x9E, "MFR_SERIAL", ASCII},
+            {0, nullptr, RAW},
+        };
+        return cmds;
+    }
+
+    const char* name[256] = {};
+    Format format[256] = {};
+    int8_t vout_exp[128]; // LINEAR16 exponent per address, 127 if unknown
+
+    void putNumber(OutBuf& out, double v)
+    {
+        char s[32];
+        snprintf(s, sizeof(s), " (%g)", v);
+        out.put(s);
+    }
+
+  protected:
+    const char* commandName(uint8_t addr, uint8_t cmd) override { return name[cmd]; }
+
+    void putWord(OutBuf& out, uint8_t addr, uint8_t cmd, uint16_t w, bool write) override
+    {
+        SmbusDecoder::putWord(out, addr, cmd, w, write);
+        if (format[cmd] == LINEAR11)
+        {
+            int exp = (int16_t)w >> 11;        // 5 bit signed
+            int mantissa = (int16_t)(w << 5) >> 5; // 11 bit signed
+            putNumber(out, ldexp(mantissa, exp));
+        }
+        else if (format[cmd] == LINEAR16 && vout_exp[addr] != 127)
+            putNumber(out, ldexp(w, vout_exp[addr]));
+    }
+
+    void putByte(OutBuf& out, uint8_t addr, uint8_t cmd, uint8_t b, bool write) override
+    {
+        SmbusDecoder::putByte(out, addr, cmd, b, write);
+        if (format[cmd] == VOUT_MODE && (b >> 5) == 0) // linear mode
+            vout_exp[addr] = (int8_t)(b << 3) >> 3;
+    }
+
+    void putBlock(OutBuf& out, uint8_t addr, uint8_t cmd, const uint8_t* data, uint32_t len) override
+    {
+        if (format[cmd] != ASCII)
+        {
+            SmbusDecoder::putBlock(out, addr, cmd, data, len);
+            return;
+        }
+        out.put('"');
+        for (uint32_t i = 0; i < len; i++)
+            out.put((data[i] >= 0x20 && data[i] < 0x7f && data[i] != '"') ? data[i] : '.');
+        out.put('"');
+    }
+
+  public:
+    PmbusDecoder(bool with_pec) : SmbusDecoder(with_pec)
+    {
+        for (const Command* c = commands(); c->name != nullptr; c++)
+        {
+            name[c->code] = c->name;
+            format[c->code] = c->format;
+        }
+        for (int i = 0; i < 128; i++)
+            vout_exp[i] = 127;
+    }
+};
+
+// Reassembles the messages from a MessageAssembler into transactions and
+// writes one line per transaction to out: the interpretation of the decoder
+// assigned to its address with --protocol or, if there is none or it does not
+// understand the transaction, the raw messages. Transactions performed by
+// i2cdriver itself are skipped, because they are printed anyway.
+class ProtocolSink : public MessageSink
+{
+    ProtocolDecoder* decoder[128] = {};
+    Transaction t;
+    bool open = false; // t has messages
+    uint64_t txn;      // of t
+    OutBuf out;
+
+    void finish()
+    {
+        if (!open)
+            return;
+        open = false;
+        out.reserve(256 + 3 * t.used + 16 * t.nmsgs);
+        const I2CMessage& m = t.msg[0];
+        ProtocolDecoder* d = decoder[m.addr];
+        if (d == nullptr || m.addr_nak || t.error || t.truncated || !t.stop || !d->decode(t, out))
+            putRaw(out, t);
+        out.put('\n');
+    }
+
+  public:
+    ProtocolSink(FILE* f) : out(f) { t.clear(); }
+
+    // Adds a --protocol argument <name>[@<addr>] where <name> is one of reg,
+    // reg16, smbus, pmbus, smbus+pec or pmbus+pec. Without address it applies to
+    // all addresses that have no decoder yet. Returns false if spec is invalid.
+    bool add(const char* spec)
+    {
+        const char* at = strchr(spec, '@');
+        size_t len = at ? (size_t)(at - spec) : strlen(spec);
+        int addr = -1;
+        if (at != nullptr)
+        {
+            char* end;
+            addr = strtol(at + 1, &end, 0);
+            if (at[1] == 0 || *end != 0 || addr < 0 || addr > 127)
+                return false;
+        }
+        ProtocolDecoder* d;
+        if (len == 3 && strncmp(spec, "reg", len) == 0)
+            d = new RegisterDecoder(1);
+        else if (len == 5 && strncmp(spec, "reg16", len) == 0)
+            d = new RegisterDecoder(2);
+        else if (len == 5 && strncmp(spec, "smbus", len) == 0)
+            d = new SmbusDecoder(false);
+        else if (len == 9 && strncmp(spec, "smbus+pec", len) == 0)
+            d = new SmbusDecoder(true);
+        else if (len == 5 && strncmp(spec, "pmbus", len) == 0)
+            d = new PmbusDecoder(false);
+        else if (len == 9 && strncmp(spec, "pmbus+pec", len) == 0)
+            d = new PmbusDecoder(true);
+        else
+            return false;
+        if (addr >= 0)
+            decoder[addr] = d;
+        else
+            for (int a = 0; a < 128; a++)
+                if (decoder[a] == nullptr)
+                    decoder[a] = d;
+        return true;
+    }
+
+    void message(const I2CMessage& msg) override
+    {
+        if (msg.host)
+            return;
+        if (open && msg.txn != txn)
+            finish();
+        if (!open)
+        {
+            t.clear();
+            open = true;
+            txn = msg.txn;
+        }
+        t.add(msg);
+        if (msg.stop)
+        {
+            t.stop = true;
+            finish();
+        }
+    }
+
+    void anomaly(uint64_t ts_ns, CaptureEvent ev) override
+    {
+        if (open)
+            t.error = true;
+    }
+
+    void lost(uint64_t ts_ns, uint64_t bytes) override
+    {
+        finish();
+        out.reserve(64);
+        out.put("[");
+        out.dec(bytes);
+        out.put(" bytes lost]\n");
+    }
+
+    void flush() override { out.flush(); }
+};
+
+#endif
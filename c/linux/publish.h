@@ -0,0 +1,344 @@
+/*
+ * Copyright (C) 2022 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PUBLISH_H
+#define PUBLISH_H
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "export.h"
+#include "file.h"
+
+// Serves the output of an exporter, e.g. the --jsonl lines of a live capture
+// (--publish), to local subscribers that connect to a Unix socket (or a TCP
+// port, see File::listen()). Every subscriber has its own buffer. If it does
+// not keep up, its oldest lines are dropped to make room, so that a slow
+// subscriber can not hold up the capture or the others. Before the next line
+// it gets, it is told how many were dropped with a line like
+// {"ts":1666077300.000000000,"src":"publish","error":"dropped","lines":42}
+// A thread of its own accepts the connections and writes to the sockets, the
+// capture thread only copies into the buffers.
+class CapturePublisher
+{
+  public:
+    static const int MAX_SUBSCRIBERS = 16;
+    static const size_t BUFFER_SIZE = 1 << 22;
+    static const size_t SEND_SIZE = 1 << 20; // longer than the longest line
+
+  private:
+    struct Subscriber
+    {
+        std::atomic<bool> active{false};
+        std::mutex mutex; // protects buf, head, len, dropped
+        int fd = -1;
+        char* buf = nullptr; // ring of BUFFER_SIZE bytes, whole lines from head on
+        size_t head = 0;
+        size_t len = 0;
+        uint64_t dropped = 0; // lines not yet reported to the subscriber
+
+        // writer thread only
+        char* out = nullptr; // being sent
+        size_t out_len = 0;
+        size_t out_off = 0;
+        uint64_t lines = 0;         // sent
+        uint64_t total_dropped = 0; // reported
+        bool eof = false;           // the subscriber has shut down its side for writing
+    };
+
+    const char* path;
+    File sock;
+    int wake = -1; // eventfd to wake the writer thread
+    std::thread writer;
+    std::atomic<bool> stop{false};
+    Subscriber subs[MAX_SUBSCRIBERS];
+    FILE* file = nullptr;
+
+    static ssize_t cookieWrite(void* cookie, const char* data, size_t n)
+    {
+        ((CapturePublisher*)cookie)->publish(data, n);
+        return n;
+    }
+
+    // Drops the oldest line of s. Called with s.mutex held.
+    static void dropLine(Subscriber& s)
+    {
+        size_t first = BUFFER_SIZE - s.head < s.len ? BUFFER_SIZE - s.head : s.len;
+        const char* nl = (const char*)memchr(s.buf + s.head, '\n', first);
+        size_t n;
+        if (nl != nullptr)
+            n = nl - (s.buf + s.head) + 1;
+        else
+        {
+            nl = (const char*)memchr(s.buf, '\n', s.len - first);
+            n = nl != nullptr ? first + (nl - s.buf) + 1 : s.len;
+        }
+        s.head = (s.head + n) % BUFFER_SIZE;
+        s.len -= n;
+        s.dropped++;
+    }
+
+    // Moves the complete lines from s's buffer to its out buffer, preceded by the
+    // report of dropped lines if there are any.
+    void refill(Subscriber& s)
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.out_off = 0;
+        s.out_len = 0;
+        if (s.dropped != 0)
+        {
+            uint64_t now = realtimeNs();
+            s.out_len = snprintf(s.out, 128,
+                                 "{\"ts\":%" PRIu64 ".%09u,\"src\":\"publish\",\"error\":\"dropped\",\"lines\":%" PRIu64
+                                 "}\n",
+                                 now / 1000000000, (unsigned)(now % 1000000000), s.dropped);
+            s.total_dropped += s.dropped;
+            s.dropped = 0;
+        }
+        size_t n = s.len < SEND_SIZE ? s.len : SEND_SIZE;
+        size_t first = BUFFER_SIZE - s.head < n ? BUFFER_SIZE - s.head : n;
+        memcpy(s.out + s.out_len, s.buf + s.head, first);
+        memcpy(s.out + s.out_len + first, s.buf, n - first);
+        // only whole lines, so that a drop can't cut one in half
+        const char* nl = (const char*)memrchr(s.out + s.out_len, '\n', n);
+        n = nl == nullptr ? 0 : nl + 1 - (s.out + s.out_len);
+        s.head = (s.head + n) % BUFFER_SIZE;
+        s.len -= n;
+        s.out_len += n;
+    }
+
+    // Sends as much of s's data as the socket takes. Returns false if the
+    // subscriber is gone.
+    bool send(Subscriber& s)
+    {
+        for (;;)
+        {
+            if (s.out_off == s.out_len)
+            {
+                refill(s);
+                if (s.out_len == 0)
+                    return true;
+            }
+            ssize_t n = ::send(s.fd, s.out + s.out_off, s.out_len - s.out_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0)
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            for (ssize_t i = 0; i < n; i++)
+                s.lines += (s.out[s.out_off + i] == '\n');
+            s.out_off += n;
+        }
+    }
+
+    void report(Subscriber& s)
+    {
+        if (s.total_dropped != 0)
+            fprintf(stderr, "%s: subscriber too slow: %" PRIu64 " lines dropped, %" PRIu64 " sent\n", path,
+                    s.total_dropped, s.lines);
+    }
+
+    void remove(Subscriber& s)
+    {
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.active = false;
+        }
+        report(s);
+        ::close(s.fd);
+    }
+
+    void accept()
+    {
+        int fd = sock.accept();
+        if (fd < 0)
+        {
+            sock.clearError();
+            return;
+        }
+        for (Subscriber& s : subs)
+            if (!s.active)
+            {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                std::lock_guard<std::mutex> lock(s.mutex);
+                if (s.buf == nullptr)
+                {
+                    s.buf = new char[BUFFER_SIZE];
+                    s.out = new char[SEND_SIZE + 128];
+                }
+                s.fd = fd;
+                s.head = s.len = 0;
+                s.dropped = s.total_dropped = s.lines = 0;
+                s.out_len = s.out_off = 0;
+                s.eof = false;
+                s.active = true;
+                return;
+            }
+        fprintf(stderr, "%s: more than %d subscribers\n", path, MAX_SUBSCRIBERS);
+        ::close(fd);
+    }
+
+    // Body of the writer thread.
+    void run()
+    {
+        pollfd fds[2 + MAX_SUBSCRIBERS];
+        int index[MAX_SUBSCRIBERS];
+        while (!stop)
+        {
+            fds[0] = {sock.fileDescriptor(), POLLIN, 0};
+            fds[1] = {wake, POLLIN, 0};
+            int n = 2;
+            for (int i = 0; i < MAX_SUBSCRIBERS; i++)
+                if (subs[i].active)
+                {
+                    Subscriber& s = subs[i];
+                    bool pending = s.out_off < s.out_len || s.len != 0;
+                    index[n - 2] = i;
+                    fds[n++] = {s.fd, (short)((s.eof ? 0 : POLLIN) | (pending ? POLLOUT : 0)), 0};
+                }
+            if (::poll(fds, n, 1000) < 0 && errno != EINTR)
+                break;
+            if (fds[0].revents & POLLIN)
+                accept();
+            uint64_t count;
+            if ((fds[1].revents & POLLIN) && read(wake, &count, sizeof(count)) < 0)
+                break;
+            for (int k = 2; k < n; k++)
+            {
+                Subscriber& s = subs[index[k - 2]];
+                char discard[256];
+                if (fds[k].revents & POLLIN) // subscribers have nothing to say
+                    s.eof = ::recv(s.fd, discard, sizeof(discard), MSG_DONTWAIT) == 0;
+                if ((fds[k].revents & (POLLERR | POLLHUP)) != 0 || !send(s))
+                    remove(s);
+            }
+        }
+        // Give the subscribers up to a second to take what is still buffered.
+        for (int tries = 0; tries < 10; tries++)
+        {
+            int n = 0;
+            for (Subscriber& s : subs)
+                if (s.active && send(s) && (s.out_off < s.out_len || s.len != 0))
+                    fds[n++] = {s.fd, POLLOUT, 0};
+            if (n == 0 || ::poll(fds, n, 100) < 0)
+                break;
+        }
+        for (Subscriber& s : subs)
+            if (s.active)
+                remove(s);
+    }
+
+  public:
+    CapturePublisher(const char* path) : path(path), sock(path) { sock.action("listening on"); }
+
+    ~CapturePublisher()
+    {
+        for (Subscriber& s : subs)
+        {
+            delete[] s.buf;
+            delete[] s.out;
+        }
+    }
+
+    // Starts listening on path. A socket left over from a previous run is
+    // replaced. Returns false and prints an error message on failure.
+    bool start()
+    {
+        struct stat st;
+        if (strchr(path, ':') == nullptr && ::stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(path);
+        if (!sock.listen() || !sock.setNonBlock(true))
+        {
+            fprintf(stderr, "%s\n", sock.error());
+            return false;
+        }
+        wake = eventfd(0, EFD_NONBLOCK);
+        writer = std::thread(&CapturePublisher::run, this);
+        return true;
+    }
+
+    // Copies the n bytes at data, which must be complete lines, to the buffers
+    // of all subscribers.
+    void publish(const char* data, size_t n)
+    {
+        bool any = false;
+        for (Subscriber& s : subs)
+        {
+            if (!s.active)
+                continue;
+            std::lock_guard<std::mutex> lock(s.mutex);
+            if (!s.active || n > BUFFER_SIZE)
+                continue;
+            while (s.len + n > BUFFER_SIZE)
+                dropLine(s);
+            size_t tail = (s.head + s.len) % BUFFER_SIZE;
+            size_t first = BUFFER_SIZE - tail < n ? BUFFER_SIZE - tail : n;
+            memcpy(s.buf + tail, data, first);
+            memcpy(s.buf, data + first, n - first);
+            s.len += n;
+            any = true;
+        }
+        uint64_t one = 1;
+        if (any && write(wake, &one, sizeof(one)) < 0)
+            return; // the counter is full, so the thread will wake anyway
+    }
+
+    // Returns a stream that publish()es what is written to it, e.g. for a
+    // JsonlWriter. Writes must consist of complete lines, which OutBuf ensures.
+    FILE* stream()
+    {
+        if (file == nullptr)
+        {
+            cookie_io_functions_t io = {nullptr, cookieWrite, nullptr, nullptr};
+            file = fopencookie(this, "w", io);
+            setvbuf(file, nullptr, _IONBF, 0); // OutBuf does the buffering
+        }
+        return file;
+    }
+
+    // Sends what is still buffered, disconnects the subscribers and stops
+    // listening.
+    void close()
+    {
+        if (!writer.joinable())
+            return;
+        stop = true;
+        uint64_t one = 1;
+        if (write(wake, &one, sizeof(one)) < 0)
+            perror("eventfd");
+        writer.join();
+        ::close(wake);
+        sock.close();
+        if (strchr(path, ':') == nullptr)
+            unlink(path);
+    }
+};
+
+#endif
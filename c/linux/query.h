@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2022 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "capture_file.h"
+#include "export.h"
+#include "protocol.h"
+#include "trigger.h"
+
+// Returns the offset of the first occurrence of needle[0..m) in hay[0..n) or
+// -1. Compares the first and last byte of needle with 16 positions at a time,
+// so that only candidates that match both get compared in full.
+inline long findBytes(const uint8_t* hay, size_t n, const uint8_t* needle, size_t m)
+{
+    if (m == 0)
+        return 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    for (; i + m - 1 + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(hay + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        for (; mask != 0; mask &= mask - 1)
+        {
+            size_t k = i + __builtin_ctz(mask);
+            if (memcmp(hay + k, needle, m) == 0)
+                return k;
+        }
+    }
+#endif
+    for (; i + m <= n; i++)
+        if (hay[i] == needle[0] && memcmp(hay + i, needle, m) == 0)
+            return i;
+    return -1;
+}
+
+// Prints the transactions of a recorded capture that have a message matching a
+// --query expression (same syntax as --trigger) as a line with the time and the
+// raw messages, e.g. "2022-10-18 14:02:13.123456 S 0x50 W NAK P". mayMatch()
+// tells from the index entry of a frame if it is worth decoding.
+class QuerySink : public MessageSink
+{
+  public:
+    static const int MAX_CONDITIONS = 16;
+
+  private:
+    TriggerCondition cond[MAX_CONDITIONS];
+    int nconds = 0;
+    bool any_error = false; // some condition is "error"
+    Transaction t;
+    bool open = false;     // t has messages
+    uint64_t txn;          // of t
+    uint64_t ts_ns;        // of t's first message
+    bool matched;          // a message of t matches
+    uint64_t matches = 0;
+    OutBuf out;
+
+    static bool match(const TriggerCondition& c, const I2CMessage& m)
+    {
+        bool nak = m.addr_nak || (!m.rd && m.last_nak);
+        if (c.error || (c.addr >= 0 && c.addr != m.addr) || (c.rd >= 0 && c.rd != m.rd) || (c.nak && !nak) ||
+            (c.nodata && (m.len != 0 || !m.stop)) || m.len < (uint32_t)c.pattern_len)
+            return false;
+        for (int i = 0; i < c.pattern_len; i++)
+            if (((m.data[i] ^ c.pattern[i]) & c.mask[i]) != 0)
+                return false;
+        return c.contains_len == 0 || findBytes(m.data, m.len, c.contains, c.contains_len) >= 0;
+    }
+
+    void putTime(uint64_t ns)
+    {
+        char when[32];
+        time_t secs = ns / 1000000000;
+        struct tm tm;
+        size_t len = strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S.", localtime_r(&secs, &tm));
+        snprintf(when + len, sizeof(when) - len, "%06u ", (unsigned)(ns % 1000000000 / 1000));
+        out.put(when);
+    }
+
+    void finish()
+    {
+        if (!open)
+            return;
+        open = false;
+        if (!matched && !(any_error && t.error))
+            return;
+        matches++;
+        out.reserve(256 + 3 * t.used + 16 * t.nmsgs);
+        putTime(ts_ns);
+        putRaw(out, t);
+        out.put('\n');
+    }
+
+  public:
+    QuerySink(FILE* f) : out(f) { t.clear(); }
+
+    // Adds a --query expression. Returns false if it is invalid.
+    bool add(const char* expr)
+    {
+        if (nconds == MAX_CONDITIONS)
+            return false;
+        TriggerCondition c;
+        if (!c.parse(expr))
+            return false;
+        any_error |= c.error;
+        cond[nconds++] = c;
+        return true;
+    }
+
+    // Returns false if the frame of e can not contain the start of a matching message.
+    bool mayMatch(const CaptureIndexEntry& e) const
+    {
+        for (int i = 0; i < nconds; i++)
+        {
+            const TriggerCondition& c = cond[i];
+            if (c.error)
+                return true;
+            const uint64_t* bits = c.nak ? e.naks : e.addrs;
+            if (c.addr >= 0 ? CaptureIndexEntry::has(bits, c.addr) : (bits[0] | bits[1]) != 0)
+                return true;
+        }
+        return false;
+    }
+
+    // Number of matching transactions.
+    uint64_t count() const { return matches; }
+
+    // Ends the transaction being assembled, because the following data is not
+    // what followed it on the bus.
+    void skip() { finish(); }
+
+    void message(const I2CMessage& msg) override
+    {
+        if (msg.host)
+            return;
+        if (open && msg.txn != txn)
+            finish();
+        if (!open)
+        {
+            t.clear();
+            open = true;
+            txn = msg.txn;
+            ts_ns = msg.ts_ns;
+            matched = false;
+        }
+        t.add(msg);
+        for (int i = 0; i < nconds && !matched; i++)
+            matched = match(cond[i], msg);
+        if (msg.stop)
+        {
+            t.stop = true;
+            finish();
+        }
+    }
+
+    void anomaly(uint64_t ts_ns, CaptureEvent ev) override
+    {
+        if (open)
+            t.error = true;
+        else if (any_error)
+        {
+            matches++;
+            out.reserve(64);
+            putTime(ts_ns);
+            out.put("(capture error)\n");
+        }
+    }
+
+    void lost(uint64_t ts_ns, uint64_t bytes) override { finish(); }
+
+    void flush() override
+    {
+        finish();
+        out.flush();
+    }
+};
+
+#endif
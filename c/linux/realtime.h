@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2022 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <atomic>
+
+#include "latency.h"
+
+// --realtime: keeps the threads that talk to the I2CDriver (the --capture
+// readers and the FUSE threads serving --dev and --mount) from being delayed by
+// page faults and other processes. The memory that exists when start() is called
+// is locked and faulted in, memory allocated later is locked as it is touched,
+// which is why buffers are pre-faulted before use. Each I/O thread switches
+// itself to SCHED_FIFO, optionally pinned to some CPUs, when it first calls
+// enterThread(). Threads it creates inherit this, so helper threads that should
+// not compete with it have to drop back to SCHED_OTHER themselves.
+//
+// With priority 0 only the pinning applies, but the latency histograms are still
+// collected and reported, so that a run without --realtime can be compared.
+class Realtime
+{
+    static const size_t STACK_PREFAULT = 256 << 10;
+
+    bool on = false;
+    int priority = 0;
+    bool pin = false;
+    cpu_set_t cpus;
+    std::atomic<bool> warned{false};
+
+    LatencyHistogram transactions; // updates are serialized by the bus
+
+    void warn(const char* what, int err)
+    {
+        if (!warned.exchange(true))
+            fprintf(stderr, "--realtime: %s: %s\n", what, strerror(err));
+    }
+
+    // Touches the stack below the caller, so that it is faulted in (and locked)
+    // before the thread needs it.
+    static void __attribute__((noinline)) prefaultStack()
+    {
+        volatile char buf[STACK_PREFAULT];
+        for (size_t i = 0; i < sizeof(buf); i += 4096)
+            buf[i] = 0;
+    }
+
+  public:
+    // Parses a list of CPUs like "0,2-3" into set. Returns false if it is invalid.
+    static bool parseCpus(const char* list, cpu_set_t& set)
+    {
+        CPU_ZERO(&set);
+        const char* p = list;
+        for (;;)
+        {
+            char* end;
+            long first = strtol(p, &end, 10);
+            long last = first;
+            if (end == p || first < 0)
+                return false;
+            if (*end == '-')
+            {
+                p = end + 1;
+                last = strtol(p, &end, 10);
+                if (end == p || last < first)
+                    return false;
+            }
+            if (last >= CPU_SETSIZE)
+                return false;
+            for (long c = first; c <= last; c++)
+                CPU_SET(c, &set);
+            if (*end == 0)
+                return true;
+            if (*end != ',')
+                return false;
+            p = end + 1;
+        }
+    }
+
+    // Enables --realtime with the SCHED_FIFO priority prio (0 to only measure) and
+    // the CPUs in cpu_list (nullptr for any). Returns false if an argument is invalid.
+    bool setup(int prio, const char* cpu_list)
+    {
+        if (prio < 0 || prio > sched_get_priority_max(SCHED_FIFO))
+            return false;
+        if (cpu_list != nullptr && !parseCpus(cpu_list, cpus))
+            return false;
+        on = true;
+        priority = prio;
+        pin = (cpu_list != nullptr);
+        return true;
+    }
+
+    bool active() const { return on; }
+
+    // Locks the memory of the process. Must be called in the process that does
+    // the I/O, i.e. after daemonizing with --background, because the locks are
+    // not inherited by fork().
+    void start()
+    {
+        if (!on || priority == 0)
+            return;
+        if (mlockall(MCL_CURRENT) != 0)
+        {
+            warn("mlockall", errno);
+            return;
+        }
+#ifdef MCL_ONFAULT
+        // Locking thread stacks and the like in full would take several MB each.
+        if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) == 0)
+            return;
+#endif
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+            warn("mlockall", errno);
+    }
+
+    // Makes the calling thread an I/O thread. Only the first call on a thread
+    // does anything.
+    void enterThread()
+    {
+        static thread_local bool entered = false;
+        if (!on || entered)
+            return;
+        entered = true;
+        if (pin)
+        {
+            int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+            if (err != 0)
+                warn("pinning to CPUs", err);
+        }
+        if (priority == 0)
+            return;
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = priority;
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err != 0)
+            warn("SCHED_FIFO", err);
+        prefaultStack();
+    }
+
+    // Makes the calling thread, which may have inherited --realtime from the
+    // thread that created it, an ordinary one again.
+    static void leaveThread()
+    {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+    }
+
+    // Counts a transaction that took us microseconds.
+    void transaction(uint64_t us)
+    {
+        if (on)
+            transactions.add(us);
+    }
+
+    // Prints the latency histogram of the transactions, if there were any.
+    void report(FILE* f)
+    {
+        if (on && transactions.samples() != 0)
+            transactions.print(f, "Transactions");
+    }
+};
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2022 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "export.h"
+#include "latency.h"
+#include "protocol.h"
+
+// Re-issues the transactions of a recorded capture (--replay) as the bus master
+// and compares the responses with the recording. Transactions are issued when
+// they are complete, i.e. at their STOP, through perform(), which returns 0 or an
+// errno value like i2c_rdwr(). Transactions that were not recorded completely
+// can not be reproduced and are skipped.
+class ReplaySink : public MessageSink
+{
+    int (*perform)(struct i2c_rdwr_ioctl_data& rdwr);
+    double rate; // speed-up factor for the recorded timing, 0 => as fast as possible
+    OutBuf out;  // divergences
+
+    Transaction t;
+    bool open = false; // t has messages
+    uint64_t txn;      // of t
+
+    struct i2c_msg msgs[Transaction::MAX_MSGS];
+    uint8_t buf[Transaction::MAX_DATA];
+
+    uint64_t first_ts = 0; // CLOCK_REALTIME of the first transaction in the recording
+    uint64_t last_ts = 0;
+    uint64_t start_ns = 0; // CLOCK_MONOTONIC when the first transaction was replayed
+
+    LatencyHistogram latency;
+    uint64_t replayed = 0;
+    uint64_t bytes = 0; // address and data bytes replayed
+    uint64_t skipped = 0;
+    uint64_t diverged = 0;
+    uint64_t late = 0; // transactions issued more than 1ms after their time
+
+    static uint64_t monoNs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    // Waits until it is time for the transaction recorded at ts_ns.
+    void pace(uint64_t ts_ns)
+    {
+        if (first_ts == 0)
+        {
+            first_ts = ts_ns;
+            start_ns = monoNs();
+        }
+        last_ts = ts_ns;
+        if (rate == 0)
+            return;
+        uint64_t due = start_ns + (ts_ns - first_ts) / rate;
+        uint64_t now = monoNs();
+        if (now > due + 1000000)
+            late++;
+        if (now >= due)
+            return;
+        struct timespec ts = {(time_t)(due / 1000000000), (long)(due % 1000000000)};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+        {
+        }
+    }
+
+    // The errno value the recorded transaction implies.
+    int expected()
+    {
+        for (int i = 0; i < t.nmsgs; i++)
+        {
+            if (t.msg[i].addr_nak)
+                return ENXIO;
+            if (!t.msg[i].rd && t.msg[i].last_nak)
+                return EIO;
+        }
+        return 0;
+    }
+
+    void replay()
+    {
+        pace(t.msg[0].ts_ns);
+
+        uint32_t used = 0;
+        for (int i = 0; i < t.nmsgs; i++)
+        {
+            const I2CMessage& m = t.msg[i];
+            msgs[i].addr = m.addr;
+            msgs[i].flags = m.rd ? I2C_M_RD : 0;
+            msgs[i].len = m.len;
+            msgs[i].buf = buf + used;
+            if (!m.rd)
+                memcpy(buf + used, m.data, m.len);
+            used += m.len;
+            bytes += 1 + m.len;
+        }
+        struct i2c_rdwr_ioctl_data rdwr = {msgs, (uint32_t)t.nmsgs};
+        uint64_t begin = monoNs();
+        int err = perform(rdwr);
+        latency.add((monoNs() - begin) / 1000);
+        replayed++;
+
+        bool same = (err == expected());
+        for (int i = 0; same && err == 0 && i < t.nmsgs; i++)
+            if (t.msg[i].rd && memcmp(msgs[i].buf, t.msg[i].data, t.msg[i].len) != 0)
+                same = false;
+        if (same)
+            return;
+
+        diverged++;
+        char when[32];
+        snprintf(when, sizeof(when), "+%.6f ", (t.msg[0].ts_ns - first_ts) / 1e9);
+        out.reserve(256 + 6 * t.used + 16 * t.nmsgs);
+        out.put(when);
+        putRaw(out, t);
+        out.put("  replayed:");
+        if (err != 0)
+        {
+            out.put(' ');
+            out.put(strerror(err));
+        }
+        else
+        {
+            for (int i = 0; i < t.nmsgs; i++)
+                if (t.msg[i].rd)
+                {
+                    out.put(" R");
+                    for (uint32_t k = 0; k < t.msg[i].len; k++)
+                    {
+                        out.put(' ');
+                        out.hex2(msgs[i].buf[k]);
+                    }
+                }
+            if (expected() != 0)
+                out.put(" OK");
+        }
+        out.put('\n');
+    }
+
+    void finish()
+    {
+        if (!open)
+            return;
+        open = false;
+        if (!t.stop || t.error || t.truncated)
+            skipped++;
+        else
+            replay();
+    }
+
+  public:
+    ReplaySink(int (*perform)(struct i2c_rdwr_ioctl_data& rdwr), double rate, FILE* f)
+        : perform(perform), rate(rate), out(f)
+    {
+        t.clear();
+    }
+
+    void message(const I2CMessage& msg) override
+    {
+        if (msg.host)
+            return;
+        if (open && msg.txn != txn)
+            finish();
+        if (!open)
+        {
+            t.clear();
+            open = true;
+            txn = msg.txn;
+        }
+        t.add(msg);
+        if (msg.stop)
+        {
+            t.stop = true;
+            finish();
+        }
+    }
+
+    void anomaly(uint64_t ts_ns, CaptureEvent ev) override
+    {
+        if (open)
+            t.error = true;
+    }
+
+    void lost(uint64_t ts_ns, uint64_t bytes) override { finish(); }
+
+    void flush() override
+    {
+        finish();
+        out.flush();
+    }
+
+    // Prints throughput, latency and divergence statistics.
+    void report(FILE* f)
+    {
+        double secs = (monoNs() - start_ns) / 1e9;
+        double recorded = (last_ts - first_ts) / 1e9;
+        if (replayed == 0)
+            secs = recorded = 0;
+        fprintf(f,
+                "%" PRIu64 " transactions replayed in %.3fs (recorded in %.3fs): %.1f transactions/s, %.0f bytes/s\n",
+                replayed, secs, recorded, secs > 0 ? replayed / secs : 0.0, secs > 0 ? bytes / secs : 0.0);
+        latency.print(f, "Latency");
+        fprintf(f, "%" PRIu64 " diverged from the recording, %" PRIu64 " incomplete ones skipped", diverged, skipped);
+        if (rate != 0)
+            fprintf(f, ", %" PRIu64 " issued more than 1ms late", late);
+        fputc('\n', f);
+    }
+};
+
+#endif
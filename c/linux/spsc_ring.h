@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2022 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+// Lock-free ring of NUM_BLOCKS Blocks for exactly 1 producer thread and 1
+// consumer thread. The producer fills the block returned by writable() in place
+// and publishes it with commit(). The consumer processes the block returned by
+// readable() in place and hands it back with release(). Neither side ever waits
+// for the other unless it asks to with waitReadable().
+template <typename Block, size_t NUM_BLOCKS> class SpscRing
+{
+    static_assert((NUM_BLOCKS & (NUM_BLOCKS - 1)) == 0, "NUM_BLOCKS must be a power of 2");
+
+    Block* blocks;
+
+    // head and tail count blocks since the start and are only ever incremented,
+    // head by the producer and tail by the consumer. They live on separate cache
+    // lines, so that the 2 threads don't fight over them.
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+    alignas(64) std::atomic<bool> closed{false};
+    std::atomic<uint32_t> signals{0}; // incremented by commit() and close() to wake up waitReadable()
+
+    void signal()
+    {
+        signals.fetch_add(1, std::memory_order_release);
+        signals.notify_one();
+    }
+
+  public:
+    SpscRing() : blocks(new Block[NUM_BLOCKS]) {}
+    ~SpscRing() { delete[] blocks; }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    // Writes to every page of the blocks, so that using them does not page fault
+    // (see --realtime). Only before the producer and consumer start.
+    void prefault()
+    {
+        volatile char* p = (volatile char*)blocks;
+        for (size_t i = 0; i < sizeof(Block) * NUM_BLOCKS; i += 4096)
+            p[i] = p[i];
+    }
+
+    // Producer: Returns the next free block or nullptr if the ring is full.
+    Block* writable()
+    {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == NUM_BLOCKS)
+            return nullptr;
+        return &blocks[h % NUM_BLOCKS];
+    }
+
+    // Producer: Publishes the block returned by writable().
+    void commit()
+    {
+        head.fetch_add(1, std::memory_order_release);
+        signal();
+    }
+
+    // Producer: Tells the consumer that no more blocks will come.
+    void close()
+    {
+        closed.store(true, std::memory_order_release);
+        signal();
+    }
+
+    // Consumer: Returns the oldest published block or nullptr if there is none.
+    Block* readable()
+    {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        if (head.load(std::memory_order_acquire) == t)
+            return nullptr;
+        return &blocks[t % NUM_BLOCKS];
+    }
+
+    // Consumer: Waits until a block is published and returns it. Returns nullptr
+    // if the ring is empty and the producer has called close().
+    Block* waitReadable()
+    {
+        for (;;)
+        {
+            uint32_t s = signals.load(std::memory_order_acquire);
+            Block* b = readable();
+            if (b != nullptr)
+                return b;
+            if (closed.load(std::memory_order_acquire))
+                return readable(); // a block may have been committed right before close()
+            signals.wait(s, std::memory_order_acquire);
+        }
+    }
+
+    // Consumer: Returns true if the producer has called close() and all blocks
+    // have been read, for consumers that poll with readable().
+    bool drained()
+    {
+        if (!closed.load(std::memory_order_acquire))
+            return false;
+        return readable() == nullptr;
+    }
+
+    // Consumer: Returns the block obtained from readable() or waitReadable() to the producer.
+    void release() { tail.fetch_add(1, std::memory_order_release); }
+
+    // Number of blocks published and not yet released.
+    size_t fill() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+};
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2022 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TIMEBASE_H
+#define TIMEBASE_H
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "capture_file.h"
+
+// Estimates the CLOCK_MONOTONIC at which the I2CDriver sent each byte of the
+// capture token stream, given only when the reads that returned them completed.
+//
+// The FTDI chip holds received bytes back until its packet is full or its
+// latency timer expires, and the host polls it once per 1 ms USB frame, so the
+// last byte of a read arrived somewhere in the window of latency_timer + 1 ms
+// before the read completed. It is taken to be in the middle of that window.
+//
+// While the bus is idle the firmware sends a 0x00 byte each time its timer
+// runs out, so idle bytes are a clock within the stream. Their period is learned
+// by a least squares fit of the time between reads to the number of idle and
+// other bytes they returned; the latency of each read cancels out over many of
+// them. The bytes of a block are then laid out up to its end: idle bytes 1 period
+// apart, the rest evenly in the time that remains since the end of the previous
+// block. Until the period is known, all bytes are spread evenly, as --replay does.
+class CaptureTimebase
+{
+    uint64_t window_ns = 17000000; // FTDI default latency timer of 16 ms + 1 USB frame
+
+    uint64_t prev_read = 0; // mono_ns of the previous block, 0 at the start and after lost data
+    uint64_t prev_end = 0;  // estimated time of its last byte
+
+    // Sums for fitting the time between reads d to i * idle period + b * busy
+    // byte time, i and b being the number of idle and other bytes
+    double s_ii = 0, s_ib = 0, s_bb = 0, s_id = 0, s_bd = 0;
+    uint64_t idle_count = 0; // idle bytes in the fit
+    uint64_t period_ns = 0;  // idle period, 0 if not known yet
+    uint64_t byte_ns = 0;    // time of a byte that is not idle
+
+    // The current block
+    const uint8_t* data = nullptr;
+    uint64_t start = 0;      // estimated time before its first byte
+    uint64_t idle_step = 0;  // time per idle byte
+    uint64_t busy_step = 0;  // time per other byte
+    uint64_t error_ns = 0;   // error bound of its timestamps (+/-)
+    size_t cur = 0;          // at() cursor: byte index ...
+    uint64_t cur_ns = 0;     // ... and the time before it
+
+    // For report()
+    uint64_t blocks = 0;
+    uint64_t stamps = 0;
+    double error_sum = 0; // of the error bounds of the at() results
+    uint64_t error_max = 0;
+
+    void fit(double i, double b, double d)
+    {
+        s_ii += i * i;
+        s_ib += i * b;
+        s_bb += b * b;
+        s_id += i * d;
+        s_bd += b * d;
+        idle_count += i;
+        if (idle_count > (1 << 20)) // follow drifts of the I2CDriver's clock
+        {
+            s_ii /= 2, s_ib /= 2, s_bb /= 2, s_id /= 2, s_bd /= 2;
+            idle_count /= 2;
+        }
+        if (idle_count < 64)
+            return;
+        double det = s_ii * s_bb - s_ib * s_ib;
+        double p = det > 1e-6 * s_ii * s_bb ? (s_bb * s_id - s_ib * s_bd) / det : s_id / s_ii;
+        period_ns = p > 0 ? p : 0;
+        double t = det > 1e-6 * s_ii * s_bb ? (s_ii * s_bd - s_ib * s_id) / det : 0;
+        byte_ns = t > 0 ? t : 0;
+    }
+
+  public:
+    // Sets the USB latency timer of the TTY in ms (-1 if unknown, which assumes
+    // the FTDI default).
+    void setLatency(int latency_timer)
+    {
+        window_ns = (uint64_t)((latency_timer >= 0 ? latency_timer : 16) + 1) * 1000000;
+    }
+
+    // Idle period in ns, 0 if not known yet.
+    uint64_t idlePeriod() const { return period_ns; }
+
+    // Forgets the previous block, e.g. because data was lost.
+    void reset() { prev_read = 0; }
+
+    // Starts timestamping the bytes of block.
+    void block(const CaptureBlock& b)
+    {
+        size_t idle = 0;
+        for (size_t i = 0; i < b.len; i++)
+            idle += (b.data[i] == 0);
+        size_t busy = b.len - idle;
+
+        if (prev_read != 0)
+            fit(idle, busy, b.mono_ns - prev_read);
+
+        uint64_t end = b.mono_ns - window_ns / 2;
+        uint64_t period = idlePeriod();
+        if (prev_read != 0 && prev_end < end)
+            start = prev_end;
+        else // no previous block => assume the idle cadence up to the end
+            start = end - (period != 0 ? b.len * period : 0);
+        uint64_t span = end - start;
+
+        if (period != 0 && idle != 0 && busy != 0 && idle * period <= span)
+        {
+            idle_step = period;
+            busy_step = (span - idle * period) / busy;
+            // An event is within 1 period of the idle byte next to it, plus what
+            // the block's timing deviates from the fit.
+            int64_t slack = span - idle * period - busy * byte_ns;
+            error_ns = window_ns / 2 + period + (slack < 0 ? -slack : slack);
+        }
+        else
+        {
+            idle_step = busy_step = b.len != 0 ? span / b.len : 0;
+            error_ns = window_ns / 2 + (period != 0 && busy == 0 ? period : span);
+        }
+
+        data = b.data;
+        cur = 0;
+        cur_ns = start;
+        prev_read = b.mono_ns;
+        prev_end = end;
+        blocks++;
+    }
+
+    // Returns the estimated time byte k of the current block was sent. Calls with
+    // increasing k are O(1) on average.
+    uint64_t at(size_t k)
+    {
+        if (k < cur)
+        {
+            cur = 0;
+            cur_ns = start;
+        }
+        for (; cur <= k; cur++)
+            cur_ns += data[cur] == 0 ? idle_step : busy_step;
+        stamps++;
+        error_sum += error_ns;
+        if (error_ns > error_max)
+            error_max = error_ns;
+        return cur_ns;
+    }
+
+    // Error bound (+/-) of the timestamps of the current block.
+    uint64_t error() const { return error_ns; }
+
+    // Prints how the timestamps were estimated and their error bounds.
+    void report(FILE* f)
+    {
+        if (stamps == 0)
+            return;
+        fprintf(f, "Timestamps from %" PRIu64 " reads, USB latency window %.1f ms, ", blocks, window_ns / 1e6);
+        uint64_t period = idlePeriod();
+        if (period != 0)
+            fprintf(f, "idle period %.3f ms", period / 1e6);
+        else
+            fprintf(f, "idle period unknown");
+        fprintf(f, ", error +/-%.3f ms on average (max +/-%.3f ms)\n", error_sum / stamps / 1e6, error_max / 1e6);
+    }
+};
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2022 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+
+#include "capture.h"
+#include "realtime.h"
+#include "spsc_ring.h"
+
+// A transaction performed by i2c_rdwr(), as recorded for the --verbose trace.
+struct TraceRecord
+{
+    static const size_t MAX_DATA = 4096; // bytes beyond this are only counted
+
+    struct Msg
+    {
+        uint8_t addr;
+        bool rd;
+        uint32_t len;    // data bytes of the message
+        uint32_t stored; // of them in data
+    };
+
+    uint64_t lost; // transactions not traced before this one, because the ring was full
+    int err;       // errno value of the transaction, 0 on success
+    unsigned nmsgs;
+    unsigned failed; // index of the message that failed if err != 0
+    bool has_pec;
+    uint8_t pec;
+    Msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+    size_t used;
+    uint8_t data[MAX_DATA];
+};
+
+// Prints the transactions performed with --verbose or debug CUSE output in the
+// --capture format on a background thread, so that the bus path only has to
+// copy the messages into a TraceRecord. Records are passed through a lock-free
+// ring. There is only 1 producer at a time, because all bus access is
+// serialized. If the ring is full, the transaction is left out and the number
+// of them is printed with the next one. The thread is started with the first
+// record, so that it survives --background daemonizing.
+class TraceLogger
+{
+    typedef SpscRing<TraceRecord, 256> TraceRing;
+    static const size_t MAX_EVENTS = 2 * I2C_RDWR_IOCTL_MAX_MSGS + TraceRecord::MAX_DATA + 1;
+
+    const CaptureText& text;
+    const Color& color;
+    FILE* f;
+    OutBuf out;
+    TraceRing ring;
+    std::thread thread;
+    bool started = false;
+    uint64_t lost = 0;
+    uint64_t committed = 0;
+    std::atomic<uint64_t> printed{0}; // records formatted and flushed to the FILE
+    CaptureEvent ev[MAX_EVENTS];
+
+    void format(const TraceRecord& r)
+    {
+        if (r.lost != 0)
+        {
+            out.reserve(64);
+            char msg[64];
+            snprintf(msg, sizeof(msg), "%s[%" PRIu64 " transactions not traced]%s\n", color.ERR, r.lost,
+                     color.DEFAULT);
+            out.put(msg);
+        }
+        size_t n = 0;
+        const uint8_t* data = r.data;
+        size_t truncated = 0;
+        for (unsigned i = 0; i < r.nmsgs; i++)
+        {
+            const TraceRecord::Msg& m = r.msgs[i];
+            bool failed = (r.err != 0 && i == r.failed);
+            ev[n++] = CaptureEvent::make(CAPTURE_START);
+            ev[n++] = CaptureEvent::make(CAPTURE_ADDR, (m.addr << 1) | m.rd, failed && r.err == ENXIO);
+            if (!failed) // the data of the failed message is unknown
+                for (uint32_t k = 0; k < m.stored; k++)
+                    ev[n++] = CaptureEvent::make(CAPTURE_DATA, data[k], m.rd && k + 1 == m.len);
+            data += m.stored;
+            truncated += m.len - m.stored;
+            if (failed)
+                break;
+        }
+        ev[n++] = CaptureEvent::make(CAPTURE_STOP);
+        text.format(ev, n, out);
+
+        char tail[64];
+        size_t len = 0;
+        if (truncated != 0)
+            len += snprintf(tail + len, sizeof(tail) - len, "%s[%zu bytes not traced]%s ", color.ERR, truncated,
+                            color.DEFAULT);
+        if (r.has_pec)
+            snprintf(tail + len, sizeof(tail) - len, "PEC: 0x%02X", r.pec);
+        out.reserve(sizeof(tail) + 16);
+        out.put(tail);
+        out.put(color.DEFAULT);
+        out.put('\n');
+    }
+
+    void run()
+    {
+        Realtime::leaveThread(); // started by a bus thread, which may run with --realtime
+        uint64_t count = 0;
+        TraceRecord* r;
+        while ((r = ring.waitReadable()) != nullptr)
+        {
+            format(*r);
+            ring.release();
+            count++;
+            if (ring.readable() == nullptr) // caught up => show it
+            {
+                out.flush();
+                fflush(f);
+                printed.store(count, std::memory_order_release);
+            }
+        }
+        out.flush();
+        fflush(f);
+        printed.store(count, std::memory_order_release);
+    }
+
+  public:
+    TraceLogger(const CaptureText& text, const Color& color, FILE* f) : text(text), color(color), f(f), out(f) {}
+    ~TraceLogger() { stop(); }
+
+    TraceLogger(const TraceLogger&) = delete;
+    TraceLogger& operator=(const TraceLogger&) = delete;
+
+    // Records a transaction. failed is the index of the message that failed if
+    // err != 0. pec is printed if has_pec.
+    void add(const struct i2c_rdwr_ioctl_data& rdwr, unsigned failed, int err, bool has_pec, uint8_t pec)
+    {
+        if (!started)
+        {
+            started = true;
+            thread = std::thread(&TraceLogger::run, this);
+        }
+        TraceRecord* r = ring.writable();
+        if (r == nullptr)
+        {
+            lost++;
+            return;
+        }
+        r->lost = lost;
+        lost = 0;
+        r->err = err;
+        r->failed = failed;
+        r->has_pec = has_pec;
+        r->pec = pec;
+        r->nmsgs = 0;
+        r->used = 0;
+        for (unsigned i = 0; i < rdwr.nmsgs && i < I2C_RDWR_IOCTL_MAX_MSGS; i++)
+        {
+            const struct i2c_msg& msg = rdwr.msgs[i];
+            if (msg.buf == nullptr)
+                continue; // should not happen
+            TraceRecord::Msg& m = r->msgs[r->nmsgs++];
+            m.addr = msg.addr & 0x7f;
+            m.rd = (msg.flags & I2C_M_RD) != 0;
+            m.len = (msg.flags & I2C_M_RECV_LEN) ? msg.buf[0] + 1 : msg.len;
+            m.stored = m.len < TraceRecord::MAX_DATA - r->used ? m.len : TraceRecord::MAX_DATA - r->used;
+            memcpy(r->data + r->used, msg.buf, m.stored);
+            r->used += m.stored;
+            if (err != 0 && i == failed)
+                r->failed = r->nmsgs - 1;
+        }
+        ring.commit();
+        committed++;
+    }
+
+    // Waits until everything recorded so far has been printed, so that other
+    // output can follow it.
+    void drain()
+    {
+        while (started && printed.load(std::memory_order_acquire) < committed)
+            usleep(100);
+    }
+
+    // Prints what is left and ends the thread. Must not be followed by add().
+    void stop()
+    {
+        if (!started)
+            return;
+        ring.close();
+        thread.join();
+        started = false;
+    }
+};
+
+#endif
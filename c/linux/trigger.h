@@ -0,0 +1,339 @@
+/*
+ * Copyright (C) 2022 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TRIGGER_H
+#define TRIGGER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+
+// A --trigger expression: a ','-separated list of conditions that must all hold
+// for a message (address byte and following data up to the next START, STOP or
+// idle bus):
+//
+//   <addr>        7 bit address, e.g. 0x50
+//   r, w          read or write message
+//   nak           the address or a written data byte was NAKed
+//   nodata        the address was followed by a STOP without any data
+//   data=<hex>    the data starts with the given bytes, ".." matches any byte,
+//                 e.g. data=12..34
+//   contains=<hex> the data contains the given bytes anywhere (--query only,
+//                 because it can't be decided before the end of the message)
+//   error         a partial byte or an undocumented token (matches on its own)
+struct TriggerCondition
+{
+    static const int MAX_PATTERN = 16;
+
+    int addr = -1; // -1 => any
+    int rd = -1;   // -1 => any
+    bool nak = false;
+    bool nodata = false;
+    bool error = false;
+    int pattern_len = 0;
+    uint8_t pattern[MAX_PATTERN];
+    uint8_t mask[MAX_PATTERN]; // 0 for ".."
+    int contains_len = 0;
+    uint8_t contains[MAX_PATTERN];
+
+    // Returns false if expr is not a valid trigger expression.
+    bool parse(const char* expr)
+    {
+        const char* p = expr;
+        for (;;)
+        {
+            size_t len = strcspn(p, ",");
+            if (len == 1 && (*p == 'r' || *p == 'w'))
+                rd = (*p == 'r');
+            else if (len == 3 && strncmp(p, "nak", 3) == 0)
+                nak = true;
+            else if (len == 6 && strncmp(p, "nodata", 6) == 0)
+                nodata = true;
+            else if (len == 5 && strncmp(p, "error", 5) == 0)
+                error = true;
+            else if (len > 5 && strncmp(p, "data=", 5) == 0)
+            {
+                if (!parseHex(p + 5, len - 5, pattern, mask, pattern_len))
+                    return false;
+            }
+            else if (len > 9 && strncmp(p, "contains=", 9) == 0)
+            {
+                if (!parseHex(p + 9, len - 9, contains, nullptr, contains_len))
+                    return false;
+            }
+            else
+            {
+                char* end;
+                long a = strtol(p, &end, 0);
+                if (len == 0 || end != p + len || a < 0 || a > 127)
+                    return false;
+                addr = a;
+            }
+            p += len;
+            if (*p == 0)
+                break;
+            p++;
+        }
+        // "error" concerns events outside of messages, so it can't be combined
+        return !error || (addr < 0 && rd < 0 && !nak && !nodata && pattern_len == 0 && contains_len == 0);
+    }
+
+    // Parses len hex digits into bytes[n..]. If mask is not null, ".." is
+    // allowed and stored as mask 0.
+    static bool parseHex(const char* hex, size_t len, uint8_t* bytes, uint8_t* mask, int& n)
+    {
+        if (len % 2 != 0 || len / 2 > (size_t)(MAX_PATTERN - n))
+            return false;
+        for (size_t i = 0; i < len; i += 2)
+        {
+            if (mask != nullptr && hex[i] == '.' && hex[i + 1] == '.')
+            {
+                bytes[n] = 0;
+                mask[n++] = 0;
+                continue;
+            }
+            char digits[3] = {hex[i], hex[i + 1], 0};
+            char* end;
+            long b = strtol(digits, &end, 16);
+            if (end != digits + 2)
+                return false;
+            bytes[n] = b;
+            if (mask != nullptr)
+                mask[n] = 0xff;
+            n++;
+        }
+        return true;
+    }
+};
+
+// Passes the decoded capture stream through the --trigger expressions and lets
+// only the events around a match through: up to pre events before the event
+// that completed the match, and post events after it. A match within the post
+// window extends it. Between matches, events only go into a ring of the most
+// recent ones, so that following the stream costs a store and a few compares
+// per event.
+class CaptureTrigger
+{
+  public:
+    static const int MAX_CONDITIONS = 16;
+    static const size_t MAX_PRE = 1 << 24;
+
+  private:
+    TriggerCondition cond[MAX_CONDITIONS];
+    int nconds = 0;
+    bool any_error = false; // some condition is "error"
+
+    size_t pre = 256;
+    uint64_t post = 256;
+
+    // Ring of the last size events and their timestamps. head is the sequence
+    // number of the next event, emitted the one of the first event not yet passed
+    // on and emit_to the end of the events that are to be passed on.
+    CaptureEvent* ring = nullptr;
+    uint64_t* ring_ts = nullptr;
+    size_t size = 0;
+    uint64_t head = 0;
+    uint64_t emitted = 0;
+    uint64_t emit_to = 0;
+    uint64_t post_left = 0;
+    uint64_t fired = 0;
+
+    // The message currently being matched.
+    bool in_msg = false;
+    uint8_t addr;
+    bool rd;
+    bool nak;
+    uint32_t ndata;
+    uint32_t pattern_ok; // bit i set while the data matches cond[i]'s pattern
+
+    void startMessage(CaptureEvent e)
+    {
+        in_msg = true;
+        addr = e.value() >> 1;
+        rd = e.value() & 1;
+        nak = e.nak();
+        ndata = 0;
+        pattern_ok = ~0u;
+    }
+
+    void dataByte(CaptureEvent e)
+    {
+        if (!rd && e.nak()) // the master NAKs the last byte it reads, which is normal
+            nak = true;
+        if (ndata < TriggerCondition::MAX_PATTERN)
+            for (int i = 0; i < nconds; i++)
+                if (ndata < (uint32_t)cond[i].pattern_len &&
+                    ((e.value() ^ cond[i].pattern[ndata]) & cond[i].mask[ndata]) != 0)
+                    pattern_ok &= ~(1u << i);
+        ndata++;
+    }
+
+    // Ends the current message and returns true if it matches a condition.
+    bool endMessage(bool stop)
+    {
+        if (!in_msg)
+            return false;
+        in_msg = false;
+        for (int i = 0; i < nconds; i++)
+        {
+            const TriggerCondition& c = cond[i];
+            if (c.error || (c.addr >= 0 && c.addr != addr) || (c.rd >= 0 && c.rd != rd) || (c.nak && !nak) ||
+                (c.nodata && (ndata != 0 || !stop)) || ndata < (uint32_t)c.pattern_len || !(pattern_ok & (1u << i)))
+                continue;
+            return true;
+        }
+        return false;
+    }
+
+    bool match(CaptureEvent e)
+    {
+        switch (e.type())
+        {
+            case CAPTURE_ADDR:
+            {
+                bool m = endMessage(false);
+                startMessage(e);
+                return m;
+            }
+            case CAPTURE_DATA:
+                if (in_msg)
+                    dataByte(e);
+                return false;
+            case CAPTURE_STOP:
+                return endMessage(true);
+            case CAPTURE_START:
+            case CAPTURE_IDLE:
+                return endMessage(false);
+            case CAPTURE_PARTIAL:
+            case CAPTURE_UNDOC:
+                return endMessage(false) | any_error;
+        }
+        return false;
+    }
+
+    // Passes ring[emitted..emit_to) to out in runs of the same timestamp.
+    template <typename Out> void flush(Out& out)
+    {
+        while (emitted < emit_to)
+        {
+            size_t i = emitted % size;
+            size_t n = 1;
+            uint64_t ts = ring_ts[i];
+            while (emitted + n < emit_to && i + n < size && ring_ts[i + n] == ts)
+                n++;
+            out(ring + i, n, ts);
+            emitted += n;
+        }
+    }
+
+  public:
+    ~CaptureTrigger()
+    {
+        delete[] ring;
+        delete[] ring_ts;
+    }
+
+    // Adds a --trigger expression. Returns false if it is invalid.
+    bool add(const char* expr)
+    {
+        if (nconds == MAX_CONDITIONS)
+            return false;
+        TriggerCondition c;
+        if (!c.parse(expr) || c.contains_len != 0)
+            return false;
+        any_error |= c.error;
+        cond[nconds++] = c;
+        return true;
+    }
+
+    // Sets the number of events to show before and after a match.
+    void setWindow(size_t pre_events, uint64_t post_events)
+    {
+        pre = pre_events > MAX_PRE ? MAX_PRE : pre_events;
+        post = post_events;
+    }
+
+    // Number of times a trigger has fired.
+    uint64_t count() const { return fired; }
+
+    // Forgets the message being matched, e.g. because capture data was lost.
+    void reset() { in_msg = false; }
+
+    // Processes n events that were received at ts_ns. Events in a window around a
+    // match are passed on to out(const CaptureEvent* ev, size_t n, uint64_t ts_ns).
+    // Before the first event of a window that does not continue the previous one,
+    // gap(uint64_t skipped) is called with the number of events left out.
+    template <typename Out, typename Gap>
+    void filter(const CaptureEvent* ev, size_t n, uint64_t ts_ns, Out out, Gap gap)
+    {
+        if (ring == nullptr)
+        {
+            size = 1024;
+            while (size < 2 * pre)
+                size *= 2;
+            ring = new CaptureEvent[size];
+            ring_ts = new uint64_t[size];
+        }
+
+        for (size_t k = 0; k < n; k++)
+        {
+            uint64_t seq = head++;
+            ring[seq % size] = ev[k];
+            ring_ts[seq % size] = ts_ns;
+            if (post_left > 0)
+            {
+                post_left--;
+                emit_to = seq + 1;
+                if (emit_to - emitted >= size / 2) // don't let the ring overwrite what we still have to pass on
+                    flush(out);
+            }
+
+            if (match(ev[k]))
+            {
+                fired++;
+                if (emit_to < seq + 1)
+                { // not within a post window => start a new window
+                    uint64_t start = seq + 1 > pre ? seq + 1 - pre : 0;
+                    if (start < emitted)
+                        start = emitted;
+                    // begin with a START if there is one, to not show a message cut in half
+                    for (uint64_t s = start; s < seq; s++)
+                        if (ring[s % size].type() == CAPTURE_START)
+                        {
+                            start = s;
+                            break;
+                        }
+                    if (start > emitted || emitted == 0)
+                        gap(start - emitted);
+                    emitted = start;
+                    emit_to = seq + 1;
+                    flush(out);
+                }
+                post_left = post;
+            }
+        }
+        flush(out);
+    }
+};
+
+#endif
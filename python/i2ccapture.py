@@ -0,0 +1,173 @@
+"""
+Columnar decoding of the I2CDriver capture stream.
+
+Decoding millions of events into one Python object each is far too slow for
+statistics. This module lets the C library (``libi2cdriver.so``, built with
+``make -f linux/Makefile`` in the ``c`` directory) decode the raw capture
+stream straight into parallel arrays, one entry per event:
+
+    ts_ns   time of the event in ns (uint64)
+    type    START, STOP, ADDR, DATA or ERROR (uint8)
+    addr    7 bit address of the message the event belongs to, 0xff if none
+    value   address byte incl. R/W bit (ADDR), data byte (DATA), token or
+            bits of a partial byte (ERROR)
+    ack     1 if the byte was ACKed (ADDR, DATA)
+
+The arrays are numpy arrays if numpy is installed, otherwise memoryviews. The
+C code writes into them directly, nothing is copied.
+
+Example::
+
+    import i2cdriver, i2ccapture
+    c = i2ccapture.capture(i2cdriver.I2CDriver("/dev/ttyUSB0"), 10)
+    reads = c.value[(c.type == i2ccapture.DATA) & (c.addr == 0x48)]
+"""
+
+import ctypes
+import os
+import time
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+START, STOP, ADDR, DATA, ERROR = range(5)
+
+EVENTS_PER_BYTE = 4  # I2C_CAPTURE_EVENTS_PER_BYTE
+
+class _Decoder(ctypes.Structure):
+    _fields_ = [("starting", ctypes.c_int),
+                ("nbits", ctypes.c_int),
+                ("bits", ctypes.c_int),
+                ("addr", ctypes.c_uint8)]
+
+class _Columns(ctypes.Structure):
+    _fields_ = [("ts_ns", ctypes.c_void_p),
+                ("type", ctypes.c_void_p),
+                ("addr", ctypes.c_void_p),
+                ("value", ctypes.c_void_p),
+                ("ack", ctypes.c_void_p),
+                ("capacity", ctypes.c_size_t)]
+
+_FIELDS = (("ts_ns", ctypes.c_uint64), ("type", ctypes.c_uint8), ("addr", ctypes.c_uint8),
+           ("value", ctypes.c_uint8), ("ack", ctypes.c_uint8))
+
+def _load(path):
+    here = os.path.dirname(os.path.abspath(__file__))
+    candidates = [path, os.environ.get("I2CDRIVER_LIB"),
+                  os.path.join(here, "libi2cdriver.so"),
+                  os.path.join(here, "..", "c", "build", "libi2cdriver.so"),
+                  "libi2cdriver.so"]
+    for p in candidates:
+        if p is None or (os.sep in p and not os.path.exists(p)):
+            continue
+        try:
+            lib = ctypes.CDLL(p)
+        except OSError:
+            continue
+        lib.i2c_capture_decoder_init.argtypes = [ctypes.POINTER(_Decoder)]
+        lib.i2c_capture_decoder_init.restype = None
+        lib.i2c_capture_decode_columns.argtypes = [
+            ctypes.POINTER(_Decoder), ctypes.c_char_p, ctypes.c_size_t, ctypes.c_uint64, ctypes.c_uint64,
+            ctypes.POINTER(_Columns), ctypes.POINTER(ctypes.c_size_t)]
+        lib.i2c_capture_decode_columns.restype = ctypes.c_size_t
+        return lib
+    raise OSError("libi2cdriver.so not found, build it with 'make -f linux/Makefile' in c/ "
+                  "or set I2CDRIVER_LIB")
+
+class Columns:
+    """
+    Decoded events as the parallel arrays ``ts_ns``, ``type``, ``addr``,
+    ``value`` and ``ack``, all of length ``len(columns)``.
+    """
+    def __init__(self, capacity):
+        self.capacity = capacity
+        self.count = 0
+        self._arrays = []
+        for (name, ctype) in _FIELDS:
+            if numpy is not None:
+                a = numpy.empty(capacity, dtype = numpy.dtype(ctype))
+                address = a.ctypes.data
+            else:
+                a = (ctype * capacity)()
+                address = ctypes.addressof(a)
+            self._arrays.append((name, a, address, ctypes.sizeof(ctype)))
+        self._publish()
+
+    def _publish(self):
+        for (name, a, _, _) in self._arrays:
+            setattr(self, name, (a if numpy is not None else memoryview(a).cast("B").cast(
+                "Q" if name == "ts_ns" else "B"))[:self.count])
+
+    def _tail(self):
+        # The C struct for the free part of the arrays
+        c = _Columns()
+        for (name, _, address, size) in self._arrays:
+            setattr(c, name, address + self.count * size)
+        c.capacity = self.capacity - self.count
+        return c
+
+    def __len__(self):
+        return self.count
+
+class ColumnDecoder:
+    """
+    Decodes the capture stream into Columns. The decoder keeps its state
+    between calls, so a stream can be passed in as it is read.
+    """
+    def __init__(self, lib = None):
+        self.lib = _load(lib)
+        self.state = _Decoder()
+        self.lib.i2c_capture_decoder_init(ctypes.byref(self.state))
+
+    def decode_into(self, columns, data, t0_ns = 0, t1_ns = 0):
+        """
+        Appends the events of the bytes ``data``, received between ``t0_ns``
+        and ``t1_ns``, to ``columns``, which needs room for
+        ``EVENTS_PER_BYTE * len(data)`` more events. Returns the number of events.
+        """
+        data = bytes(data)
+        c = columns._tail()
+        consumed = ctypes.c_size_t()
+        n = self.lib.i2c_capture_decode_columns(ctypes.byref(self.state), data, len(data), t0_ns, t1_ns,
+                                                ctypes.byref(c), ctypes.byref(consumed))
+        if consumed.value != len(data):
+            raise ValueError("columns are too small")
+        columns.count += n
+        columns._publish()
+        return n
+
+    def decode(self, data, t0_ns = 0, t1_ns = 0):
+        """Returns the Columns of the bytes ``data`` received between ``t0_ns`` and ``t1_ns``."""
+        columns = Columns(EVENTS_PER_BYTE * len(data))
+        self.decode_into(columns, data, t0_ns, t1_ns)
+        return columns
+
+def _now_ns():
+    return int(time.time() * 1e9)
+
+def capture(i2, seconds, decoder = None):
+    """
+    Captures for ``seconds`` with the I2CDriver ``i2`` and returns the
+    Columns of everything that happened on the bus. The timestamps are
+    CLOCK_REALTIME ns, the bytes of each read being spread over the time since
+    the previous read.
+    """
+    if decoder is None:
+        decoder = ColumnDecoder()
+    chunks = []
+    i2.ser.write(b"c")
+    t0 = _now_ns()
+    stop = t0 + int(seconds * 1e9)
+    while t0 < stop:
+        data = i2.ser.read(max(1, i2.ser.in_waiting))
+        t1 = _now_ns()
+        if data:
+            chunks.append((data, t0, t1))
+        t0 = t1
+    i2.capture_stop()
+    columns = Columns(EVENTS_PER_BYTE * sum(len(d) for (d, _, _) in chunks))
+    for (data, t0, t1) in chunks:
+        decoder.decode_into(columns, data, t0, t1)
+    return columns
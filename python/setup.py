@@ -19,6 +19,7 @@ setup(name='i2cdriver',
       install_requires=['pyserial'],
       py_modules = [
         'i2cdriver',
+        'i2ccapture',
         'EDS',
       ],
       scripts=['samples/i2cgui.py'],